@@ -17,6 +17,7 @@
 #include <linux/jiffies.h>
 #include <linux/errno.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 
 #include <scsi/scsi.h>
@@ -29,6 +30,7 @@
 #include "protocol.h"
 #include "debug.h"
 #include "scsiglue.h"
+#include "freemap.h"
 
 #define SD_INIT1_FIRMWARE "ene-ub6250/sd_init1.bin"
 #define SD_INIT2_FIRMWARE "ene-ub6250/sd_init2.bin"
@@ -433,6 +435,7 @@ struct ms_lib_ctrl {
 	u16 NumberOfSegment;
 	u16 *Phy2LogMap;		/* phy2log table */
 	u16 *Log2PhyMap;		/* log2phy table */
+	struct us_freemap freemap;	/* MS_LB_NOT_USED(_ERASED) blocks */
 	u16 wrtblk;
 	unsigned char *pagemap[(MS_MAX_PAGES_PER_BLOCK + (MS_LIB_BITS_PER_BYTE-1)) / MS_LIB_BITS_PER_BYTE];
 	unsigned char *blkpag;
@@ -483,7 +486,7 @@ struct ene_ub6250_info {
 	u8		SM_CardID;
 
 	unsigned char	*testbuf;
-	u8		BIN_FLAG;
+	u8		BIN_FLAG;	/* pattern running on the reader, or 0 */
 	u32		bl_num;
 	int		SrbStatus;
 
@@ -494,6 +497,7 @@ struct ene_ub6250_info {
 static int ene_sd_init(struct us_data *us);
 static int ene_ms_init(struct us_data *us);
 static int ene_load_bincode(struct us_data *us, unsigned char flag);
+static void ene_fw_put(void);
 
 static void ene_ub6250_info_destructor(void *extra)
 {
@@ -502,6 +506,8 @@ static void ene_ub6250_info_destructor(void *extra)
 	if (!extra)
 		return;
 	kfree(info->bbuf);
+	usb_stor_freemap_free(&info->MS_Lib.freemap);
+	ene_fw_put();
 }
 
 static int ene_send_scsi_cmd(struct us_data *us, u8 fDir, void *buf, int use_sg)
@@ -751,6 +757,21 @@ static int sd_scsi_write(struct us_data *us, struct scsi_cmnd *srb)
  * ENE MS Card
  */
 
+/* Change a phy2log entry, keeping the free block index in step */
+static void ms_lib_set_phy2log(struct ene_ub6250_info *info, u16 phyblk,
+		u16 logblk)
+{
+	if (phyblk >= info->MS_Lib.NumberOfPhyBlock)
+		return;
+
+	info->MS_Lib.Phy2LogMap[phyblk] = logblk;
+	if (logblk == MS_LB_NOT_USED || logblk == MS_LB_NOT_USED_ERASED)
+		usb_stor_freemap_put(&info->MS_Lib.freemap, phyblk,
+				logblk == MS_LB_NOT_USED_ERASED);
+	else
+		usb_stor_freemap_take(&info->MS_Lib.freemap, phyblk);
+}
+
 static int ms_lib_set_logicalpair(struct us_data *us, u16 logblk, u16 phyblk)
 {
 	struct ene_ub6250_info *info = (struct ene_ub6250_info *) us->extra;
@@ -758,7 +779,7 @@ static int ms_lib_set_logicalpair(struct us_data *us, u16 logblk, u16 phyblk)
 	if ((logblk >= info->MS_Lib.NumberOfLogBlock) || (phyblk >= info->MS_Lib.NumberOfPhyBlock))
 		return (u32)-1;
 
-	info->MS_Lib.Phy2LogMap[phyblk] = logblk;
+	ms_lib_set_phy2log(info, phyblk, logblk);
 	info->MS_Lib.Log2PhyMap[logblk] = phyblk;
 
 	return 0;
@@ -771,7 +792,7 @@ static int ms_lib_set_logicalblockmark(struct us_data *us, u16 phyblk, u16 mark)
 	if (phyblk >= info->MS_Lib.NumberOfPhyBlock)
 		return (u32)-1;
 
-	info->MS_Lib.Phy2LogMap[phyblk] = mark;
+	ms_lib_set_phy2log(info, phyblk, mark);
 
 	return 0;
 }
@@ -796,6 +817,8 @@ static int ms_lib_free_logicalmap(struct us_data *us)
 	kfree(info->MS_Lib.Log2PhyMap);
 	info->MS_Lib.Log2PhyMap = NULL;
 
+	usb_stor_freemap_free(&info->MS_Lib.freemap);
+
 	return 0;
 }
 
@@ -807,13 +830,14 @@ static int ms_lib_alloc_logicalmap(struct us_data *us)
 	info->MS_Lib.Phy2LogMap = kmalloc(info->MS_Lib.NumberOfPhyBlock * sizeof(u16), GFP_KERNEL);
 	info->MS_Lib.Log2PhyMap = kmalloc(info->MS_Lib.NumberOfLogBlock * sizeof(u16), GFP_KERNEL);
 
-	if ((info->MS_Lib.Phy2LogMap == NULL) || (info->MS_Lib.Log2PhyMap == NULL)) {
+	if ((info->MS_Lib.Phy2LogMap == NULL) || (info->MS_Lib.Log2PhyMap == NULL) ||
+	    usb_stor_freemap_alloc(&info->MS_Lib.freemap, info->MS_Lib.NumberOfPhyBlock)) {
 		ms_lib_free_logicalmap(us);
 		return (u32)-1;
 	}
 
 	for (i = 0; i < info->MS_Lib.NumberOfPhyBlock; i++)
-		info->MS_Lib.Phy2LogMap[i] = MS_LB_NOT_USED;
+		ms_lib_set_phy2log(info, i, MS_LB_NOT_USED);
 
 	for (i = 0; i < info->MS_Lib.NumberOfLogBlock; i++)
 		info->MS_Lib.Log2PhyMap[i] = MS_LB_NOT_USED;
@@ -1137,7 +1161,7 @@ static int ms_lib_force_setlogical_pair(struct us_data *us, u16 logblk, u16 phyb
 		(phyblk >= info->MS_Lib.NumberOfPhyBlock))
 		return (u32)-1;
 
-	info->MS_Lib.Phy2LogMap[phyblk] = logblk;
+	ms_lib_set_phy2log(info, phyblk, logblk);
 	info->MS_Lib.Log2PhyMap[logblk] = phyblk;
 
 	return 0;
@@ -1252,7 +1276,7 @@ static int ms_lib_setacquired_errorblock(struct us_data *us, u16 phyblk)
 		info->MS_Lib.Log2PhyMap[log] = MS_LB_NOT_USED;
 
 	if (info->MS_Lib.Phy2LogMap[phyblk] != MS_LB_INITIAL_ERROR)
-		info->MS_Lib.Phy2LogMap[phyblk] = MS_LB_ACQUIRED_ERROR;
+		ms_lib_set_phy2log(info, phyblk, MS_LB_ACQUIRED_ERROR);
 
 	return 0;
 }
@@ -1319,12 +1343,12 @@ static int ms_lib_erase_phyblock(struct us_data *us, u16 phyblk)
 	if (log < info->MS_Lib.NumberOfLogBlock)
 		info->MS_Lib.Log2PhyMap[log] = MS_LB_NOT_USED;
 
-	info->MS_Lib.Phy2LogMap[phyblk] = MS_LB_NOT_USED;
+	ms_lib_set_phy2log(info, phyblk, MS_LB_NOT_USED);
 
 	if (ms_lib_iswritable(info)) {
 		switch (ms_read_eraseblock(us, phyblk)) {
 		case MS_STATUS_SUCCESS:
-			info->MS_Lib.Phy2LogMap[phyblk] = MS_LB_NOT_USED_ERASED;
+			ms_lib_set_phy2log(info, phyblk, MS_LB_NOT_USED_ERASED);
 			return MS_STATUS_SUCCESS;
 		case MS_ERROR_FLASH_ERASE:
 		case MS_STATUS_INT_ERROR:
@@ -1381,54 +1405,60 @@ static int ms_lib_read_extra(struct us_data *us, u32 PhyBlock,
 
 static int ms_libsearch_block_from_physical(struct us_data *us, u16 phyblk)
 {
-	u16 Newblk;
-	u16 blk;
+	u32 blk, from, segstart, segend;
 	struct ms_lib_type_extdat extdat; /* need check */
 	struct ene_ub6250_info *info = (struct ene_ub6250_info *) us->extra;
+	struct us_freemap *fm = &info->MS_Lib.freemap;
 
 
 	if (phyblk >= info->MS_Lib.NumberOfPhyBlock)
 		return MS_LB_ERROR;
 
-	for (blk = phyblk + 1; blk != phyblk; blk++) {
-		if ((blk & MS_PHYSICAL_BLOCKS_PER_SEGMENT_MASK) == 0)
-			blk -= MS_PHYSICAL_BLOCKS_PER_SEGMENT;
+	/* look in phyblk's segment, starting after it and wrapping around */
+	segstart = phyblk & ~MS_PHYSICAL_BLOCKS_PER_SEGMENT_MASK;
+	segend = segstart + MS_PHYSICAL_BLOCKS_PER_SEGMENT;
+	from = phyblk + 1;
 
-		Newblk = info->MS_Lib.Phy2LogMap[blk];
-		if (info->MS_Lib.Phy2LogMap[blk] == MS_LB_NOT_USED_ERASED) {
-			return blk;
-		} else if (info->MS_Lib.Phy2LogMap[blk] == MS_LB_NOT_USED) {
-			switch (ms_lib_read_extra(us, blk, 0, &extdat)) {
-			case MS_STATUS_SUCCESS:
-			case MS_STATUS_SUCCESS_WITH_ECC:
-				break;
-			case MS_NOCARD_ERROR:
-				return MS_NOCARD_ERROR;
-			case MS_STATUS_INT_ERROR:
-				return MS_LB_ERROR;
-			case MS_ERROR_FLASH_READ:
-			default:
-				ms_lib_setacquired_errorblock(us, blk);
-				continue;
-			} /* End switch */
+	/* an erased block can be used straight away */
+	blk = usb_stor_freemap_find(fm, segstart, segend, from, 1);
+	if (blk != US_FREEMAP_NONE && blk != phyblk)
+		return blk;
 
-			if ((extdat.ovrflg & MS_REG_OVR_BKST) != MS_REG_OVR_BKST_OK) {
-				ms_lib_setacquired_errorblock(us, blk);
-				continue;
-			}
+	/* otherwise erase the next unused one; bad ones drop out of the index */
+	while ((blk = usb_stor_freemap_find(fm, segstart, segend, from, 0)) !=
+			US_FREEMAP_NONE && blk != phyblk) {
+		from = blk + 1;
 
-			switch (ms_lib_erase_phyblock(us, blk)) {
-			case MS_STATUS_SUCCESS:
-				return blk;
-			case MS_STATUS_ERROR:
-				return MS_LB_ERROR;
-			case MS_ERROR_FLASH_ERASE:
-			default:
-				ms_lib_error_phyblock(us, blk);
-				break;
-			}
+		switch (ms_lib_read_extra(us, blk, 0, &extdat)) {
+		case MS_STATUS_SUCCESS:
+		case MS_STATUS_SUCCESS_WITH_ECC:
+			break;
+		case MS_NOCARD_ERROR:
+			return MS_NOCARD_ERROR;
+		case MS_STATUS_INT_ERROR:
+			return MS_LB_ERROR;
+		case MS_ERROR_FLASH_READ:
+		default:
+			ms_lib_setacquired_errorblock(us, blk);
+			continue;
+		} /* End switch */
+
+		if ((extdat.ovrflg & MS_REG_OVR_BKST) != MS_REG_OVR_BKST_OK) {
+			ms_lib_setacquired_errorblock(us, blk);
+			continue;
+		}
+
+		switch (ms_lib_erase_phyblock(us, blk)) {
+		case MS_STATUS_SUCCESS:
+			return blk;
+		case MS_STATUS_ERROR:
+			return MS_LB_ERROR;
+		case MS_ERROR_FLASH_ERASE:
+		default:
+			ms_lib_error_phyblock(us, blk);
+			break;
 		}
-	} /* End for */
+	} /* End while */
 
 	return MS_LB_ERROR;
 }
@@ -1686,16 +1716,19 @@ static int ms_scsi_read(struct us_data *us, struct scsi_cmnd *srb)
 
 		result = ene_send_scsi_cmd(us, FDIR_READ, scsi_sglist(srb), 1);
 	} else {
+		struct us_xfer_cursor cur;
 		void *buf;
-		int offset = 0;
 		u16 phyblk, logblk;
 		u8 PageNum;
 		u16 len;
 		u32 blkno;
 
-		buf = kmalloc(blenByte, GFP_KERNEL);
+		/* one block at a time goes through the bounce buffer */
+		buf = usb_stor_pool_get(us,
+				info->MS_Lib.PagesPerBlock * MS_BYTES_PER_PAGE);
 		if (buf == NULL)
 			return USB_STOR_TRANSPORT_ERROR;
+		usb_stor_cursor_start(&cur, srb, TO_XFER_BUF);
 
 		result = ene_load_bincode(us, MS_RW_PATTERN);
 		if (result != USB_STOR_XFER_GOOD) {
@@ -1728,23 +1761,25 @@ static int ms_scsi_read(struct us_data *us, struct scsi_cmnd *srb)
 			bcb->CDB[3] = (unsigned char)(blkno>>16);
 			bcb->CDB[2] = (unsigned char)(blkno>>24);
 
-			result = ene_send_scsi_cmd(us, FDIR_READ, buf+offset, 0);
+			result = ene_send_scsi_cmd(us, FDIR_READ, buf, 0);
 			if (result != USB_STOR_XFER_GOOD) {
 				pr_info("MS_SCSI_Read --- result = %x\n", result);
 				result = USB_STOR_TRANSPORT_ERROR;
 				goto exit;
 			}
+			usb_stor_cursor_copy(&cur, buf, MS_BYTES_PER_PAGE*len);
 
 			blen -= len;
 			if (blen <= 0)
 				break;
 			logblk++;
 			PageNum = 0;
-			offset += MS_BYTES_PER_PAGE*len;
 		}
-		usb_stor_set_xfer_buf(buf, blenByte, srb);
+		if (blenByte < scsi_bufflen(srb))
+			scsi_set_resid(srb, scsi_bufflen(srb) - blenByte);
 exit:
-		kfree(buf);
+		usb_stor_cursor_stop(&cur);
+		usb_stor_pool_put(us, buf);
 	}
 	return result;
 }
@@ -1787,16 +1822,19 @@ static int ms_scsi_write(struct us_data *us, struct scsi_cmnd *srb)
 
 		result = ene_send_scsi_cmd(us, FDIR_WRITE, scsi_sglist(srb), 1);
 	} else {
+		struct us_xfer_cursor cur;
 		void *buf;
-		int offset = 0;
 		u16 PhyBlockAddr;
 		u8 PageNum;
 		u16 len, oldphy, newphy;
 
-		buf = kmalloc(blenByte, GFP_KERNEL);
+		/* one block at a time goes through the bounce buffer */
+		buf = usb_stor_pool_get(us,
+				info->MS_Lib.PagesPerBlock * MS_BYTES_PER_PAGE);
 		if (buf == NULL)
 			return USB_STOR_TRANSPORT_ERROR;
-		usb_stor_set_xfer_buf(buf, blenByte, srb);
+		/* the pages to write are taken from the request */
+		usb_stor_cursor_start(&cur, srb, FROM_XFER_BUF);
 
 		result = ene_load_bincode(us, MS_RW_PATTERN);
 		if (result != USB_STOR_XFER_GOOD) {
@@ -1814,10 +1852,12 @@ static int ms_scsi_write(struct us_data *us, struct scsi_cmnd *srb)
 			else
 				len = blen;
 
+			usb_stor_cursor_copy(&cur, buf, MS_BYTES_PER_PAGE*len);
+
 			oldphy = ms_libconv_to_physical(info, PhyBlockAddr); /* need check us <-> info */
 			newphy = ms_libsearch_block_from_logical(us, PhyBlockAddr);
 
-			result = ms_read_copyblock(us, oldphy, newphy, PhyBlockAddr, PageNum, buf+offset, len);
+			result = ms_read_copyblock(us, oldphy, newphy, PhyBlockAddr, PageNum, buf, len);
 
 			if (result != USB_STOR_XFER_GOOD) {
 				pr_info("MS_SCSI_Write --- result = %x\n", result);
@@ -1825,7 +1865,7 @@ static int ms_scsi_write(struct us_data *us, struct scsi_cmnd *srb)
 				goto exit;
 			}
 
-			info->MS_Lib.Phy2LogMap[oldphy] = MS_LB_NOT_USED_ERASED;
+			ms_lib_set_phy2log(info, oldphy, MS_LB_NOT_USED_ERASED);
 			ms_lib_force_setlogical_pair(us, PhyBlockAddr, newphy);
 
 			blen -= len;
@@ -1833,10 +1873,10 @@ static int ms_scsi_write(struct us_data *us, struct scsi_cmnd *srb)
 				break;
 			PhyBlockAddr++;
 			PageNum = 0;
-			offset += MS_BYTES_PER_PAGE*len;
 		}
 exit:
-		kfree(buf);
+		usb_stor_cursor_stop(&cur);
+		usb_stor_pool_put(us, buf);
 	}
 	return result;
 }
@@ -1892,74 +1932,105 @@ static int ene_get_card_status(struct us_data *us, u8 *buf)
 	return USB_STOR_TRANSPORT_GOOD;
 }
 
+/*
+ * The firmware patterns are read from the filesystem the first time a
+ * reader needs them and then kept, in kmalloc memory that can be sent
+ * as it is, until the last reader goes away.  Every card insertion and
+ * every switch between SD and MS needs two or three of them.
+ */
+static struct ene_fw_blob {
+	const char	*name;
+	u8		*data;
+	size_t		size;
+} ene_fw_blobs[] = {
+	[SD_INIT1_PATTERN]	= { SD_INIT1_FIRMWARE },
+	[SD_INIT2_PATTERN]	= { SD_INIT2_FIRMWARE },
+	[SD_RW_PATTERN]		= { SD_RW_FIRMWARE },
+	[MS_INIT_PATTERN]	= { MS_INIT_FIRMWARE },
+	[MSP_RW_PATTERN]	= { MSP_RW_FIRMWARE },
+	[MS_RW_PATTERN]		= { MS_RW_FIRMWARE },
+};
+
+static DEFINE_MUTEX(ene_fw_mutex);	/* protects ene_fw_blobs/users */
+static unsigned int ene_fw_users;	/* readers bound to the driver */
+
+static void ene_fw_get(void)
+{
+	mutex_lock(&ene_fw_mutex);
+	ene_fw_users++;
+	mutex_unlock(&ene_fw_mutex);
+}
+
+static void ene_fw_put(void)
+{
+	int i;
+
+	mutex_lock(&ene_fw_mutex);
+	if (--ene_fw_users == 0) {
+		for (i = 0; i < ARRAY_SIZE(ene_fw_blobs); i++) {
+			kfree(ene_fw_blobs[i].data);
+			ene_fw_blobs[i].data = NULL;
+		}
+	}
+	mutex_unlock(&ene_fw_mutex);
+}
+
+/* Returns the pattern, reading it in if no reader has used it yet */
+static struct ene_fw_blob *ene_fw_lookup(struct us_data *us,
+		unsigned char flag)
+{
+	struct ene_fw_blob *blob = &ene_fw_blobs[flag];
+	const struct firmware *fw;
+
+	mutex_lock(&ene_fw_mutex);
+	if (!blob->data) {
+		if (request_firmware(&fw, blob->name, &us->pusb_dev->dev)) {
+			usb_stor_dbg(us, "load firmware %s failed\n",
+				     blob->name);
+			goto out;
+		}
+		blob->data = kmemdup(fw->data, fw->size, GFP_KERNEL);
+		blob->size = fw->size;
+		release_firmware(fw);
+	}
+ out:
+	mutex_unlock(&ene_fw_mutex);
+	return (blob->data ? blob : NULL);
+}
+
 static int ene_load_bincode(struct us_data *us, unsigned char flag)
 {
-	int err;
-	char *fw_name = NULL;
-	unsigned char *buf = NULL;
-	const struct firmware *sd_fw = NULL;
-	int result = USB_STOR_TRANSPORT_ERROR;
+	struct ene_fw_blob *blob;
+	int result;
 	struct bulk_cb_wrap *bcb = (struct bulk_cb_wrap *) us->iobuf;
 	struct ene_ub6250_info *info = (struct ene_ub6250_info *) us->extra;
 
+	/* the reader still runs it */
 	if (info->BIN_FLAG == flag)
 		return USB_STOR_TRANSPORT_GOOD;
 
-	switch (flag) {
-	/* For SD */
-	case SD_INIT1_PATTERN:
-		usb_stor_dbg(us, "SD_INIT1_PATTERN\n");
-		fw_name = SD_INIT1_FIRMWARE;
-		break;
-	case SD_INIT2_PATTERN:
-		usb_stor_dbg(us, "SD_INIT2_PATTERN\n");
-		fw_name = SD_INIT2_FIRMWARE;
-		break;
-	case SD_RW_PATTERN:
-		usb_stor_dbg(us, "SD_RW_PATTERN\n");
-		fw_name = SD_RW_FIRMWARE;
-		break;
-	/* For MS */
-	case MS_INIT_PATTERN:
-		usb_stor_dbg(us, "MS_INIT_PATTERN\n");
-		fw_name = MS_INIT_FIRMWARE;
-		break;
-	case MSP_RW_PATTERN:
-		usb_stor_dbg(us, "MSP_RW_PATTERN\n");
-		fw_name = MSP_RW_FIRMWARE;
-		break;
-	case MS_RW_PATTERN:
-		usb_stor_dbg(us, "MS_RW_PATTERN\n");
-		fw_name = MS_RW_FIRMWARE;
-		break;
-	default:
+	if (flag >= ARRAY_SIZE(ene_fw_blobs) || !ene_fw_blobs[flag].name) {
 		usb_stor_dbg(us, "----------- Unknown PATTERN ----------\n");
-		goto nofw;
+		return USB_STOR_TRANSPORT_ERROR;
 	}
+	usb_stor_dbg(us, "Loading %s\n", ene_fw_blobs[flag].name);
 
-	err = request_firmware(&sd_fw, fw_name, &us->pusb_dev->dev);
-	if (err) {
-		usb_stor_dbg(us, "load firmware %s failed\n", fw_name);
-		goto nofw;
-	}
-	buf = kmemdup(sd_fw->data, sd_fw->size, GFP_KERNEL);
-	if (buf == NULL)
-		goto nofw;
+	blob = ene_fw_lookup(us, flag);
+	if (!blob)
+		return USB_STOR_TRANSPORT_ERROR;
 
 	memset(bcb, 0, sizeof(struct bulk_cb_wrap));
 	bcb->Signature = cpu_to_le32(US_BULK_CB_SIGN);
-	bcb->DataTransferLength = sd_fw->size;
+	bcb->DataTransferLength = blob->size;
 	bcb->Flags = 0x00;
 	bcb->CDB[0] = 0xEF;
 
-	result = ene_send_scsi_cmd(us, FDIR_WRITE, buf, 0);
+	result = ene_send_scsi_cmd(us, FDIR_WRITE, blob->data, 0);
 	if (us->srb != NULL)
 		scsi_set_resid(us->srb, 0);
-	info->BIN_FLAG = flag;
-	kfree(buf);
 
-nofw:
-	release_firmware(sd_fw);
+	/* after a failed upload nobody knows what the reader runs */
+	info->BIN_FLAG = (result == USB_STOR_XFER_GOOD ? flag : 0);
 	return result;
 }
 
@@ -2044,15 +2115,15 @@ static int ms_card_init(struct us_data *us)
 	}
 
 	for (TmpBlock = 0; TmpBlock < btBlk1st; TmpBlock++)
-		info->MS_Lib.Phy2LogMap[TmpBlock] = MS_LB_INITIAL_ERROR;
+		ms_lib_set_phy2log(info, TmpBlock, MS_LB_INITIAL_ERROR);
 
-	info->MS_Lib.Phy2LogMap[btBlk1st] = MS_LB_BOOT_BLOCK;
+	ms_lib_set_phy2log(info, btBlk1st, MS_LB_BOOT_BLOCK);
 
 	if (btBlk2nd != MS_LB_NOT_USED) {
 		for (TmpBlock = btBlk1st + 1; TmpBlock < btBlk2nd; TmpBlock++)
-			info->MS_Lib.Phy2LogMap[TmpBlock] = MS_LB_INITIAL_ERROR;
+			ms_lib_set_phy2log(info, TmpBlock, MS_LB_INITIAL_ERROR);
 
-		info->MS_Lib.Phy2LogMap[btBlk2nd] = MS_LB_BOOT_BLOCK;
+		ms_lib_set_phy2log(info, btBlk2nd, MS_LB_BOOT_BLOCK);
 	}
 
 	result = ms_lib_scan_logicalblocknumber(us, btBlk1st);
@@ -2074,6 +2145,10 @@ static int ms_card_init(struct us_data *us)
 		goto exit;
 	}
 
+	/* block bounce buffer for the reads and writes */
+	usb_stor_pool_reserve(us, 0,
+			info->MS_Lib.PagesPerBlock * MS_BYTES_PER_PAGE);
+
 	result = MS_STATUS_SUCCESS;
 
 exit:
@@ -2207,6 +2282,7 @@ static int ene_init(struct us_data *us)
 {
 	int result;
 	u8  misc_reg03;
+	unsigned long start;
 	struct ene_ub6250_info *info = (struct ene_ub6250_info *)(us->extra);
 	u8 *bbuf = info->bbuf;
 
@@ -2217,16 +2293,22 @@ static int ene_init(struct us_data *us)
 	misc_reg03 = bbuf[0];
 	if (misc_reg03 & 0x01) {
 		if (!info->SD_Status.Ready) {
+			start = jiffies;
 			result = ene_sd_init(us);
 			if (result != USB_STOR_XFER_GOOD)
 				return USB_STOR_TRANSPORT_ERROR;
+			usb_stor_dbg(us, "SD card ready in %u ms\n",
+				     jiffies_to_msecs(jiffies - start));
 		}
 	}
 	if (misc_reg03 & 0x02) {
 		if (!info->MS_Status.Ready) {
+			start = jiffies;
 			result = ene_ms_init(us);
 			if (result != USB_STOR_XFER_GOOD)
 				return USB_STOR_TRANSPORT_ERROR;
+			usb_stor_dbg(us, "MS card ready in %u ms\n",
+				     jiffies_to_msecs(jiffies - start));
 		}
 	}
 	return result;
@@ -2354,6 +2436,7 @@ static int ene_ub6250_probe(struct usb_interface *intf,
 		kfree(us->extra);
 		return -ENOMEM;
 	}
+	ene_fw_get();
 
 	us->transport_name = "ene_ub6250";
 	us->transport = ene_transport;
@@ -2416,6 +2499,7 @@ static int ene_ub6250_reset_resume(struct usb_interface *iface)
 	/* FIXME: Notify the subdrivers that they need to reinitialize
 	 * the device */
 	info->Power_IsResum = true;
+	info->BIN_FLAG = 0;
 	/*info->SD_Status.Ready = 0; */
 	info->SD_Status = *(struct SD_STATUS *)&tmp;
 	info->MS_Status = *(struct MS_STATUS *)&tmp;
@@ -2431,6 +2515,17 @@ static int ene_ub6250_reset_resume(struct usb_interface *iface)
 
 #endif
 
+static int ene_ub6250_post_reset(struct usb_interface *iface)
+{
+	struct us_data *us = usb_get_intfdata(iface);
+	struct ene_ub6250_info *info = (struct ene_ub6250_info *)(us->extra);
+
+	/* The reset took the loaded pattern with it */
+	if (info)
+		info->BIN_FLAG = 0;
+	return usb_stor_post_reset(iface);
+}
+
 static struct usb_driver ene_ub6250_driver = {
 	.name =		DRV_NAME,
 	.probe =	ene_ub6250_probe,
@@ -2439,7 +2534,7 @@ static struct usb_driver ene_ub6250_driver = {
 	.resume =	ene_ub6250_resume,
 	.reset_resume =	ene_ub6250_reset_resume,
 	.pre_reset =	usb_stor_pre_reset,
-	.post_reset =	usb_stor_post_reset,
+	.post_reset =	ene_ub6250_post_reset,
 	.id_table =	ene_ub6250_usb_ids,
 	.soft_unbind =	1,
 	.no_dynamic_id = 1,
@@ -9,6 +9,7 @@
  */
 
 #include <linux/version.h>
+#include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/slab.h>
 #include <linux/types.h>
@@ -20,6 +21,7 @@
 #include "../core/hcd.h"
 #endif
 #include <linux/usb_usual.h>
+#include <linux/workqueue.h>
 
 #include <scsi/scsi_dbg.h>
 #include <scsi/scsi_device.h>
@@ -37,6 +39,24 @@ MODULE_DESCRIPTION(DRIVER_DESCRIPTION);
 MODULE_AUTHOR(DRIVER_AUTHOR);
 MODULE_LICENSE("GPL");
 
+static unsigned int quiesce_errors = 3;
+module_param(quiesce_errors, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(quiesce_errors,
+		"failed commands within quiesce_window_ms before all commands are failed (1 = on the first error)");
+
+static unsigned int quiesce_window_ms = 1000;
+module_param(quiesce_window_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(quiesce_window_ms, "window in ms over which quiesce_errors is counted");
+
+
+/*
+ * Stream IDs run from 1 to the number of streams the host controller
+ * allocated, which is at most this many.
+ */
+#define UAS_MAX_AVAILABLE_STREAMS	256
+
+/* How long to wait for the RESPONSE IU of an ABORT TASK */
+#define UAS_ABORT_TIMEOUT		(2 * HZ)
 
 /* Overrides scsi_pointer */
 struct uas_cmd_info {
@@ -56,6 +76,7 @@ enum {
 	COMMAND_INFLIGHT	= (1 << 3),
 	DATA_INFLIGHT		= (1 << 4),
 	COMMAND_ERROR		= (1 << 5),
+	STREAM_ERROR		= (1 << 6),
 };
 
 struct uas_dev_info {
@@ -75,14 +96,29 @@ struct uas_dev_info {
 	struct list_head busy_list;
 
 	spinlock_t lock;
-	unsigned long stream_id_bitmap;
+	DECLARE_BITMAP(stream_id_bitmap, UAS_MAX_AVAILABLE_STREAMS + 1);
 	int total_stream_ids;
 	int available_stream_ids;
 	int next_available_stream_id;
 	struct scsi_cmnd *untagged;
 
+	/* IDs of failed streams, held until aborted, see abort_work_fn() */
+	DECLARE_BITMAP(stale_stream_ids, UAS_MAX_AVAILABLE_STREAMS + 1);
+	u16 stale_lun[UAS_MAX_AVAILABLE_STREAMS + 1];
+	struct delayed_work abort_work;
+
 	unsigned long flags;
 	unsigned long quirks;
+
+	/* transfer errors, see transfer_urb_completion() */
+	unsigned long error_window;
+	unsigned int window_errors;
+	unsigned long urb_errors;
+	unsigned long isolated_errors;
+	unsigned long quiesce_count;
+	unsigned long quiesce_rejects;
+	unsigned long stream_aborts;
+	unsigned long abort_resets;
 };
 
 #define UAS_FLAG_QUIESCING	0
@@ -108,7 +144,6 @@ struct uas_dev_info {
 #define UAS_PROTOCOL_BULK	0x50
 #define UAS_PROTOCOL_UAS	0x62
 
-#define UAS_MAX_AVAILABLE_STREAMS	16
 #define UAS_INVALID_STREAM_ID		0
 #define CIU_TAG_UNTAGGED	1
 #define CIU_TAG_OFFSET		2
@@ -135,52 +170,68 @@ extern void usb_run_bot_mode_notification(struct usb_device *hdev,
 
 static void initialize_stream_id(struct uas_dev_info *devinfo)
 {
-	devinfo->stream_id_bitmap = 0;
+	bitmap_zero(devinfo->stream_id_bitmap, UAS_MAX_AVAILABLE_STREAMS + 1);
+	bitmap_zero(devinfo->stale_stream_ids, UAS_MAX_AVAILABLE_STREAMS + 1);
+	/* stream 0 is never handed out */
+	__set_bit(UAS_INVALID_STREAM_ID, devinfo->stream_id_bitmap);
 	devinfo->available_stream_ids = devinfo->total_stream_ids;
 	devinfo->next_available_stream_id = 1;
 }
 
+/*
+ * IDs are handed out round robin from next_available_stream_id so that a
+ * stream is not reused right after it completed, but the search is a
+ * single find_next_zero_bit() (plus one from the start on wrap) instead
+ * of probing every ID in turn.
+ */
 static int acquire_stream_id(struct uas_dev_info *devinfo)
 {
-	int stream_id = UAS_INVALID_STREAM_ID;
+	int size = devinfo->total_stream_ids + 1;
+	int stream_id;
 
-	if (--devinfo->available_stream_ids >= 0) {
-		int retry = devinfo->total_stream_ids;
-
-		while (retry-- > 0) {
-			if (!test_bit(devinfo->next_available_stream_id, &devinfo->stream_id_bitmap)) {
-				__set_bit(devinfo->next_available_stream_id, &devinfo->stream_id_bitmap);
-				stream_id = devinfo->next_available_stream_id;
-			}
-
-			if (++devinfo->next_available_stream_id > devinfo->total_stream_ids) {
-				devinfo->next_available_stream_id = 1;
-			}
-
-			if (UAS_INVALID_STREAM_ID != stream_id) {
-				break;
-			}
-		}
+	if (devinfo->available_stream_ids <= 0) {
+		return UAS_INVALID_STREAM_ID;
+	}
 
-		if (UAS_INVALID_STREAM_ID == stream_id) {
-			devinfo->available_stream_ids++;
+	stream_id = find_next_zero_bit(devinfo->stream_id_bitmap, size,
+			devinfo->next_available_stream_id);
+	if (stream_id >= size) {
+		stream_id = find_next_zero_bit(devinfo->stream_id_bitmap, size, 1);
+		if (stream_id >= size) {
+			return UAS_INVALID_STREAM_ID;
 		}
 	}
-	else {
-		devinfo->available_stream_ids++;
-	}
+
+	__set_bit(stream_id, devinfo->stream_id_bitmap);
+	devinfo->available_stream_ids--;
+	devinfo->next_available_stream_id = (stream_id + 1 < size) ? stream_id + 1 : 1;
 
 	return stream_id;
 }
 
 static void release_stream_id(struct uas_dev_info *devinfo, int stream_id)
 {
-	if (stream_id <= devinfo->total_stream_ids) {
-		__clear_bit(stream_id, &devinfo->stream_id_bitmap);
+	if (stream_id > UAS_INVALID_STREAM_ID && stream_id <= devinfo->total_stream_ids &&
+			__test_and_clear_bit(stream_id, devinfo->stream_id_bitmap)) {
 		devinfo->available_stream_ids++;
 	}
 }
 
+/*
+ * The command on stream_id failed, but the device may still send its
+ * data or status.  Keep the ID allocated, so that nothing late can be
+ * taken for the next command on it, until an ABORT TASK for it has
+ * succeeded or the device has been reset.
+ */
+static void hold_stream_id(struct uas_dev_info *devinfo, int stream_id, u64 lun)
+{
+	if (stream_id > UAS_INVALID_STREAM_ID && stream_id <= devinfo->total_stream_ids) {
+		__set_bit(stream_id, devinfo->stale_stream_ids);
+		devinfo->stale_lun[stream_id] = lun;
+		schedule_delayed_work(&devinfo->abort_work, 0);
+	}
+}
+
 static int configure_endpoints(struct uas_dev_info *devinfo)
 {
 	struct usb_interface *intf = devinfo->intf;
@@ -234,7 +285,7 @@ static int configure_endpoints(struct uas_dev_info *devinfo)
 		}
 		else {
 			dev_info(&udev->dev, "%s: Streams allocated = %d\n", __func__, ret);
-			devinfo->total_stream_ids = ret;
+			devinfo->total_stream_ids = min(ret, max_streams);
 			if (!(devinfo->quirks & UAS_QUIRK_ONE_STREAM_ID)) {
 				initialize_stream_id(devinfo);
 			}
@@ -520,13 +571,223 @@ static int scsi_command_completion(struct scsi_cmnd *cmnd)
 	}
 
 	if (!(devinfo->quirks & UAS_QUIRK_ONE_STREAM_ID)) {
-		release_stream_id(devinfo, cmdinfo->stream_id);
+		if (cmdinfo->state & STREAM_ERROR) {
+			hold_stream_id(devinfo, cmdinfo->stream_id, cmnd->device->lun);
+		}
+		else {
+			release_stream_id(devinfo, cmdinfo->stream_id);
+		}
 	}
 
 	cmnd->scsi_done(cmnd);
 	return 0;
 }
 
+/* The status stage of cmnd is over: take it off busy_list */
+static void retire_command(struct scsi_cmnd *cmnd)
+{
+	struct uas_dev_info *devinfo = scmnd_to_devinfo(cmnd);
+	struct uas_cmd_info *cmdinfo = scmnd_to_cmdinfo(cmnd);
+
+	if (devinfo->untagged == cmnd) {
+		devinfo->untagged = NULL;
+	}
+
+	list_del_init(&cmdinfo->list);
+	if (list_empty(&devinfo->busy_list)) {
+		wake_up(&devinfo->wait);
+	}
+
+	cmdinfo->state &= ~COMMAND_INFLIGHT;
+}
+
+/*
+ * Count a failed command and tell whether the device as a whole looks
+ * broken, i.e. quiesce_errors commands failed within quiesce_window_ms.
+ */
+static bool stream_error_escalates(struct uas_dev_info *devinfo)
+{
+	if (!devinfo->window_errors ||
+			time_after(jiffies, devinfo->error_window + msecs_to_jiffies(quiesce_window_ms))) {
+		devinfo->error_window = jiffies;
+		devinfo->window_errors = 0;
+	}
+
+	return ++devinfo->window_errors >= quiesce_errors;
+}
+
+/*
+ * A transfer on one stream failed.  Fail just that command with
+ * DID_ERROR so the midlayer retries it, and unlink its other URB.  Once
+ * both have come back the stream ID is held until abort_work_fn() has
+ * aborted the task.  Called and returns with devinfo->lock held, but
+ * drops it around the unlink.
+ */
+static void fail_stream_command(struct urb *urb)
+{
+	struct scsi_cmnd *cmnd = urb->context;
+	struct uas_dev_info *devinfo = scmnd_to_devinfo(cmnd);
+	struct uas_cmd_info *cmdinfo = scmnd_to_cmdinfo(cmnd);
+	bool is_siu = (urb == cmdinfo->siu_urb);
+	struct urb *other = (is_siu) ? cmdinfo->data_urb : cmdinfo->siu_urb;
+
+	if (!(cmdinfo->state & STREAM_ERROR)) {
+		cmdinfo->state |= STREAM_ERROR;
+		cmnd->result = DID_ERROR << 16;
+		devinfo->isolated_errors++;
+
+		if (cmdinfo->state & ((is_siu) ? DATA_INFLIGHT : COMMAND_INFLIGHT)) {
+			spin_unlock(&devinfo->lock);
+			usb_unlink_urb(other);
+			spin_lock(&devinfo->lock);
+		}
+	}
+
+	if (is_siu) {
+		retire_command(cmnd);
+	}
+	else {
+		cmdinfo->state &= ~DATA_INFLIGHT;
+	}
+}
+
+static void abort_urb_completion(struct urb *urb)
+{
+	complete(urb->context);
+}
+
+/*
+ * Send ABORT TASK for the task tagged task_tag, using tag for the TMF
+ * itself, and wait for its RESPONSE IU.  Returns 0 if the device says
+ * the task is gone.
+ */
+static int abort_task(struct uas_dev_info *devinfo, int tag, int task_tag, u64 lun)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct task_mgmt_iu *tmf = NULL;
+	struct response_iu *riu = NULL;
+	struct urb *tmf_urb = NULL;
+	struct urb *riu_urb = NULL;
+	int ret = -ENOMEM;
+
+	tmf = kzalloc(sizeof(*tmf), GFP_NOIO);
+	riu = kzalloc(sizeof(struct sense_iu), GFP_NOIO);
+	tmf_urb = usb_alloc_urb(0, GFP_NOIO);
+	riu_urb = usb_alloc_urb(0, GFP_NOIO);
+	if (NULL == tmf || NULL == riu || NULL == tmf_urb || NULL == riu_urb) {
+		goto free;
+	}
+
+	usb_fill_bulk_urb(riu_urb, devinfo->udev, devinfo->status_pipe,
+			riu, sizeof(struct sense_iu), abort_urb_completion, &done);
+	riu_urb->stream_id = tag;
+	usb_anchor_urb(riu_urb, &devinfo->sense_urbs);
+	ret = usb_submit_urb(riu_urb, GFP_NOIO);
+	if (ret < 0) {
+		usb_unanchor_urb(riu_urb);
+		goto free;
+	}
+
+	tmf->iu_id = IU_ID_TASK_MGMT;
+	tmf->tag = cpu_to_be16(tag);
+	tmf->function = TMF_ABORT_TASK;
+	tmf->task_tag = cpu_to_be16(task_tag);
+	int_to_scsilun(lun, &tmf->lun);
+	usb_fill_bulk_urb(tmf_urb, devinfo->udev, devinfo->cmd_pipe,
+			tmf, sizeof(*tmf), usb_free_urb, NULL);
+	tmf_urb->transfer_flags |= URB_FREE_BUFFER;
+	usb_anchor_urb(tmf_urb, &devinfo->cmd_urbs);
+	ret = usb_submit_urb(tmf_urb, GFP_NOIO);
+	if (ret < 0) {
+		usb_unanchor_urb(tmf_urb);
+		usb_kill_urb(riu_urb);
+		goto free;
+	}
+	/* the URB frees itself and the IU */
+	tmf_urb = NULL;
+	tmf = NULL;
+
+	if (!wait_for_completion_timeout(&done, UAS_ABORT_TIMEOUT)) {
+		usb_kill_urb(riu_urb);
+	}
+
+	ret = -EIO;
+	if (0 == riu_urb->status && IU_ID_RESPONSE == riu->iu_id &&
+			be16_to_cpu(riu->tag) == tag &&
+			(RC_TMF_COMPLETE == riu->response_code ||
+			 RC_TMF_SUCCEEDED == riu->response_code)) {
+		ret = 0;
+	}
+
+free:
+	usb_free_urb(riu_urb);
+	usb_free_urb(tmf_urb);
+	kfree(riu);
+	kfree(tmf);
+	return ret;
+}
+
+/*
+ * Abort the tasks of the held stream IDs one at a time and give the IDs
+ * back.  If the device does not confirm an abort, nothing can tell its
+ * late data for that stream from the next command's, so the device is
+ * reset, which gives all IDs back.
+ */
+static void abort_work_fn(struct work_struct *work)
+{
+	struct uas_dev_info *devinfo = container_of(work, struct uas_dev_info, abort_work.work);
+	unsigned long flags;
+	int stream_id, tag;
+	u64 lun;
+
+	for (;;) {
+		spin_lock_irqsave(&devinfo->lock, flags);
+		if (test_bit(UAS_FLAG_DISCONNECTING, &devinfo->flags) ||
+				test_bit(UAS_FLAG_RESETTING, &devinfo->flags)) {
+			spin_unlock_irqrestore(&devinfo->lock, flags);
+			return;
+		}
+
+		stream_id = find_next_bit(devinfo->stale_stream_ids, devinfo->total_stream_ids + 1, 1);
+		if (stream_id > devinfo->total_stream_ids) {
+			spin_unlock_irqrestore(&devinfo->lock, flags);
+			return;
+		}
+
+		/* every ID is in use: try again once some have completed */
+		tag = acquire_stream_id(devinfo);
+		if (UAS_INVALID_STREAM_ID == tag) {
+			spin_unlock_irqrestore(&devinfo->lock, flags);
+			schedule_delayed_work(&devinfo->abort_work, HZ / 10);
+			return;
+		}
+		lun = devinfo->stale_lun[stream_id];
+		spin_unlock_irqrestore(&devinfo->lock, flags);
+
+		if (abort_task(devinfo, tag, stream_id, lun) < 0) {
+			spin_lock_irqsave(&devinfo->lock, flags);
+			release_stream_id(devinfo, tag);
+			spin_unlock_irqrestore(&devinfo->lock, flags);
+
+			if (!test_bit(UAS_FLAG_DISCONNECTING, &devinfo->flags) &&
+					!test_bit(UAS_FLAG_RESETTING, &devinfo->flags)) {
+				shost_printk(KERN_INFO, devinfo->shost, "ABORT TASK for tag %d failed, resetting\n", stream_id);
+				devinfo->abort_resets++;
+				usb_queue_reset_device(devinfo->intf);
+			}
+			return;
+		}
+
+		spin_lock_irqsave(&devinfo->lock, flags);
+		release_stream_id(devinfo, tag);
+		if (__test_and_clear_bit(stream_id, devinfo->stale_stream_ids)) {
+			release_stream_id(devinfo, stream_id);
+			devinfo->stream_aborts++;
+		}
+		spin_unlock_irqrestore(&devinfo->lock, flags);
+	}
+}
+
 static void transfer_urb_completion(struct urb *urb)
 {
 	struct scsi_cmnd *cmnd = urb->context;
@@ -561,16 +822,7 @@ static void transfer_urb_completion(struct urb *urb)
 				spin_lock(&devinfo->lock);
 			}
 
-			if (devinfo->untagged == cmnd) {
-				devinfo->untagged = NULL;
-			}
-
-			list_del_init(&cmdinfo->list);
-			if (list_empty(&devinfo->busy_list)) {
-				wake_up(&devinfo->wait);
-			}
-
-			cmdinfo->state &= ~COMMAND_INFLIGHT;
+			retire_command(cmnd);
 		}
 		else {
 			scsi_set_resid(cmnd, scsi_bufflen(cmnd) - urb->actual_length);
@@ -579,9 +831,18 @@ static void transfer_urb_completion(struct urb *urb)
 		break;
 
 	case -ECONNRESET:
+		/* already failed along with the whole queue */
+		if (cmdinfo->state & COMMAND_ERROR) {
+			spin_unlock(&devinfo->lock);
+			return;
+		}
+
 		if (urb == cmdinfo->data_urb) {
 			cmdinfo->state &= ~DATA_INFLIGHT;
 		}
+		else {
+			retire_command(cmnd);
+		}
 		break;
 
 	case -ENOENT:
@@ -611,8 +872,19 @@ static void transfer_urb_completion(struct urb *urb)
 
 	default:
 		scmd_printk(KERN_DEBUG, cmnd, "Bad URB status (%d) received\n", urb->status);
-		if (!test_bit(UAS_FLAG_QUIESCING, &devinfo->flags)) {
-			set_bit(UAS_FLAG_QUIESCING, &devinfo->flags);
+		devinfo->urb_errors++;
+		/* without a spare tag for ABORT TASK, a failed stream can't be isolated */
+		if (!test_bit(UAS_FLAG_QUIESCING, &devinfo->flags) &&
+				!(devinfo->quirks & UAS_QUIRK_ONE_STREAM_ID) &&
+				((cmdinfo->state & STREAM_ERROR) || !stream_error_escalates(devinfo))) {
+			fail_stream_command(urb);
+			break;
+		}
+
+		if (!test_and_set_bit(UAS_FLAG_QUIESCING, &devinfo->flags)) {
+			scmd_printk(KERN_INFO, cmnd, "%u transfer errors, failing all commands until reset\n",
+					devinfo->window_errors);
+			devinfo->quiesce_count++;
 			list_for_each_entry(cmdinfo, &devinfo->busy_list, list) {
 				cmdinfo->state &= ~(DATA_INFLIGHT | COMMAND_INFLIGHT);
 				cmdinfo->state |= COMMAND_ERROR;
@@ -856,6 +1128,7 @@ static int prev_queue_command(struct scsi_cmnd *cmnd)
 
 	if (test_bit(UAS_FLAG_QUIESCING, &devinfo->flags)) {
 		scmd_printk(KERN_DEBUG, cmnd, "Fail cmd:%p (%02X) during transfer error\n", cmnd, cmnd->cmnd[0]);
+		devinfo->quiesce_rejects++;
 		cmnd->result = DID_ERROR << 16;
 		return 0;
 	}
@@ -894,14 +1167,15 @@ static void log_scsi_command_state(struct scsi_cmnd *cmnd)
 {
 	struct uas_cmd_info *cmdinfo = scmnd_to_cmdinfo(cmnd);
 
-	scmd_printk(KERN_INFO, cmnd, "Log tag:%d, inflight:%s%s%s%s%s%s ",
+	scmd_printk(KERN_INFO, cmnd, "Log tag:%d, inflight:%s%s%s%s%s%s%s ",
 			cmdinfo->stream_id,
 			(cmdinfo->state & SUBMIT_SIU_URB)		? " S-SIU"	: "",
 			(cmdinfo->state & SUBMIT_DATA_URB)		? " S-DATA"	: "",
 			(cmdinfo->state & SUBMIT_CIU_URB)		? " S-CIU"	: "",
 			(cmdinfo->state & DATA_INFLIGHT)		? " DATA"	: "",
 			(cmdinfo->state & COMMAND_INFLIGHT) 	? " CMD"	: "",
-			(cmdinfo->state & COMMAND_ERROR)	 	? " ERROR"	: "");
+			(cmdinfo->state & COMMAND_ERROR)	 	? " ERROR"	: "",
+			(cmdinfo->state & STREAM_ERROR)		? " STREAM"	: "");
 	scsi_print_command(cmnd);
 }
 
@@ -1073,6 +1347,7 @@ static int scsi_reset_bus_handler(struct scsi_cmnd *cmnd)
 	}
 	else {
 		clear_bit(UAS_FLAG_QUIESCING, &devinfo->flags);
+		devinfo->window_errors = 0;
 		set_bit(UAS_FLAG_RESETTING, &devinfo->flags);
 		usb_kill_anchored_urbs(&devinfo->cmd_urbs);
 		usb_kill_anchored_urbs(&devinfo->data_urbs);
@@ -1096,6 +1371,47 @@ static int scsi_reset_bus_handler(struct scsi_cmnd *cmnd)
 	return FAILED;
 }
 
+static ssize_t stream_depth_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct uas_dev_info *devinfo = to_scsi_device(dev)->hostdata;
+	unsigned long flags;
+	int depth, in_use;
+
+	spin_lock_irqsave(&devinfo->lock, flags);
+	if (IS_ONE_COMMAND_ONLY(devinfo->quirks)) {
+		depth = 1;
+		in_use = (NULL != devinfo->untagged);
+	}
+	else {
+		depth = devinfo->total_stream_ids;
+		in_use = depth - devinfo->available_stream_ids;
+	}
+	spin_unlock_irqrestore(&devinfo->lock, flags);
+
+	return sprintf(buf, "depth %d in_use %d\n", depth, in_use);
+}
+static DEVICE_ATTR_RO(stream_depth);
+
+static ssize_t error_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct uas_dev_info *devinfo = to_scsi_device(dev)->hostdata;
+
+	return sprintf(buf, "urb_errors %lu\nisolated %lu\nquiesced %lu\nrejected %lu\n"
+			"aborted %lu\nabort_resets %lu\n",
+			devinfo->urb_errors, devinfo->isolated_errors,
+			devinfo->quiesce_count, devinfo->quiesce_rejects,
+			devinfo->stream_aborts, devinfo->abort_resets);
+}
+static DEVICE_ATTR_RO(error_stats);
+
+static struct device_attribute *uas_sdev_attrs[] = {
+	&dev_attr_stream_depth,
+	&dev_attr_error_stats,
+	NULL,
+};
+
 static struct scsi_host_template uas_host_template = {
 	.name		= "etuas",
 	.module		= THIS_MODULE,
@@ -1117,6 +1433,7 @@ static struct scsi_host_template uas_host_template = {
 	.queuecommand			= scsi_queue_command,
 	.eh_abort_handler		= scsi_abort_handler,
 	.eh_bus_reset_handler	= scsi_reset_bus_handler,
+	.sdev_attrs				= uas_sdev_attrs,
 };
 
 
@@ -1150,6 +1467,7 @@ static int probe_device(struct usb_interface *intf, const struct usb_device_id *
 	init_usb_anchor(&devinfo->sense_urbs);
 	init_usb_anchor(&devinfo->data_urbs);
 	init_waitqueue_head(&devinfo->wait);
+	INIT_DELAYED_WORK(&devinfo->abort_work, abort_work_fn);
 	adjust_device_quirks(devinfo, id);
 	ret = configure_endpoints(devinfo);
 	if (ret < 0) {
@@ -1199,6 +1517,7 @@ static void disconnect_device(struct usb_interface *intf)
 	usb_kill_anchored_urbs(&devinfo->cmd_urbs);
 	usb_kill_anchored_urbs(&devinfo->data_urbs);
 	usb_kill_anchored_urbs(&devinfo->sense_urbs);
+	cancel_delayed_work_sync(&devinfo->abort_work);
 
 	scsi_remove_host(devinfo->shost);
 
@@ -1216,6 +1535,9 @@ static int prev_reset_device(struct usb_interface *intf)
 
 	setup_device_options(intf, UAS_STATE_PREV_RESET);
 
+	/* The reset gives the held stream IDs back */
+	cancel_delayed_work_sync(&devinfo->abort_work);
+
 	/* Block new requests */
 	spin_lock_irqsave(shost->host_lock, flags);
 	scsi_block_requests(shost);
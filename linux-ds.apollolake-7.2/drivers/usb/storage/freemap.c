@@ -0,0 +1,88 @@
+/* Driver for USB Mass Storage compliant devices
+ * Free Block Index
+ *
+ * The SmartMedia, xD and MemoryStick subdrivers do their own flash
+ * translation and need a free physical block in the right zone or
+ * segment for every block they rewrite.  Scanning the physical to
+ * logical map for one costs a pass over the zone on every write, which
+ * adds up on large cards that are nearly full.
+ *
+ * Instead, the subdrivers keep a bitmap of the free blocks next to their
+ * maps, and a second one of the free blocks that are known to be erased,
+ * updating both whenever a block is assigned, released, retired or
+ * marked bad.  Finding a free block is then a find_next_bit() over a
+ * few words.  Like the maps, the bitmaps are only touched by the
+ * command being run and need no locking.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/bitmap.h>
+#include <linux/errno.h>
+#include <linux/export.h>
+#include <linux/slab.h>
+
+#include "freemap.h"
+
+/* Set up an index of blocks blocks, all of them in use to begin with */
+int usb_stor_freemap_alloc(struct us_freemap *fm, unsigned int blocks)
+{
+	usb_stor_freemap_free(fm);
+
+	fm->free = kcalloc(BITS_TO_LONGS(blocks), sizeof(long), GFP_NOIO);
+	fm->erased = kcalloc(BITS_TO_LONGS(blocks), sizeof(long), GFP_NOIO);
+	if (!fm->free || !fm->erased) {
+		usb_stor_freemap_free(fm);
+		return -ENOMEM;
+	}
+	fm->blocks = blocks;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_freemap_alloc);
+
+void usb_stor_freemap_free(struct us_freemap *fm)
+{
+	kfree(fm->free);
+	kfree(fm->erased);
+	fm->free = NULL;
+	fm->erased = NULL;
+	fm->blocks = 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_freemap_free);
+
+/*
+ * Find a free block (an erased one if erased is set) in [start, end),
+ * looking from block from up to the end and then from start onwards.
+ * Returns US_FREEMAP_NONE if there is none.
+ */
+unsigned int usb_stor_freemap_find(struct us_freemap *fm,
+		unsigned int start, unsigned int end, unsigned int from,
+		int erased)
+{
+	unsigned long *map = erased ? fm->erased : fm->free;
+	unsigned int block;
+
+	if (end > fm->blocks)
+		end = fm->blocks;
+	if (start >= end)
+		return US_FREEMAP_NONE;
+	if (from < start || from >= end)
+		from = start;
+
+	block = find_next_bit(map, end, from);
+	if (block < end)
+		return block;
+	block = find_next_bit(map, from, start);
+	if (block < from)
+		return block;
+	return US_FREEMAP_NONE;
+}
+EXPORT_SYMBOL_GPL(usb_stor_freemap_find);
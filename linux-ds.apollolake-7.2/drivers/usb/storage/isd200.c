@@ -48,8 +48,11 @@
 #include <linux/slab.h>
 #include <linux/ata.h>
 #include <linux/hdreg.h>
+#include <linux/log2.h>
 #include <linux/scatterlist.h>
 
+#include <asm/unaligned.h>
+
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
 #include <scsi/scsi_device.h>
@@ -66,6 +69,10 @@ MODULE_DESCRIPTION("Driver for In-System Design, Inc. ISD200 ASIC");
 MODULE_AUTHOR("Björn Stenberg <bjorn@haxx.se>");
 MODULE_LICENSE("GPL");
 
+static bool multiple = 1;
+module_param(multiple, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(multiple, "use READ/WRITE MULTIPLE when the drive can");
+
 static int isd200_Initialization(struct us_data *us);
 
 
@@ -117,6 +124,7 @@ static struct us_unusual_dev isd200_unusual_dev_list[] = {
 #define DF_ATA_DEVICE		0x0001
 #define DF_MEDIA_STATUS_ENABLED	0x0002
 #define DF_REMOVABLE_MEDIA	0x0004
+#define DF_LBA48		0x0008
 
 /* capability bit definitions */
 #define CAPABILITY_DMA		0x01
@@ -194,6 +202,8 @@ static struct us_unusual_dev isd200_unusual_dev_list[] = {
 #define	ACTION_SOFT_RESET	3
 #define	ACTION_ENUM		4
 #define	ACTION_IDENTIFY		5
+#define	ACTION_SET_MULTIPLE	6
+#define	ACTION_WRITE_HOB	7
 
 
 /*
@@ -335,6 +345,15 @@ struct isd200_info {
 	unsigned char DeviceHead;
 	unsigned char DeviceFlags;
 
+	/* sectors per DRQ block for READ/WRITE MULTIPLE, 0 if not set */
+	unsigned char MultCount;
+	/* set after a reset, which puts the drive back to its default */
+	unsigned char MultPending;
+
+	/* upper count and LBA bytes, loaded before a 48-bit command */
+	unsigned char HobRegs[4];
+	unsigned char HobPending;
+
 	/* maximum number of LUNs supported */
 	unsigned char MaxLUNs;
 	unsigned char cmnd[BLK_MAX_CDB];
@@ -558,6 +577,33 @@ static int isd200_action( struct us_data *us, int action,
 				ATA_ID_WORDS * 2);
 		break;
 
+	case ACTION_SET_MULTIPLE:
+		usb_stor_dbg(us, "   isd200_action(SET_MULTIPLE,%d)\n", value);
+		ata.generic.RegisterSelect = REG_SECTOR_COUNT | REG_COMMAND;
+		ata.write.SectorCountByte = value;
+		ata.write.CommandByte = ATA_CMD_SET_MULTI;
+		isd200_set_srb(info, DMA_NONE, NULL, 0);
+		break;
+
+	case ACTION_WRITE_HOB:
+		/* The ATACB has room for one value per register.  Writing
+		 * the registers twice leaves the first values in the
+		 * "previous content" the EXT commands take the upper
+		 * bytes from, so the upper bytes go out on their own
+		 * first, without a command. */
+		usb_stor_dbg(us, "   isd200_action(WRITE_HOB)\n");
+		ata.generic.ActionSelect = ACTION_SELECT_1|ACTION_SELECT_2|
+					   ACTION_SELECT_3|ACTION_SELECT_4;
+		ata.generic.RegisterSelect =
+		  REG_SECTOR_COUNT | REG_SECTOR_NUMBER |
+		  REG_CYLINDER_LOW | REG_CYLINDER_HIGH;
+		ata.write.SectorCountByte = ((unsigned char *) pointer)[0];
+		ata.write.SectorNumberByte = ((unsigned char *) pointer)[1];
+		ata.write.CylinderLowByte = ((unsigned char *) pointer)[2];
+		ata.write.CylinderHighByte = ((unsigned char *) pointer)[3];
+		isd200_set_srb(info, DMA_NONE, NULL, 0);
+		break;
+
 	default:
 		usb_stor_dbg(us, "Error: Undefined action %d\n", action);
 		return ISD200_ERROR;
@@ -1185,6 +1231,20 @@ static int isd200_get_inquiry_data( struct us_data *us )
 				else
 					info->DeviceFlags &= ~DF_MEDIA_STATUS_ENABLED;
 
+				if (ata_id_has_lba48(id)) {
+					usb_stor_dbg(us, "   Device supports LBA48\n");
+					info->DeviceFlags |= DF_LBA48;
+				}
+
+				/* Use the largest DRQ block the drive allows */
+				i = id[ATA_ID_MAX_MULTSECT] & 0xff;
+				info->MultCount = 0;
+				if (i > 1 && is_power_of_2(i) &&
+				    isd200_action(us, ACTION_SET_MULTIPLE,
+						  NULL, i) == ISD200_GOOD)
+					info->MultCount = i;
+				usb_stor_dbg(us, "   Multiple sector count %d\n",
+					     info->MultCount);
 			}
 		} else {
 			/* 
@@ -1210,6 +1270,118 @@ static int isd200_get_inquiry_data( struct us_data *us )
 	return(retStatus);
 }
 
+/**************************************************************************
+ * isd200_capacity
+ *
+ * Number of sectors the drive reports
+ */
+static u64 isd200_capacity(struct isd200_info *info)
+{
+	u16 *id = info->id;
+
+	if (info->DeviceFlags & DF_LBA48)
+		return ata_id_u64(id, ATA_ID_LBA_CAPACITY_2);
+	if (ata_id_has_lba(id))
+		return ata_id_u32(id, ATA_ID_LBA_CAPACITY);
+	return id[ATA_ID_HEADS] * id[ATA_ID_CYLS] * id[ATA_ID_SECTORS];
+}
+
+/**************************************************************************
+ * isd200_rw_to_ata
+ *
+ * Build the ATA command for a read or write of blockCount sectors at lba.
+ * Requests that fit are sent as 28-bit commands like before; the others
+ * need a drive with LBA48.  With a multiple sector count set, the
+ * MULTIPLE commands move a DRQ block of that many sectors per interrupt
+ * instead of one.  The ATACB has no way to ask for a DMA data phase, so
+ * these are all PIO commands.
+ *
+ * RETURNS:
+ *    1 if the command needs to be sent to the transport layer
+ *    0 otherwise
+ */
+static int isd200_rw_to_ata(struct scsi_cmnd *srb, struct us_data *us,
+			    union ata_cdb *ataCdb, u64 lba,
+			    unsigned long blockCount, int write)
+{
+	struct isd200_info *info = (struct isd200_info *)us->extra;
+	u16 *id = info->id;
+	unsigned char sectnum, head, command;
+	unsigned short cylinder;
+	int ext, mult;
+
+	/* a transfer length of zero moves nothing */
+	if (blockCount == 0) {
+		srb->result = SAM_STAT_GOOD;
+		return 0;
+	}
+
+	ext = (lba + blockCount >= (1 << 28) || blockCount > 256);
+	if (ext && (!(info->DeviceFlags & DF_LBA48) ||
+		    lba + blockCount > (1ULL << 48) || blockCount > 65536)) {
+		usb_stor_dbg(us, "   %lu sectors at LBA %llu out of reach\n",
+			     blockCount, (unsigned long long) lba);
+		srb->result = DID_ERROR << 16;
+		return 0;
+	}
+	mult = (multiple && info->MultCount);
+
+	if (ext) {
+		sectnum = (unsigned char)(lba);
+		cylinder = (unsigned short)(lba>>8);
+		head = ATA_ADDRESS_DEVHEAD_LBA_MODE;
+
+		info->HobRegs[0] = (unsigned char)(blockCount>>8);
+		info->HobRegs[1] = (unsigned char)(lba>>24);
+		info->HobRegs[2] = (unsigned char)(lba>>32);
+		info->HobRegs[3] = (unsigned char)(lba>>40);
+		info->HobPending = 1;
+
+		if (write)
+			command = mult ? ATA_CMD_WRITE_MULTI_EXT :
+					 ATA_CMD_PIO_WRITE_EXT;
+		else
+			command = mult ? ATA_CMD_READ_MULTI_EXT :
+					 ATA_CMD_PIO_READ_EXT;
+	} else {
+		unsigned long lba28 = (unsigned long)lba;
+
+		if (ata_id_has_lba(id)) {
+			sectnum = (unsigned char)(lba28);
+			cylinder = (unsigned short)(lba28>>8);
+			head = ATA_ADDRESS_DEVHEAD_LBA_MODE | (unsigned char)(lba28>>24 & 0x0F);
+		} else {
+			sectnum = (u8)((lba28 % id[ATA_ID_SECTORS]) + 1);
+			cylinder = (u16)(lba28 / (id[ATA_ID_SECTORS] *
+					id[ATA_ID_HEADS]));
+			head = (u8)((lba28 / id[ATA_ID_SECTORS]) %
+					id[ATA_ID_HEADS]);
+		}
+
+		if (write)
+			command = mult ? ATA_CMD_WRITE_MULTI :
+					 ATA_CMD_PIO_WRITE;
+		else
+			command = mult ? ATA_CMD_READ_MULTI :
+					 ATA_CMD_PIO_READ;
+	}
+
+	ataCdb->generic.SignatureByte0 = info->ConfigData.ATAMajorCommand;
+	ataCdb->generic.SignatureByte1 = info->ConfigData.ATAMinorCommand;
+	ataCdb->generic.TransferBlockSize = mult ? info->MultCount : 1;
+	ataCdb->generic.RegisterSelect =
+	  REG_SECTOR_COUNT | REG_SECTOR_NUMBER |
+	  REG_CYLINDER_LOW | REG_CYLINDER_HIGH |
+	  REG_DEVICE_HEAD  | REG_COMMAND;
+	ataCdb->write.SectorCountByte = (unsigned char)blockCount;
+	ataCdb->write.SectorNumberByte = sectnum;
+	ataCdb->write.CylinderHighByte = (unsigned char)(cylinder>>8);
+	ataCdb->write.CylinderLowByte = (unsigned char)cylinder;
+	ataCdb->write.DeviceHeadByte = (head | ATA_ADDRESS_DEVHEAD_STD);
+	ataCdb->write.CommandByte = command;
+	return 1;
+}
+
 /**************************************************************************
  * isd200_scsi_to_ata
  *									 
@@ -1223,10 +1395,8 @@ static int isd200_scsi_to_ata(struct scsi_cmnd *srb, struct us_data *us,
 			      union ata_cdb * ataCdb)
 {
 	struct isd200_info *info = (struct isd200_info *)us->extra;
-	u16 *id = info->id;
 	int sendToTransport = 1;
-	unsigned char sectnum, head;
-	unsigned short cylinder;
+	u64 capacity;
 	unsigned long lba;
 	unsigned long blockCount;
 	unsigned char senseData[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
@@ -1286,16 +1456,14 @@ static int isd200_scsi_to_ata(struct scsi_cmnd *srb, struct us_data *us,
 
 	case READ_CAPACITY:
 	{
-		unsigned long capacity;
 		struct read_capacity_data readCapacityData;
 
 		usb_stor_dbg(us, "   ATA OUT - SCSIOP_READ_CAPACITY\n");
 
-		if (ata_id_has_lba(id))
-			capacity = ata_id_u32(id, ATA_ID_LBA_CAPACITY) - 1;
-		else
-			capacity = (id[ATA_ID_HEADS] * id[ATA_ID_CYLS] *
-				    id[ATA_ID_SECTORS]) - 1;
+		/* past 2^32 sectors sd asks again with READ CAPACITY(16) */
+		capacity = isd200_capacity(info) - 1;
+		if (capacity > 0xffffffff)
+			capacity = 0xffffffff;
 
 		readCapacityData.LogicalBlockAddress = cpu_to_be32(capacity);
 		readCapacityData.BytesPerBlock = cpu_to_be32(0x200);
@@ -1307,36 +1475,34 @@ static int isd200_scsi_to_ata(struct scsi_cmnd *srb, struct us_data *us,
 	}
 	break;
 
+	case SERVICE_ACTION_IN_16:
+	{
+		unsigned char readCapacity16[32];
+
+		if ((srb->cmnd[1] & 0x1f) != SAI_READ_CAPACITY_16)
+			goto unsupported;
+
+		usb_stor_dbg(us, "   ATA OUT - SCSIOP_READ_CAPACITY_16\n");
+
+		memset(readCapacity16, 0, sizeof(readCapacity16));
+		put_unaligned_be64(isd200_capacity(info) - 1,
+				   &readCapacity16[0]);
+		put_unaligned_be32(0x200, &readCapacity16[8]);
+
+		usb_stor_set_xfer_buf(readCapacity16,
+				sizeof(readCapacity16), srb);
+		srb->result = SAM_STAT_GOOD;
+		sendToTransport = 0;
+	}
+	break;
+
 	case READ_10:
 		usb_stor_dbg(us, "   ATA OUT - SCSIOP_READ\n");
 
 		lba = be32_to_cpu(*(__be32 *)&srb->cmnd[2]);
 		blockCount = (unsigned long)srb->cmnd[7]<<8 | (unsigned long)srb->cmnd[8];
-
-		if (ata_id_has_lba(id)) {
-			sectnum = (unsigned char)(lba);
-			cylinder = (unsigned short)(lba>>8);
-			head = ATA_ADDRESS_DEVHEAD_LBA_MODE | (unsigned char)(lba>>24 & 0x0F);
-		} else {
-			sectnum = (u8)((lba % id[ATA_ID_SECTORS]) + 1);
-			cylinder = (u16)(lba / (id[ATA_ID_SECTORS] *
-					id[ATA_ID_HEADS]));
-			head = (u8)((lba / id[ATA_ID_SECTORS]) %
-					id[ATA_ID_HEADS]);
-		}
-		ataCdb->generic.SignatureByte0 = info->ConfigData.ATAMajorCommand;
-		ataCdb->generic.SignatureByte1 = info->ConfigData.ATAMinorCommand;
-		ataCdb->generic.TransferBlockSize = 1;
-		ataCdb->generic.RegisterSelect =
-		  REG_SECTOR_COUNT | REG_SECTOR_NUMBER |
-		  REG_CYLINDER_LOW | REG_CYLINDER_HIGH |
-		  REG_DEVICE_HEAD  | REG_COMMAND;
-		ataCdb->write.SectorCountByte = (unsigned char)blockCount;
-		ataCdb->write.SectorNumberByte = sectnum;
-		ataCdb->write.CylinderHighByte = (unsigned char)(cylinder>>8);
-		ataCdb->write.CylinderLowByte = (unsigned char)cylinder;
-		ataCdb->write.DeviceHeadByte = (head | ATA_ADDRESS_DEVHEAD_STD);
-		ataCdb->write.CommandByte = ATA_CMD_PIO_READ;
+		sendToTransport = isd200_rw_to_ata(srb, us, ataCdb, lba,
+						   blockCount, 0);
 		break;
 
 	case WRITE_10:
@@ -1344,31 +1510,19 @@ static int isd200_scsi_to_ata(struct scsi_cmnd *srb, struct us_data *us,
 
 		lba = be32_to_cpu(*(__be32 *)&srb->cmnd[2]);
 		blockCount = (unsigned long)srb->cmnd[7]<<8 | (unsigned long)srb->cmnd[8];
+		sendToTransport = isd200_rw_to_ata(srb, us, ataCdb, lba,
+						   blockCount, 1);
+		break;
 
-		if (ata_id_has_lba(id)) {
-			sectnum = (unsigned char)(lba);
-			cylinder = (unsigned short)(lba>>8);
-			head = ATA_ADDRESS_DEVHEAD_LBA_MODE | (unsigned char)(lba>>24 & 0x0F);
-		} else {
-			sectnum = (u8)((lba % id[ATA_ID_SECTORS]) + 1);
-			cylinder = (u16)(lba / (id[ATA_ID_SECTORS] *
-					id[ATA_ID_HEADS]));
-			head = (u8)((lba / id[ATA_ID_SECTORS]) %
-					id[ATA_ID_HEADS]);
-		}
-		ataCdb->generic.SignatureByte0 = info->ConfigData.ATAMajorCommand;
-		ataCdb->generic.SignatureByte1 = info->ConfigData.ATAMinorCommand;
-		ataCdb->generic.TransferBlockSize = 1;
-		ataCdb->generic.RegisterSelect =
-		  REG_SECTOR_COUNT | REG_SECTOR_NUMBER |
-		  REG_CYLINDER_LOW | REG_CYLINDER_HIGH |
-		  REG_DEVICE_HEAD  | REG_COMMAND;
-		ataCdb->write.SectorCountByte = (unsigned char)blockCount;
-		ataCdb->write.SectorNumberByte = sectnum;
-		ataCdb->write.CylinderHighByte = (unsigned char)(cylinder>>8);
-		ataCdb->write.CylinderLowByte = (unsigned char)cylinder;
-		ataCdb->write.DeviceHeadByte = (head | ATA_ADDRESS_DEVHEAD_STD);
-		ataCdb->write.CommandByte = ATA_CMD_PIO_WRITE;
+	case READ_16:
+	case WRITE_16:
+		usb_stor_dbg(us, "   ATA OUT - SCSIOP_%s_16\n",
+			     srb->cmnd[0] == READ_16 ? "READ" : "WRITE");
+
+		sendToTransport = isd200_rw_to_ata(srb, us, ataCdb,
+				get_unaligned_be64(&srb->cmnd[2]),
+				get_unaligned_be32(&srb->cmnd[10]),
+				srb->cmnd[0] == WRITE_16);
 		break;
 
 	case ALLOW_MEDIUM_REMOVAL:
@@ -1419,6 +1573,7 @@ static int isd200_scsi_to_ata(struct scsi_cmnd *srb, struct us_data *us,
 		break;
 
 	default:
+	unsupported:
 		usb_stor_dbg(us, "Unsupported SCSI command - 0x%X\n",
 			     srb->cmnd[0]);
 		srb->result = DID_ERROR << 16;
@@ -1513,8 +1668,21 @@ static int isd200_Initialization(struct us_data *us)
  *
  */
 
+static int isd200_is_multiple(unsigned char command)
+{
+	switch (command) {
+	case ATA_CMD_READ_MULTI:
+	case ATA_CMD_WRITE_MULTI:
+	case ATA_CMD_READ_MULTI_EXT:
+	case ATA_CMD_WRITE_MULTI_EXT:
+		return 1;
+	}
+	return 0;
+}
+
 static void isd200_ata_command(struct scsi_cmnd *srb, struct us_data *us)
 {
+	struct isd200_info *info = (struct isd200_info *)us->extra;
 	int sendToTransport = 1, orig_bufflen;
 	union ata_cdb ataCdb;
 
@@ -1526,18 +1694,82 @@ static void isd200_ata_command(struct scsi_cmnd *srb, struct us_data *us)
 		return;
 	}
 
+	/* after a reset the DRQ block size has to be set again */
+	if (info->MultPending) {
+		info->MultPending = 0;
+		if (info->MultCount &&
+		    isd200_action(us, ACTION_SET_MULTIPLE, NULL,
+				  info->MultCount) != ISD200_GOOD) {
+			usb_stor_dbg(us, "   SET MULTIPLE failed after reset\n");
+			info->MultCount = 0;
+		}
+	}
+
 	scsi_set_resid(srb, 0);
 	/* scsi_bufflen might change in protocol translation to ata */
 	orig_bufflen = scsi_bufflen(srb);
 	sendToTransport = isd200_scsi_to_ata(srb, us, &ataCdb);
 
+	/* a 48-bit command needs its upper bytes loaded first */
+	if (sendToTransport && info->HobPending) {
+		info->HobPending = 0;
+		if (isd200_action(us, ACTION_WRITE_HOB, info->HobRegs, 0) !=
+				ISD200_GOOD) {
+			srb->result = DID_ERROR << 16;
+			sendToTransport = 0;
+		}
+	}
+
 	/* send the command to the transport layer */
-	if (sendToTransport)
+	if (sendToTransport) {
+		info->ATARegs[ATA_REG_ERROR_OFFSET] = 0;
 		isd200_invoke_transport(us, srb, &ataCdb);
 
+		/* a drive that aborts READ/WRITE MULTIPLE gets single
+		 * sector PIO from now on; sd retries the command */
+		if (srb->result != SAM_STAT_GOOD &&
+		    isd200_is_multiple(ataCdb.write.CommandByte) &&
+		    (info->ATARegs[ATA_REG_ERROR_OFFSET] & ATA_ABORTED)) {
+			usb_stor_dbg(us, "   MULTIPLE aborted, "
+				     "using single sector PIO\n");
+			info->MultCount = 0;
+		}
+	}
+
 	isd200_srb_set_bufflen(srb, orig_bufflen);
 }
 
+/* The drive has been reset, let the next command set MultCount again */
+static void isd200_reset_multiple(struct us_data *us)
+{
+	struct isd200_info *info = (struct isd200_info *)us->extra;
+
+	/* no info once an ATAPI device has been handed to Transparent SCSI */
+	if (info)
+		info->MultPending = 1;
+}
+
+#ifdef CONFIG_PM
+
+static int isd200_reset_resume(struct usb_interface *iface)
+{
+	isd200_reset_multiple(usb_get_intfdata(iface));
+	return usb_stor_reset_resume(iface);
+}
+
+#else
+
+#define isd200_reset_resume	NULL
+
+#endif
+
+/* called with dev_mutex still held by usb_stor_pre_reset() */
+static int isd200_post_reset(struct usb_interface *iface)
+{
+	isd200_reset_multiple(usb_get_intfdata(iface));
+	return usb_stor_post_reset(iface);
+}
+
 static struct scsi_host_template isd200_host_template;
 
 static int isd200_probe(struct usb_interface *intf,
@@ -1565,9 +1797,9 @@ static struct usb_driver isd200_driver = {
 	.disconnect =	usb_stor_disconnect,
 	.suspend =	usb_stor_suspend,
 	.resume =	usb_stor_resume,
-	.reset_resume =	usb_stor_reset_resume,
+	.reset_resume =	isd200_reset_resume,
 	.pre_reset =	usb_stor_pre_reset,
-	.post_reset =	usb_stor_post_reset,
+	.post_reset =	isd200_post_reset,
 	.id_table =	isd200_usb_ids,
 	.soft_unbind =	1,
 	.no_dynamic_id = 1,
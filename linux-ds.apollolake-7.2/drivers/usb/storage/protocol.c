@@ -191,3 +191,137 @@ void usb_stor_set_xfer_buf(unsigned char *buffer,
 		scsi_set_resid(srb, scsi_bufflen(srb) - buflen);
 }
 EXPORT_SYMBOL_GPL(usb_stor_set_xfer_buf);
+
+/* Transfer buffer cursors
+ *
+ * usb_stor_access_xfer_buf() starts a new mapping iterator and skips
+ * everything already copied on each call, so moving a large transfer
+ * a sector or a block at a time walks the scatter-gather list over and
+ * over.  A cursor keeps the iterator and the current page mapping from
+ * one call to the next instead.  The mapping is made with kmap(), so
+ * the caller may sleep while a cursor is active, but it must end it
+ * with usb_stor_cursor_stop() on every path.
+ *
+ * TO_XFER_BUF cursors store into the transfer buffer, FROM_XFER_BUF
+ * cursors read from it.
+ */
+void usb_stor_cursor_start(struct us_xfer_cursor *cur,
+	struct scsi_cmnd *srb, enum xfer_buf_dir dir)
+{
+	sg_miter_start(&cur->miter, scsi_sglist(srb), scsi_sg_count(srb),
+		dir == FROM_XFER_BUF ? SG_MITER_FROM_SG : SG_MITER_TO_SG);
+	cur->used = 0;
+	cur->dir = dir;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cursor_start);
+
+/* Return the next contiguous piece of the transfer buffer and its length
+ * in *len, or NULL at the end.  The caller may use the piece in place
+ * and then passes the number of bytes it consumed to
+ * usb_stor_cursor_advance().
+ */
+void *usb_stor_cursor_map(struct us_xfer_cursor *cur, unsigned int *len)
+{
+	if (cur->used == cur->miter.length) {
+		if (!sg_miter_next(&cur->miter))
+			return NULL;
+		cur->used = 0;
+	}
+	*len = cur->miter.length - cur->used;
+	return cur->miter.addr + cur->used;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cursor_map);
+
+void usb_stor_cursor_advance(struct us_xfer_cursor *cur, unsigned int len)
+{
+	cur->used += len;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cursor_advance);
+
+/* Copy up to buflen bytes between buffer and the transfer buffer at the
+ * cursor, returning the amount copied.
+ */
+unsigned int usb_stor_cursor_copy(struct us_xfer_cursor *cur,
+	unsigned char *buffer, unsigned int buflen)
+{
+	unsigned int cnt = 0;
+	unsigned int len;
+	void *addr;
+
+	while (cnt < buflen && (addr = usb_stor_cursor_map(cur, &len))) {
+		len = min(len, buflen - cnt);
+		if (cur->dir == FROM_XFER_BUF)
+			memcpy(buffer + cnt, addr, len);
+		else
+			memcpy(addr, buffer + cnt, len);
+		usb_stor_cursor_advance(cur, len);
+		cnt += len;
+	}
+	return cnt;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cursor_copy);
+
+void usb_stor_cursor_stop(struct us_xfer_cursor *cur)
+{
+	/* sg_miter_stop() flushes the page if it was written to */
+	cur->miter.consumed = cur->used;
+	sg_miter_stop(&cur->miter);
+}
+EXPORT_SYMBOL_GPL(usb_stor_cursor_stop);
+
+/* Transfer buffer parts
+ *
+ * Subdrivers whose device commands are shorter than a SCSI request can
+ * still transfer the data straight to and from the request's
+ * scatter-gather list, one command's worth at a time.
+ * usb_stor_sg_part_next() trims the entry the next part starts in, so
+ * that part->sg and the returned entry count can be passed to
+ * usb_stor_bulk_transfer_sg() together with the part's length;
+ * usb_stor_sg_part_done() puts the entry back and moves on.  The caller
+ * must make sure the request's buffer holds every part.
+ */
+void usb_stor_sg_part_start(struct us_sg_part *part, struct scsi_cmnd *srb)
+{
+	part->sg = scsi_sglist(srb);
+	part->offset = 0;
+	part->len = 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_sg_part_start);
+
+int usb_stor_sg_part_next(struct us_sg_part *part, unsigned int len)
+{
+	struct scatterlist *sg = part->sg;
+	unsigned int left = part->offset + len;
+	int nents = 0;
+
+	for (; sg && left; sg = sg_next(sg)) {
+		left -= min(left, sg->length);
+		nents++;
+	}
+
+	part->len = len;
+	part->saved_offset = part->sg->offset;
+	part->saved_length = part->sg->length;
+	part->sg->offset += part->offset;
+	part->sg->length -= part->offset;
+	return nents;
+}
+EXPORT_SYMBOL_GPL(usb_stor_sg_part_next);
+
+void usb_stor_sg_part_done(struct us_sg_part *part)
+{
+	struct scatterlist *sg = part->sg;
+	unsigned int skip = part->offset + part->len;
+
+	sg->offset = part->saved_offset;
+	sg->length = part->saved_length;
+
+	while (sg && skip >= sg->length) {
+		skip -= sg->length;
+		sg = sg_next(sg);
+	}
+	part->sg = sg;
+	part->offset = skip;
+	part->len = 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_sg_part_done);
@@ -39,6 +39,8 @@
 #ifndef _PROTOCOL_H_
 #define _PROTOCOL_H_
 
+#include <linux/scatterlist.h>
+
 /* Protocol handling routines */
 extern void usb_stor_pad12_command(struct scsi_cmnd*, struct us_data*);
 extern void usb_stor_ufi_command(struct scsi_cmnd*, struct us_data*);
@@ -54,4 +56,35 @@ extern unsigned int usb_stor_access_xfer_buf(unsigned char *buffer,
 
 extern void usb_stor_set_xfer_buf(unsigned char *buffer,
 	unsigned int buflen, struct scsi_cmnd *srb);
+
+/* Sequential access to a transfer buffer that is moved in pieces */
+struct us_xfer_cursor {
+	struct sg_mapping_iter	miter;
+	unsigned int		used;	/* bytes of the mapped piece done */
+	enum xfer_buf_dir	dir;
+};
+
+extern void usb_stor_cursor_start(struct us_xfer_cursor *cur,
+	struct scsi_cmnd *srb, enum xfer_buf_dir dir);
+extern void *usb_stor_cursor_map(struct us_xfer_cursor *cur,
+	unsigned int *len);
+extern void usb_stor_cursor_advance(struct us_xfer_cursor *cur,
+	unsigned int len);
+extern unsigned int usb_stor_cursor_copy(struct us_xfer_cursor *cur,
+	unsigned char *buffer, unsigned int buflen);
+extern void usb_stor_cursor_stop(struct us_xfer_cursor *cur);
+
+/* Consecutive parts of a transfer buffer handed to the bulk routines */
+struct us_sg_part {
+	struct scatterlist	*sg;		/* entry the part starts in */
+	unsigned int		offset;		/* ... at this offset       */
+	unsigned int		len;
+	unsigned int		saved_offset;	/* sg before trimming       */
+	unsigned int		saved_length;
+};
+
+extern void usb_stor_sg_part_start(struct us_sg_part *part,
+	struct scsi_cmnd *srb);
+extern int usb_stor_sg_part_next(struct us_sg_part *part, unsigned int len);
+extern void usb_stor_sg_part_done(struct us_sg_part *part);
 #endif
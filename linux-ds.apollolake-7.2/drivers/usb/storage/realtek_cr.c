@@ -62,6 +62,17 @@ module_param(ss_delay, int, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(ss_delay,
 		 "seconds to delay before entering selective suspend");
 
+/*
+ * Longer than the 2 s at which media-change events are usually polled,
+ * so that an idle slot is not woken up for every poll.  A card removed
+ * in that time is still noticed by the first access to it, and a
+ * resume from selective suspend drops the whole cache.
+ */
+static unsigned int tur_cache_ms = 5000;
+module_param(tur_cache_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tur_cache_ms,
+		 "milliseconds to answer TEST UNIT READY from the cached card state (0=off)");
+
 enum RTS51X_STAT {
 	RTS51X_STAT_INIT,
 	RTS51X_STAT_IDLE,
@@ -79,6 +90,10 @@ enum RTS51X_STAT {
 #define CLR_LUN_READY(chip, lun)	((chip)->lun_ready &= ~((u8)1 << (lun)))
 #define TST_LUN_READY(chip, lun)	((chip)->lun_ready & ((u8)1 << (lun)))
 
+#define SET_LUN_VALID(chip, lun)	((chip)->lun_valid |= ((u8)1 << (lun)))
+#define CLR_LUN_VALID(chip, lun)	((chip)->lun_valid &= ~((u8)1 << (lun)))
+#define TST_LUN_VALID(chip, lun)	((chip)->lun_valid & ((u8)1 << (lun)))
+
 #endif
 
 struct rts51x_status {
@@ -115,6 +130,8 @@ struct rts51x_chip {
 	unsigned long timer_expires;
 	int pwr_state;
 	u8 lun_ready;
+	u8 lun_valid;
+	unsigned long lun_expires[8];
 	enum RTS51X_STAT state;
 	int support_auto_delink;
 #endif
@@ -801,13 +818,77 @@ static inline int working_scsi(struct scsi_cmnd *srb)
 	return 1;
 }
 
-static void rts51x_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
+/*
+ * Card presence per LUN as last reported by the chip.  A media access
+ * that succeeds means a card is there, MEDIUM NOT PRESENT means it is
+ * not, and a UNIT ATTENTION or a transport failure invalidates the entry
+ * so that the next TEST UNIT READY goes to the chip again.
+ */
+static void rts51x_track_lun(struct rts51x_chip *chip, struct scsi_cmnd *srb)
+{
+	unsigned int lun = srb->device->lun;
+	u8 *sense = srb->sense_buffer;
+
+	if (srb->result == SAM_STAT_CHECK_CONDITION) {
+		if ((sense[2] & 0x0f) == UNIT_ATTENTION) {
+			CLR_LUN_VALID(chip, lun);
+			return;
+		}
+		if ((sense[2] & 0x0f) != NOT_READY || sense[12] != 0x3A)
+			return;
+		CLR_LUN_READY(chip, lun);
+	} else if (srb->result != SAM_STAT_GOOD) {
+		CLR_LUN_VALID(chip, lun);
+		return;
+	} else {
+		switch (srb->cmnd[0]) {
+		case TEST_UNIT_READY:
+		case READ_CAPACITY:
+		case READ_10:
+		case WRITE_10:
+			SET_LUN_READY(chip, lun);
+			break;
+		default:
+			return;
+		}
+	}
+
+	SET_LUN_VALID(chip, lun);
+	chip->lun_expires[lun] = jiffies + msecs_to_jiffies(tur_cache_ms);
+}
+
+/*
+ * TEST UNIT READY is answered from the cache while the entry is fresh.
+ * An entry is only refreshed by commands to its own LUN, so a slot
+ * that is merely polled goes back to the card once its entry expires,
+ * however busy the other slot is.
+ */
+static int rts51x_lun_cached(struct rts51x_chip *chip, unsigned int lun)
+{
+	if (!tur_cache_ms || !TST_LUN_VALID(chip, lun))
+		return 0;
+
+	return time_before(jiffies, chip->lun_expires[lun]);
+}
+
+static void rts51x_answer_tur(struct rts51x_chip *chip, struct scsi_cmnd *srb)
 {
-	struct rts51x_chip *chip = (struct rts51x_chip *)(us->extra);
-	static int card_first_show = 1;
 	static u8 media_not_present[] = { 0x70, 0, 0x02, 0, 0, 0, 0,
 		10, 0, 0, 0, 0, 0x3A, 0, 0, 0, 0, 0
 	};
+
+	if (TST_LUN_READY(chip, srb->device->lun)) {
+		srb->result = SAM_STAT_GOOD;
+	} else {
+		srb->result = SAM_STAT_CHECK_CONDITION;
+		memcpy(srb->sense_buffer, media_not_present, US_SENSE_SIZE);
+	}
+}
+
+static void rts51x_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
+{
+	struct rts51x_chip *chip = (struct rts51x_chip *)(us->extra);
+	static int card_first_show = 1;
 	static u8 invalid_cmd_field[] = { 0x70, 0, 0x05, 0, 0, 0, 0,
 		10, 0, 0, 0, 0, 0x24, 0, 0, 0, 0, 0
 	};
@@ -824,19 +905,20 @@ static void rts51x_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
 		if (rts51x_get_stat(chip) != RTS51X_STAT_RUN)
 			rts51x_set_stat(chip, RTS51X_STAT_RUN);
 		chip->proto_handler_backup(srb, us);
+		rts51x_track_lun(chip, srb);
+	} else if ((srb->cmnd[0] == TEST_UNIT_READY) &&
+		   rts51x_lun_cached(chip, srb->device->lun)) {
+		rts51x_answer_tur(chip, srb);
+		usb_stor_dbg(us, "TEST_UNIT_READY from cache\n");
+		if (rts51x_get_stat(chip) == RTS51X_STAT_RUN)
+			rts51x_set_stat(chip, RTS51X_STAT_IDLE);
+		goto out;
 	} else {
 		if (rts51x_get_stat(chip) == RTS51X_STAT_SS) {
 			usb_stor_dbg(us, "NOT working scsi\n");
 			if ((srb->cmnd[0] == TEST_UNIT_READY) &&
 			    (chip->pwr_state == US_SUSPEND)) {
-				if (TST_LUN_READY(chip, srb->device->lun)) {
-					srb->result = SAM_STAT_GOOD;
-				} else {
-					srb->result = SAM_STAT_CHECK_CONDITION;
-					memcpy(srb->sense_buffer,
-					       media_not_present,
-					       US_SENSE_SIZE);
-				}
+				rts51x_answer_tur(chip, srb);
 				usb_stor_dbg(us, "TEST_UNIT_READY\n");
 				goto out;
 			}
@@ -868,6 +950,7 @@ static void rts51x_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
 					CLR_LUN_READY(chip, srb->device->lun);
 					card_first_show = 1;
 				}
+				rts51x_track_lun(chip, srb);
 			}
 			if (rts51x_get_stat(chip) != RTS51X_STAT_IDLE)
 				rts51x_set_stat(chip, RTS51X_STAT_IDLE);
@@ -890,6 +973,7 @@ static int realtek_cr_autosuspend_setup(struct us_data *us)
 	chip->support_auto_delink = 0;
 	chip->pwr_state = US_RESUME;
 	chip->lun_ready = 0;
+	chip->lun_valid = 0;
 	rts51x_set_stat(chip, RTS51X_STAT_INIT);
 
 	retval = rts51x_read_status(us, 0, buf, 16, &(chip->status_len));
@@ -972,6 +1056,12 @@ static int realtek_cr_resume(struct usb_interface *iface)
 	fw5895_init(us);
 	config_autodelink_after_power_on(us);
 
+#ifdef CONFIG_REALTEK_AUTOPM
+	/* the cards may have been swapped while we were asleep */
+	if (us->extra)
+		((struct rts51x_chip *)us->extra)->lun_valid = 0;
+#endif
+
 	return 0;
 }
 #else
@@ -0,0 +1,265 @@
+/* Driver for USB Mass Storage compliant devices
+ * Management Command Response Cache
+ *
+ * The storage manager, udev, smartctl and the SCSI midlayer keep polling
+ * USB disks with the same handful of commands: TEST UNIT READY, INQUIRY,
+ * READ CAPACITY, MODE SENSE and ATA pass-through IDENTIFY / SMART READ
+ * DATA.  None of these change anything on the device, and the answers
+ * only change after a unit attention, a reset or a media change.  On
+ * Bulk-Only devices each of them blocks the single command slot, and on
+ * UAS devices they take a tag and may wake a sleeping disk.
+ *
+ * TEST UNIT READY is never cached even though it is polled the most:
+ * it is how sd notices that the medium went away, and a replayed GOOD
+ * would hide the removal for a whole TTL.
+ *
+ * This cache remembers the last few successful answers per host and
+ * replays them for an identical CDB until the entry expires.  It is off
+ * unless a TTL is configured, either through the cache_ttl module
+ * parameter or per device through sysfs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/ata.h>
+#include <linux/export.h>
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+
+#include <scsi/scsi.h>
+#include <scsi/scsi_cmnd.h>
+#include <scsi/scsi_device.h>
+#include <scsi/scsi_eh.h>
+
+#include "respcache.h"
+
+static unsigned int cache_ttl;
+module_param(cache_ttl, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(cache_ttl, "milliseconds to answer repeated management "
+		 "commands from a per-device cache (0 = off)");
+
+/* ATA PASS-THROUGH protocol field value for PIO Data-In */
+#define ATA_PT_PIO_DATA_IN	4
+
+/* Can the answer to this command be replayed later? */
+static int us_cache_cacheable(struct scsi_cmnd *srb)
+{
+	const unsigned char *cdb = srb->cmnd;
+
+	if (srb->cmd_len > sizeof(((struct us_cache_entry *) 0)->cmnd))
+		return 0;
+
+	switch (cdb[0]) {
+	case INQUIRY:
+	case READ_CAPACITY:
+	case MODE_SENSE:
+	case MODE_SENSE_10:
+		return 1;
+
+	case SERVICE_ACTION_IN_16:
+		return (cdb[1] & 0x1f) == SAI_READ_CAPACITY_16;
+
+	case ATA_16:
+		/* Only PIO Data-In without CK_COND, whose result is the data */
+		if (((cdb[1] >> 1) & 0x0f) != ATA_PT_PIO_DATA_IN ||
+				(cdb[2] & 0x20))
+			return 0;
+		if (cdb[14] == ATA_CMD_ID_ATA)
+			return 1;
+		return cdb[14] == ATA_CMD_SMART &&
+				cdb[4] == ATA_SMART_READ_VALUES;
+	}
+	return 0;
+}
+
+/* Does this command change what the cached commands would report? */
+static int us_cache_invalidates(struct scsi_cmnd *srb)
+{
+	switch (srb->cmnd[0]) {
+	case START_STOP:
+	case MODE_SELECT:
+	case MODE_SELECT_10:
+	case FORMAT_UNIT:
+	case WRITE_BUFFER:
+	case ATA_12:
+	case ATA_16:
+		return !us_cache_cacheable(srb);
+	}
+	return 0;
+}
+
+/* Did the device report something that voids everything we remember? */
+static int us_cache_result_invalidates(struct scsi_cmnd *srb)
+{
+	struct scsi_sense_hdr sshdr;
+
+	if (host_byte(srb->result) != DID_OK)
+		return 1;
+	if ((srb->result & 0xff) != SAM_STAT_CHECK_CONDITION)
+		return 0;
+	if (!scsi_normalize_sense(srb->sense_buffer, SCSI_SENSE_BUFFERSIZE,
+				&sshdr))
+		return 0;
+	return sshdr.sense_key == UNIT_ATTENTION ||
+			sshdr.sense_key == NOT_READY;
+}
+
+static struct us_cache_entry *us_cache_find(struct us_cache *cache,
+		struct scsi_cmnd *srb)
+{
+	struct us_cache_entry *e;
+	int i;
+
+	for (i = 0; i < US_CACHE_ENTRIES; i++) {
+		e = &cache->entries[i];
+		if (e->expires && e->cmd_len == srb->cmd_len &&
+				e->lun == srb->device->lun &&
+				!memcmp(e->cmnd, srb->cmnd, srb->cmd_len))
+			return e;
+	}
+	return NULL;
+}
+
+int usb_stor_cache_init(struct us_cache *cache)
+{
+	int i;
+
+	spin_lock_init(&cache->lock);
+	cache->ttl = cache_ttl;
+	cache->buf = kmalloc(US_CACHE_ENTRIES * US_CACHE_DATA_SIZE,
+			GFP_KERNEL);
+	if (!cache->buf)
+		return -ENOMEM;
+
+	for (i = 0; i < US_CACHE_ENTRIES; i++)
+		cache->entries[i].data = cache->buf + i * US_CACHE_DATA_SIZE;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_init);
+
+void usb_stor_cache_release(struct us_cache *cache)
+{
+	kfree(cache->buf);
+	cache->buf = NULL;
+	cache->ttl = 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_release);
+
+/*
+ * Try to answer srb from the cache.  Returns 1 if the command has been
+ * completed (data, residue and result filled in) and must not be sent
+ * to the device, 0 otherwise.  May be called in atomic context.
+ */
+int usb_stor_cache_lookup(struct us_cache *cache, struct scsi_cmnd *srb)
+{
+	struct us_cache_entry *e;
+	unsigned long flags;
+	int hit = 0;
+
+	if (!READ_ONCE(cache->ttl) || !us_cache_cacheable(srb))
+		return 0;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	e = us_cache_find(cache, srb);
+	if (e && time_before(jiffies, e->expires)) {
+		if (e->len)
+			scsi_sg_copy_from_buffer(srb, e->data, e->len);
+		scsi_set_resid(srb, scsi_bufflen(srb) - e->len);
+		srb->result = SAM_STAT_GOOD;
+		cache->hits++;
+		hit = 1;
+	} else {
+		cache->misses++;
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	return hit;
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_lookup);
+
+/*
+ * Called for every command the device actually executed, just before it
+ * is handed back to the SCSI layer.  Remembers cacheable answers and
+ * drops everything on unit attentions, resets and state-changing
+ * commands.  May be called in atomic context.
+ */
+void usb_stor_cache_complete(struct us_cache *cache, struct scsi_cmnd *srb)
+{
+	struct us_cache_entry *e;
+	unsigned long flags;
+	unsigned int len;
+
+	if (!READ_ONCE(cache->ttl))
+		return;
+
+	if (us_cache_result_invalidates(srb) || us_cache_invalidates(srb)) {
+		usb_stor_cache_invalidate(cache);
+		return;
+	}
+
+	if (srb->result != SAM_STAT_GOOD || !us_cache_cacheable(srb))
+		return;
+
+	len = scsi_bufflen(srb) - scsi_get_resid(srb);
+	if (len > US_CACHE_DATA_SIZE)
+		return;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	e = us_cache_find(cache, srb);
+	if (!e) {
+		e = &cache->entries[cache->next];
+		cache->next = (cache->next + 1) % US_CACHE_ENTRIES;
+	}
+
+	e->lun = srb->device->lun;
+	e->cmd_len = srb->cmd_len;
+	memcpy(e->cmnd, srb->cmnd, srb->cmd_len);
+	e->len = len ? scsi_sg_copy_to_buffer(srb, e->data, len) : 0;
+
+	/* jiffies + ttl may wrap to 0, which marks a free slot */
+	e->expires = (jiffies + msecs_to_jiffies(cache->ttl)) | 1;
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_complete);
+
+void usb_stor_cache_invalidate(struct us_cache *cache)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&cache->lock, flags);
+	for (i = 0; i < US_CACHE_ENTRIES; i++)
+		cache->entries[i].expires = 0;
+	cache->invalidations++;
+	spin_unlock_irqrestore(&cache->lock, flags);
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_invalidate);
+
+void usb_stor_cache_set_ttl(struct us_cache *cache, unsigned int ttl)
+{
+	unsigned long flags;
+
+	/* Without a buffer (init failed or host going away) stay off */
+	spin_lock_irqsave(&cache->lock, flags);
+	cache->ttl = cache->buf ? ttl : 0;
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	usb_stor_cache_invalidate(cache);
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_set_ttl);
+
+ssize_t usb_stor_cache_show_stats(struct us_cache *cache, char *buf)
+{
+	return sprintf(buf, "hits %lu\nmisses %lu\ninvalidations %lu\n",
+			cache->hits, cache->misses, cache->invalidations);
+}
+EXPORT_SYMBOL_GPL(usb_stor_cache_show_stats);
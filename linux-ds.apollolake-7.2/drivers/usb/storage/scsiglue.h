@@ -39,11 +39,41 @@
 #ifndef _SCSIGLUE_H_
 #define _SCSIGLUE_H_
 
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+struct Scsi_Host;
+struct scsi_cmnd;
+struct scsi_device;
+struct scsi_host_template;
+struct us_data;
+
+/*
+ * Logical block provisioning state of one usb-storage or uas host.  It
+ * belongs to the driver, so it lasts across resets but not rebinding.
+ */
+struct us_provisioning {
+	struct Scsi_Host	*host;
+	struct work_struct	work;		/* turns discard off */
+	bool			disabled;	/* a provisioning command failed */
+};
+
 extern void usb_stor_report_device_reset(struct us_data *us);
 extern void usb_stor_report_bus_reset(struct us_data *us);
 extern void usb_stor_host_template_init(struct scsi_host_template *sht,
 					const char *name, struct module *owner);
 
+extern void usb_stor_provisioning_init(struct us_provisioning *prov,
+				       struct Scsi_Host *host);
+extern void usb_stor_provisioning_release(struct us_provisioning *prov);
+extern int usb_stor_probe_provisioning(struct us_provisioning *prov,
+				       struct scsi_device *sdev);
+extern void usb_stor_check_provisioning(struct us_provisioning *prov,
+					struct scsi_cmnd *srb);
+extern void usb_stor_max_sectors_work(struct work_struct *work);
+extern void usb_stor_check_max_sectors(struct us_data *us,
+				       struct scsi_cmnd *srb, int failed);
+
 extern unsigned char usb_stor_sense_invalidCDB[18];
 
 #endif
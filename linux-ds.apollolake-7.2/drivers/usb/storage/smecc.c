@@ -0,0 +1,93 @@
+/* Driver for USB Mass Storage compliant devices
+ * SmartMedia ECC
+ *
+ * SmartMedia and xD cards protect every 256 bytes of a page with a
+ * 3-byte Hamming code: 16 line parity bits, which for each bit of the
+ * byte index give the parity of the bytes whose index has that bit
+ * clear and of those that have it set, and 6 column parity bits, which
+ * do the same for the bit positions within a byte.
+ *
+ * The line parity of a bit in the byte index only depends on the XOR of
+ * the bytes selected.  Reading the data as 32 little-endian 64-bit
+ * words, the upper five index bits select whole words and the lower
+ * three select byte lanes within a word, so one pass XORing words into
+ * five accumulators and a few masked parity folds at the end give the
+ * same result as examining the data bit by bit.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/export.h>
+#include <linux/types.h>
+#include <asm/unaligned.h>
+
+#include "smecc.h"
+
+#define SM_ECC_WORDS	(SM_ECC_BLOCK / 8)
+
+/* Spread 4 bits to the even bit positions of a byte */
+static const unsigned char sm_spread[16] = {
+	0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15,
+	0x40, 0x41, 0x44, 0x45, 0x50, 0x51, 0x54, 0x55,
+};
+
+static inline unsigned int sm_parity(u64 x)
+{
+	x ^= x >> 32;
+	x ^= x >> 16;
+	x ^= x >> 8;
+	x ^= x >> 4;
+	return (0x6996 >> (x & 0xf)) & 1;
+}
+
+void usb_stor_sm_ecc(const unsigned char *data, unsigned char *ecc)
+{
+	u64 w, all = 0, line[5] = {0};
+	unsigned int bits, p, i, m;
+	unsigned char a, par;
+
+	/* line[m] collects the words whose index has bit m clear */
+	for (i = 0; i < SM_ECC_WORDS; i++) {
+		w = get_unaligned_le64(data + 8 * i);
+		all ^= w;
+		for (m = 0; m < 5; m++)
+			line[m] ^= w & ((u64) ((i >> m) & 1) - 1);
+	}
+
+	/* 8 line parity bits for the byte indexes with bit j clear */
+	bits = sm_parity(all & 0x00ff00ff00ff00ffULL) |
+		sm_parity(all & 0x0000ffff0000ffffULL) << 1 |
+		sm_parity(all & 0x00000000ffffffffULL) << 2;
+	for (m = 0; m < 5; m++)
+		bits |= sm_parity(line[m]) << (m + 3);
+
+	/* XOR of all the bytes, giving the column parities */
+	all ^= all >> 32;
+	all ^= all >> 16;
+	all ^= all >> 8;
+	par = all;
+	p = sm_parity(par);
+
+	/*
+	 * The bits with the index bit set have the parity of the ones with
+	 * it clear, flipped if the whole block has odd parity.
+	 */
+	a = sm_spread[bits & 0xf];
+	ecc[0] = ~(a ^ (a << 1) ^ (p ? 0xaa : 0));
+
+	a = sm_spread[bits >> 4];
+	ecc[1] = ~(a ^ (a << 1) ^ (p ? 0xaa : 0));
+
+	a = sm_spread[sm_parity(par & 0x55) | sm_parity(par & 0x33) << 1 |
+			sm_parity(par & 0x0f) << 2] << 2;
+	ecc[2] = ~(a ^ (a << 1) ^ (p ? 0xa8 : 0));
+}
+EXPORT_SYMBOL_GPL(usb_stor_sm_ecc);
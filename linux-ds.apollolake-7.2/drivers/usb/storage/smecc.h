@@ -0,0 +1,31 @@
+/* Driver for USB Mass Storage compliant devices
+ * SmartMedia ECC Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _SMECC_H_
+#define _SMECC_H_
+
+#include <linux/bitops.h>
+
+#define SM_ECC_BLOCK	256	/* data bytes covered by one ECC */
+
+/* parity of a byte, used for the LBA fields of the redundancy data */
+static inline int sm_parity8(unsigned char x)
+{
+	return hweight8(x) & 1;
+}
+
+/* compute the 3-byte ecc on SM_ECC_BLOCK bytes */
+extern void usb_stor_sm_ecc(const unsigned char *data, unsigned char *ecc);
+
+#endif
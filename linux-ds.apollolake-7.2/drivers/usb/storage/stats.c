@@ -0,0 +1,101 @@
+/* Driver for USB Mass Storage compliant devices
+ * Transport Statistics
+ *
+ * When a Bulk-only device is slow it is hard to tell from the outside
+ * whether the time goes into the command, data or status stage, into
+ * re-reading the CSW, into auto-sense or into clearing halted endpoints.
+ * These counters time every stage separately and keep a log2 histogram
+ * of the latencies, together with counts of the error-recovery paths
+ * taken.  They are exported per device through the transport_stats
+ * sysfs file, and writing anything to it starts over.
+ *
+ * All updates come from the context that owns the device (the command
+ * work or error handling under dev_mutex), so no locking or atomics are
+ * needed and the cost is one ktime_get() per stage.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/bitops.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+
+#include "stats.h"
+
+static const char * const us_phase_names[US_PHASES] = {
+	[US_PHASE_CBW]		= "cbw",
+	[US_PHASE_DATA]		= "data",
+	[US_PHASE_CSW]		= "csw",
+	[US_PHASE_CSW_RETRY]	= "csw_retry",
+	[US_PHASE_PIPELINE]	= "pipeline",
+	[US_PHASE_SENSE]	= "sense",
+	[US_PHASE_CLEAR_HALT]	= "clear_halt",
+};
+
+/* Account one stage that began at start */
+void usb_stor_stats_phase(struct us_stats *stats, int phase, ktime_t start,
+		int error)
+{
+	struct us_phase_stats *p = &stats->phase[phase];
+	s64 delta = ktime_us_delta(ktime_get(), start);
+	u32 us = clamp_t(s64, delta, 0, U32_MAX);
+
+	p->count++;
+	if (error)
+		p->errors++;
+	p->total_us += us;
+	if (us > p->max_us)
+		p->max_us = us;
+	p->hist[min(fls(us), US_STATS_BUCKETS - 1)]++;
+}
+
+void usb_stor_stats_clear(struct us_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+/*
+ * One line per stage that has been used, giving the count, the errors,
+ * the average and maximum latency in us and the histogram buckets, then
+ * one line per event counter.
+ */
+ssize_t usb_stor_stats_show(struct us_stats *stats, char *buf)
+{
+	struct us_phase_stats *p;
+	ssize_t len = 0;
+	int i, j;
+
+	for (i = 0; i < US_PHASES; i++) {
+		p = &stats->phase[i];
+		if (!p->count)
+			continue;
+
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				"%s count %lu errors %lu avg_us %llu max_us %u hist",
+				us_phase_names[i], p->count, p->errors,
+				div_u64(p->total_us, p->count), p->max_us);
+		for (j = 0; j < US_STATS_BUCKETS; j++)
+			len += scnprintf(buf + len, PAGE_SIZE - len, " %u",
+					p->hist[j]);
+		len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+	}
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+			"auto_sense %lu\nresidue_fixups %lu\n"
+			"last_sector_hacks %lu\nphase_errors %lu\nresets %lu\n"
+			"buffer_allocs %lu\nerases_saved %lu\n",
+			stats->auto_sense, stats->residue_fixups,
+			stats->last_sector, stats->phase_errors, stats->resets,
+			stats->buffer_allocs, stats->erases_saved);
+	return len;
+}
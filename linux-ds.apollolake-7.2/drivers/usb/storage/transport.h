@@ -77,8 +77,15 @@
 extern int usb_stor_CB_transport(struct scsi_cmnd *, struct us_data*);
 extern int usb_stor_CB_reset(struct us_data*);
 
+/*
+ * Upper limit for the delay between Bulk-only stages, in microseconds
+ */
+
+#define US_PHASE_DELAY_MAX	20000
+
 extern int usb_stor_Bulk_transport(struct scsi_cmnd *, struct us_data*);
 extern int usb_stor_Bulk_max_lun(struct us_data*);
+extern int usb_stor_Bulk_ping(struct us_data *us, int timeout);
 extern int usb_stor_Bulk_reset(struct us_data*);
 
 extern void usb_stor_invoke_transport(struct scsi_cmnd *, struct us_data*);
@@ -0,0 +1,443 @@
+/* Driver for USB Mass Storage compliant devices
+ * SAT TRIM Translation
+ *
+ * Plenty of USB-SATA bridges pass ATA PASS-THROUGH commands to the disk
+ * but do not translate UNMAP into the ATA DATA SET MANAGEMENT command, so
+ * SSDs in such enclosures never see a TRIM.  When enabled, this code asks
+ * the disk itself (IDENTIFY DEVICE) whether it supports TRIM and, if so,
+ * makes the device look thin provisioned to sd: READ CAPACITY(16) gets
+ * LBPME set, the Logical Block Provisioning VPD page is answered here,
+ * and every UNMAP is sent to the disk as an ATA_16 DSM TRIM with the
+ * descriptors turned into coalesced LBA ranges.
+ *
+ * The device's own Block Limits page is passed on with only its UNMAP
+ * fields changed, so that its transfer length limits still reach sd;
+ * it is made up only if the device has none.  It advertises a single
+ * descriptor of at most (ranges - 1) * 65535 blocks, where ranges is
+ * what the disk accepts in one DSM command, so an UNMAP from sd always
+ * fits one ATA command.
+ *
+ * Callers serialise all calls for one us_trim (the usb-storage control
+ * thread, or the uas device lock).
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/ata.h>
+#include <linux/export.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+#include <asm/unaligned.h>
+
+#include <scsi/scsi.h>
+#include <scsi/scsi_cmnd.h>
+#include <scsi/scsi_device.h>
+#include <scsi/scsi_eh.h>
+
+#include "usb.h"
+#include "scsiglue.h"
+#include "trim.h"
+
+static bool sat_trim;
+module_param(sat_trim, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sat_trim, "translate UNMAP into ATA TRIM for disks behind "
+		 "bridges that only pass ATA commands through");
+
+/* IDENTIFY DEVICE word 105: maximum 512-byte blocks per DSM command */
+#define US_ATA_ID_DSM_BLOCKS	105
+
+#define US_TRIM_MAX_BLOCKS	8	/* DSM payload blocks we allocate  */
+#define US_TRIM_RANGES_PER_BLOCK 64	/* 8-byte LBA range entries        */
+#define US_TRIM_PARAM_SIZE	512	/* UNMAP parameters / VPD scratch  */
+#define US_TRIM_RANGE_MAX	0xffff	/* blocks in one LBA range entry   */
+#define US_TRIM_BLOCK_LIMITS_LEN 64	/* Block Limits VPD page, SBC-3    */
+
+/* ATA PASS-THROUGH protocol field values */
+#define ATA_PT_PIO_DATA_IN	4
+#define ATA_PT_DMA		6
+
+static unsigned char *us_trim_scratch(struct us_trim *trim)
+{
+	return trim->buf + trim->ranges * 8;
+}
+
+/* Stop translating once the device has failed a provisioning command */
+static int us_trim_active(struct us_trim *trim)
+{
+	if (trim->enabled && trim->prov->disabled)
+		trim->enabled = 0;
+	return trim->enabled;
+}
+
+/*
+ * Ask the disk whether it does TRIM.  Called from slave_configure, where
+ * the device is already able to do I/O.  Returns 1 if UNMAP is going to
+ * be translated for this device, 0 otherwise.
+ */
+int usb_stor_trim_probe(struct us_trim *trim, struct us_provisioning *prov,
+		struct scsi_device *sdev)
+{
+	unsigned char cdb[16] = { ATA_16 };
+	unsigned int blocks;
+	u16 *id;
+	int i, result;
+
+	if (!sat_trim || trim->enabled || sdev->type != TYPE_DISK)
+		return 0;
+	if (prov->disabled)
+		return 0;
+
+	id = kmalloc(ATA_ID_WORDS * 2, GFP_KERNEL);
+	if (!id)
+		return 0;
+
+	cdb[1] = ATA_PT_PIO_DATA_IN << 1;
+	cdb[2] = 0x0e;		/* T_DIR in, BYT_BLOK, T_LENGTH in count */
+	cdb[6] = 1;
+	cdb[14] = ATA_CMD_ID_ATA;
+	result = scsi_execute_req(sdev, cdb, DMA_FROM_DEVICE, id,
+			ATA_ID_WORDS * 2, NULL, 10 * HZ, 1, NULL);
+	if (result)
+		goto out;
+
+	for (i = 0; i < ATA_ID_WORDS; i++)
+		le16_to_cpus(&id[i]);
+	if (!ata_id_has_lba48(id) || !ata_id_has_trim(id))
+		goto out;
+
+	blocks = clamp_t(unsigned int, id[US_ATA_ID_DSM_BLOCKS], 1,
+			US_TRIM_MAX_BLOCKS);
+	trim->ranges = blocks * US_TRIM_RANGES_PER_BLOCK;
+	trim->buf = kmalloc(trim->ranges * 8 + US_TRIM_PARAM_SIZE,
+			GFP_KERNEL);
+	if (!trim->buf)
+		goto out;
+
+	trim->lun = sdev->lun;
+	trim->prov = prov;
+	trim->enabled = 1;
+	sdev_printk(KERN_INFO, sdev,
+		    "translating UNMAP to ATA TRIM, %u ranges per command\n",
+		    trim->ranges);
+
+	/* sd has to read the VPD pages and READ CAPACITY(16) we fake */
+	sdev->try_vpd_pages = 1;
+	sdev->try_rc_10_first = 0;
+
+out:
+	kfree(id);
+	return trim->enabled;
+}
+EXPORT_SYMBOL_GPL(usb_stor_trim_probe);
+
+void usb_stor_trim_release(struct us_trim *trim)
+{
+	kfree(trim->buf);
+	trim->buf = NULL;
+	trim->enabled = 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_trim_release);
+
+static void us_trim_reply(struct scsi_cmnd *srb, unsigned char *data,
+		unsigned int len)
+{
+	len = scsi_sg_copy_from_buffer(srb, data, min(len, scsi_bufflen(srb)));
+	scsi_set_resid(srb, scsi_bufflen(srb) - len);
+	srb->result = SAM_STAT_GOOD;
+}
+
+/* True if the device rejected the command as an illegal request */
+static int us_trim_rejected(struct scsi_cmnd *srb)
+{
+	struct scsi_sense_hdr sshdr;
+
+	return (srb->result & 0xff) == SAM_STAT_CHECK_CONDITION &&
+		scsi_normalize_sense(srb->sense_buffer,
+				SCSI_SENSE_BUFFERSIZE, &sshdr) &&
+		sshdr.sense_key == ILLEGAL_REQUEST;
+}
+
+/*
+ * Block Limits: one UNMAP descriptor must fit into one DSM command.
+ * Only the UNMAP fields of the device's page are changed; a page from
+ * before SBC-3 is padded out to hold them, and one is made up if the
+ * device rejected the request.
+ */
+static void us_trim_fix_block_limits(struct us_trim *trim,
+		struct scsi_cmnd *srb)
+{
+	unsigned char *page = us_trim_scratch(trim);
+	unsigned int len = 0;
+
+	if (srb->result == SAM_STAT_GOOD) {
+		len = min_t(unsigned int, scsi_bufflen(srb) -
+				scsi_get_resid(srb), US_TRIM_BLOCK_LIMITS_LEN);
+		len = scsi_sg_copy_to_buffer(srb, page, len);
+		if (len < 4 || page[1] != 0xb0)
+			return;
+		len = min(len, page[3] + 4u);
+	} else if (us_trim_rejected(srb)) {
+		memset(srb->sense_buffer, 0, SCSI_SENSE_BUFFERSIZE);
+	} else {
+		return;
+	}
+
+	if (len < US_TRIM_BLOCK_LIMITS_LEN) {
+		memset(&page[len], 0, US_TRIM_BLOCK_LIMITS_LEN - len);
+		len = US_TRIM_BLOCK_LIMITS_LEN;
+	}
+	page[0] = srb->device->type;
+	page[1] = 0xb0;
+	put_unaligned_be16(len - 4, &page[2]);
+	put_unaligned_be32((trim->ranges - 1) * US_TRIM_RANGE_MAX, &page[20]);
+	put_unaligned_be32(1, &page[24]);
+	us_trim_reply(srb, page, len);
+}
+
+/* Logical Block Provisioning: UNMAP supported */
+static void us_trim_provisioning(struct scsi_cmnd *srb)
+{
+	unsigned char page[8] = { };
+
+	page[0] = srb->device->type;
+	page[1] = 0xb2;
+	page[3] = sizeof(page) - 4;
+	page[5] = 0x80;		/* LBPU */
+	us_trim_reply(srb, page, sizeof(page));
+}
+
+/* Keep the Supported VPD Pages list sorted */
+static unsigned int us_trim_add_page(unsigned char *page, unsigned int len,
+		unsigned char code)
+{
+	unsigned int i;
+
+	if (page[3] == 0xff)
+		return len;
+	for (i = 4; i < len; i++) {
+		if (page[i] == code)
+			return len;
+		if (page[i] > code)
+			break;
+	}
+	memmove(&page[i + 1], &page[i], len - i);
+	page[i] = code;
+	page[3]++;
+	return len + 1;
+}
+
+/*
+ * Add the two pages handled above to the device's Supported VPD Pages,
+ * or make up the list if the device rejected the request.
+ */
+static void us_trim_fix_vpd_list(struct us_trim *trim, struct scsi_cmnd *srb)
+{
+	unsigned char *page = us_trim_scratch(trim);
+	unsigned int len;
+
+	if (srb->result == SAM_STAT_GOOD) {
+		len = min(scsi_bufflen(srb) - scsi_get_resid(srb), 255u);
+		len = scsi_sg_copy_to_buffer(srb, page, len);
+		if (len < 4)
+			return;
+		len = min(len, page[3] + 4u);
+	} else {
+		if (!us_trim_rejected(srb))
+			return;
+		memset(srb->sense_buffer, 0, SCSI_SENSE_BUFFERSIZE);
+		memset(page, 0, 5);
+		page[0] = srb->device->type;
+		page[3] = 1;
+		len = 5;
+	}
+
+	len = us_trim_add_page(page, len, 0xb0);
+	len = us_trim_add_page(page, len, 0xb2);
+	us_trim_reply(srb, page, len);
+}
+
+/* Report LBPME so that sd configures discard through UNMAP */
+static void us_trim_fix_capacity(struct scsi_cmnd *srb)
+{
+	unsigned char buf[16];
+
+	if (scsi_bufflen(srb) - scsi_get_resid(srb) < sizeof(buf))
+		return;
+	scsi_sg_copy_to_buffer(srb, buf, sizeof(buf));
+	buf[14] |= 0x80;
+	scsi_sg_copy_from_buffer(srb, buf, sizeof(buf));
+}
+
+/*
+ * Turn the UNMAP block descriptors into DSM LBA range entries, merging
+ * adjacent descriptors.  Returns the number of 512-byte payload blocks,
+ * 0 if there is nothing to trim, or -EINVAL if the ranges do not fit.
+ */
+static int us_trim_translate(struct us_trim *trim, struct scsi_cmnd *srb)
+{
+	unsigned char *param = us_trim_scratch(trim);
+	__le64 *range = (__le64 *) trim->buf;
+	unsigned int len, i, n = 0;
+	u64 lba, start = 0, end = 0;
+	u32 count, chunk, blocks = 0;
+
+	len = min3((unsigned int) get_unaligned_be16(&srb->cmnd[7]),
+			scsi_bufflen(srb), (unsigned int) US_TRIM_PARAM_SIZE);
+	len = scsi_sg_copy_to_buffer(srb, param, len);
+	if (len < 8)
+		return 0;
+	len = min(len, get_unaligned_be16(&param[2]) + 8u);
+
+	for (i = 8; i + 16 <= len; i += 16) {
+		lba = get_unaligned_be64(&param[i]);
+		count = get_unaligned_be32(&param[i + 8]);
+		if (lba + count < lba || lba + count > (1ULL << 48))
+			return -EINVAL;
+
+		while (count) {
+			if (n && lba == end && blocks < US_TRIM_RANGE_MAX) {
+				chunk = min(count, US_TRIM_RANGE_MAX - blocks);
+				blocks += chunk;
+			} else {
+				if (n == trim->ranges)
+					return -EINVAL;
+				chunk = min_t(u32, count, US_TRIM_RANGE_MAX);
+				start = lba;
+				blocks = chunk;
+				n++;
+			}
+			range[n - 1] = cpu_to_le64(start | (u64) blocks << 48);
+			lba += chunk;
+			count -= chunk;
+			end = lba;
+		}
+	}
+	if (!n)
+		return 0;
+
+	i = DIV_ROUND_UP(n, US_TRIM_RANGES_PER_BLOCK);
+	memset(&range[n], 0, i * 512 - n * 8);
+	return i;
+}
+
+/*
+ * Look at a command before it is sent.  VPD pages we fake are answered
+ * here (US_TRIM_DONE), an UNMAP is rewritten into ATA_16 DSM TRIM
+ * (US_TRIM_TRANSLATED) and must be passed to usb_stor_trim_complete()
+ * or usb_stor_trim_cancel() before it is returned to the SCSI layer.
+ * Returns -EBUSY if another UNMAP is still being translated.
+ */
+int usb_stor_trim_queue(struct us_trim *trim, struct scsi_cmnd *srb)
+{
+	unsigned char cdb[16] = { ATA_16 };
+	int blocks;
+
+	if (!us_trim_active(trim) || srb->device->lun != trim->lun)
+		return US_TRIM_PASS;
+
+	switch (srb->cmnd[0]) {
+	case INQUIRY:
+		if (!(srb->cmnd[1] & 0x01) || srb->cmnd[2] != 0xb2)
+			return US_TRIM_PASS;
+		us_trim_provisioning(srb);
+		return US_TRIM_DONE;
+
+	case UNMAP:
+		break;
+
+	default:
+		return US_TRIM_PASS;
+	}
+
+	if (trim->srb)
+		return -EBUSY;
+
+	blocks = us_trim_translate(trim, srb);
+	if (blocks <= 0) {
+		if (blocks < 0) {
+			memcpy(srb->sense_buffer, usb_stor_sense_invalidCDB,
+			       sizeof(usb_stor_sense_invalidCDB));
+			srb->result = SAM_STAT_CHECK_CONDITION;
+		} else {
+			srb->result = SAM_STAT_GOOD;
+		}
+		scsi_set_resid(srb, 0);
+		return US_TRIM_DONE;
+	}
+
+	cdb[1] = (ATA_PT_DMA << 1) | 0x01;	/* EXTEND */
+	cdb[2] = 0x06;		/* T_DIR out, BYT_BLOK, T_LENGTH in count */
+	cdb[4] = ATA_DSM_TRIM;
+	cdb[5] = blocks >> 8;
+	cdb[6] = blocks;
+	cdb[13] = ATA_LBA;
+	cdb[14] = ATA_CMD_DSM;
+
+	/* Borrow the error handler's save area, as auto-sense does */
+	scsi_eh_prep_cmnd(srb, &trim->ses, NULL, 0, 0);
+	memcpy(srb->cmnd, cdb, sizeof(cdb));
+	srb->cmd_len = sizeof(cdb);
+	sg_init_one(&trim->sg, trim->buf, blocks * 512);
+	srb->sdb.table.sgl = &trim->sg;
+	srb->sdb.table.nents = 1;
+	srb->sdb.length = blocks * 512;
+	srb->sc_data_direction = DMA_TO_DEVICE;
+	trim->srb = srb;
+
+	return US_TRIM_TRANSLATED;
+}
+EXPORT_SYMBOL_GPL(usb_stor_trim_queue);
+
+/* Undo a translation for a command that never reached the device */
+void usb_stor_trim_cancel(struct us_trim *trim, struct scsi_cmnd *srb)
+{
+	if (trim->srb != srb)
+		return;
+	scsi_eh_restore_cmnd(srb, &trim->ses);
+	trim->srb = NULL;
+}
+EXPORT_SYMBOL_GPL(usb_stor_trim_cancel);
+
+/*
+ * Called for every command the device executed, before anything else
+ * looks at the result.  Turns a translated command back into the UNMAP
+ * it came from and patches the responses that make discard visible.
+ */
+void usb_stor_trim_complete(struct us_trim *trim, struct scsi_cmnd *srb)
+{
+	int result;
+
+	if (trim->srb == srb) {
+		result = srb->result;
+		scsi_eh_restore_cmnd(srb, &trim->ses);
+		trim->srb = NULL;
+		srb->result = result;
+		scsi_set_resid(srb, result ? scsi_bufflen(srb) : 0);
+		return;
+	}
+
+	if (!us_trim_active(trim) || srb->device->lun != trim->lun ||
+			host_byte(srb->result) != DID_OK)
+		return;
+
+	if (srb->cmnd[0] == INQUIRY && (srb->cmnd[1] & 0x01) &&
+			srb->cmnd[2] == 0x00)
+		us_trim_fix_vpd_list(trim, srb);
+	else if (srb->cmnd[0] == INQUIRY && (srb->cmnd[1] & 0x01) &&
+			srb->cmnd[2] == 0xb0)
+		us_trim_fix_block_limits(trim, srb);
+	else if (srb->cmnd[0] == SERVICE_ACTION_IN_16 &&
+			(srb->cmnd[1] & 0x1f) == SAI_READ_CAPACITY_16 &&
+			srb->result == SAM_STAT_GOOD)
+		us_trim_fix_capacity(srb);
+}
+EXPORT_SYMBOL_GPL(usb_stor_trim_complete);
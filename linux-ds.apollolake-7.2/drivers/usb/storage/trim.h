@@ -0,0 +1,53 @@
+/* Driver for USB Mass Storage compliant devices
+ * SAT TRIM Translation Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _TRIM_H_
+#define _TRIM_H_
+
+#include <linux/scatterlist.h>
+#include <linux/types.h>
+
+#include <scsi/scsi_eh.h>
+
+struct scsi_cmnd;
+struct scsi_device;
+struct us_provisioning;
+
+/* usb_stor_trim_queue() return values */
+#define US_TRIM_PASS		0	/* send the command unchanged    */
+#define US_TRIM_DONE		1	/* command answered, complete it */
+#define US_TRIM_TRANSLATED	2	/* command now carries DSM TRIM  */
+
+struct us_trim {
+	unsigned int		enabled:1;	/* disk takes DSM TRIM         */
+	struct us_provisioning	*prov;		/* ... until this is disabled  */
+	u64			lun;		/* ... on this lun             */
+	unsigned int		ranges;		/* LBA ranges per DSM command  */
+	unsigned char		*buf;		/* DSM payload, ranges * 8     */
+
+	/* the UNMAP currently sent as ATA PASS-THROUGH */
+	struct scsi_cmnd	*srb;
+	struct scsi_eh_save	ses;
+	struct scatterlist	sg;
+};
+
+extern int usb_stor_trim_probe(struct us_trim *trim,
+		struct us_provisioning *prov, struct scsi_device *sdev);
+extern void usb_stor_trim_release(struct us_trim *trim);
+extern int usb_stor_trim_queue(struct us_trim *trim, struct scsi_cmnd *srb);
+extern void usb_stor_trim_complete(struct us_trim *trim,
+		struct scsi_cmnd *srb);
+extern void usb_stor_trim_cancel(struct us_trim *trim, struct scsi_cmnd *srb);
+
+#endif
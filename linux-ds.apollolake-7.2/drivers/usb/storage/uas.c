@@ -32,6 +32,8 @@
 
 #include "uas-detect.h"
 #include "scsiglue.h"
+#include "respcache.h"
+#include "trim.h"
 
 #ifdef MY_DEF_HERE
 #else /* MY_DEF_HERE */
@@ -55,6 +57,42 @@ struct uas_dev_info {
 };
 #endif /* MY_DEF_HERE */
 
+/*
+ * struct uas_dev_info is shared with the core on some platforms, so state
+ * private to this driver lives in a wrapper around it rather than in it.
+ */
+struct uas_dev_priv {
+	struct uas_dev_info info;
+	struct us_cache cache;		/* replayed management commands */
+	struct us_provisioning prov;	/* UNMAP / WRITE SAME given up on */
+	struct us_trim trim;		/* UNMAP sent as ATA TRIM */
+
+	/*
+	 * TEST UNIT READY polling through QUERY ASYNC EVENT.  These are
+	 * plain bools rather than bitfields because the reset paths clear
+	 * qae_ready without devinfo->lock.
+	 */
+	u64 qae_lun;			/* lun of the last good TUR */
+	bool qae_unsupported;		/* bridge rejected the TMF */
+	bool qae_ready;			/* last TUR to qae_lun passed */
+	bool qae_bypass;		/* send the next TUR to the device */
+};
+
+static inline struct uas_dev_priv *uas_priv(struct uas_dev_info *devinfo)
+{
+	return container_of(devinfo, struct uas_dev_priv, info);
+}
+
+/*
+ * The scsi layer never has more than qdepth - 2 commands outstanding, so
+ * the second to last uas-tag is free to carry a QUERY ASYNC EVENT task
+ * management function in place of a TEST UNIT READY.
+ */
+static inline unsigned int uas_qae_tag(struct uas_dev_info *devinfo)
+{
+	return devinfo->qdepth - 1;
+}
+
 enum {
 	SUBMIT_STATUS_URB	= (1 << 1),
 	ALLOC_DATA_IN_URB	= (1 << 2),
@@ -68,6 +106,7 @@ enum {
 	DATA_OUT_URB_INFLIGHT   = (1 << 10),
 	COMMAND_ABORTED         = (1 << 11),
 	IS_IN_WORK_LIST         = (1 << 12),
+	QUERY_ASYNC_EVENT       = (1 << 13),
 };
 
 /* Overrides scsi_pointer */
@@ -214,7 +253,7 @@ static void uas_log_cmd_state(struct scsi_cmnd *cmnd, const char *prefix,
 		return;
 
 	scmd_printk(KERN_INFO, cmnd,
-		    "%s %d uas-tag %d inflight:%s%s%s%s%s%s%s%s%s%s%s%s ",
+		    "%s %d uas-tag %d inflight:%s%s%s%s%s%s%s%s%s%s%s%s%s ",
 		    prefix, status, cmdinfo->uas_tag,
 		    (ci->state & SUBMIT_STATUS_URB)     ? " s-st"  : "",
 		    (ci->state & ALLOC_DATA_IN_URB)     ? " a-in"  : "",
@@ -227,7 +266,8 @@ static void uas_log_cmd_state(struct scsi_cmnd *cmnd, const char *prefix,
 		    (ci->state & DATA_IN_URB_INFLIGHT)  ? " IN"    : "",
 		    (ci->state & DATA_OUT_URB_INFLIGHT) ? " OUT"   : "",
 		    (ci->state & COMMAND_ABORTED)       ? " abort" : "",
-		    (ci->state & IS_IN_WORK_LIST)       ? " work"  : "");
+		    (ci->state & IS_IN_WORK_LIST)       ? " work"  : "",
+		    (ci->state & QUERY_ASYNC_EVENT)     ? " qae"   : "");
 	scsi_print_command(cmnd);
 }
 
@@ -250,6 +290,63 @@ static void uas_free_unsubmitted_urbs(struct scsi_cmnd *cmnd)
 		usb_free_urb(cmdinfo->data_out_urb);
 }
 
+/*
+ * QUERY ASYNC EVENT only tells us whether a unit attention is pending, so
+ * it may stand in for TEST UNIT READY only while the last real TUR to the
+ * same lun passed and nothing has failed since.
+ */
+static void uas_qae_track(struct uas_dev_info *devinfo, struct scsi_cmnd *cmnd)
+{
+	struct uas_dev_priv *priv = uas_priv(devinfo);
+
+	if (cmnd->cmnd[0] == TEST_UNIT_READY) {
+		priv->qae_ready = (cmnd->result == SAM_STAT_GOOD);
+		priv->qae_lun = cmnd->device->lun;
+	} else if (cmnd->result) {
+		priv->qae_ready = false;
+	}
+}
+
+/* Should this TEST UNIT READY be answered with QUERY ASYNC EVENT? */
+static int uas_use_qae(struct uas_dev_info *devinfo, struct scsi_cmnd *cmnd)
+{
+	struct uas_dev_priv *priv = uas_priv(devinfo);
+
+	lockdep_assert_held(&devinfo->lock);
+	if (cmnd->cmnd[0] != TEST_UNIT_READY || priv->qae_unsupported)
+		return 0;
+	if (priv->qae_bypass) {
+		priv->qae_bypass = false;
+		return 0;
+	}
+	return priv->qae_ready && priv->qae_lun == cmnd->device->lun &&
+		!devinfo->cmnd[uas_qae_tag(devinfo) - 1];
+}
+
+static void uas_qae_response(struct scsi_cmnd *cmnd, u8 response_code)
+{
+	struct uas_dev_info *devinfo = cmnd->device->hostdata;
+	struct uas_dev_priv *priv = uas_priv(devinfo);
+
+	switch (response_code) {
+	case RC_TMF_COMPLETE:
+		/* Nothing pending, the unit is as ready as it was */
+		cmnd->result = SAM_STAT_GOOD;
+		return;
+	case RC_TMF_SUCCEEDED:
+		/* Let the device report the pending event to a real TUR */
+		break;
+	default:
+		sdev_printk(KERN_INFO, cmnd->device,
+			    "QUERY ASYNC EVENT not supported (%d), polling with TEST UNIT READY\n",
+			    response_code);
+		priv->qae_unsupported = true;
+		break;
+	}
+	priv->qae_bypass = true;
+	cmnd->result = DID_REQUEUE << 16;
+}
+
 static int uas_try_complete(struct scsi_cmnd *cmnd, const char *caller)
 {
 	struct uas_cmd_info *cmdinfo = (void *)&cmnd->SCp;
@@ -263,6 +360,11 @@ static int uas_try_complete(struct scsi_cmnd *cmnd, const char *caller)
 		return -EBUSY;
 	devinfo->cmnd[cmdinfo->uas_tag - 1] = NULL;
 	uas_free_unsubmitted_urbs(cmnd);
+	usb_stor_trim_complete(&uas_priv(devinfo)->trim, cmnd);
+	if (!(cmdinfo->state & QUERY_ASYNC_EVENT))
+		uas_qae_track(devinfo, cmnd);
+	usb_stor_check_provisioning(&uas_priv(devinfo)->prov, cmnd);
+	usb_stor_cache_complete(&uas_priv(devinfo)->cache, cmnd);
 	cmnd->scsi_done(cmnd);
 	return 0;
 }
@@ -319,6 +421,16 @@ static void uas_stat_cmplt(struct urb *urb)
 		goto out;
 	}
 
+	if (cmdinfo->state & QUERY_ASYNC_EVENT) {
+		/* Anything but a RESPONSE IU means the bridge got it wrong */
+		uas_qae_response(cmnd, iu->iu_id == IU_ID_RESPONSE ?
+				 ((struct response_iu *)iu)->response_code :
+				 RC_INVALID_INFO_UNIT);
+		cmdinfo->state &= ~COMMAND_INFLIGHT;
+		uas_try_complete(cmnd, __func__);
+		goto out;
+	}
+
 	switch (iu->iu_id) {
 	case IU_ID_STATUS:
 		uas_sense(urb, cmnd);
@@ -481,6 +593,36 @@ static struct urb *uas_alloc_sense_urb(struct uas_dev_info *devinfo, gfp_t gfp,
 	return NULL;
 }
 
+static struct urb *uas_alloc_qae_urb(struct uas_dev_info *devinfo, gfp_t gfp,
+				     struct scsi_cmnd *cmnd)
+{
+	struct usb_device *udev = devinfo->udev;
+	struct uas_cmd_info *cmdinfo = (void *)&cmnd->SCp;
+	struct urb *urb = usb_alloc_urb(0, gfp);
+	struct task_mgmt_iu *iu;
+
+	if (!urb)
+		goto out;
+
+	iu = kzalloc(sizeof(*iu), gfp);
+	if (!iu)
+		goto free;
+
+	iu->iu_id = IU_ID_TASK_MGMT;
+	iu->tag = cpu_to_be16(cmdinfo->uas_tag);
+	iu->function = TMF_QUERY_ASYNC_EVENT;
+	int_to_scsilun(cmnd->device->lun, &iu->lun);
+
+	usb_fill_bulk_urb(urb, udev, devinfo->cmd_pipe, iu, sizeof(*iu),
+							uas_cmd_cmplt, NULL);
+	urb->transfer_flags |= URB_FREE_BUFFER;
+ out:
+	return urb;
+ free:
+	usb_free_urb(urb);
+	return NULL;
+}
+
 static struct urb *uas_alloc_cmd_urb(struct uas_dev_info *devinfo, gfp_t gfp,
 					struct scsi_cmnd *cmnd)
 {
@@ -601,7 +743,10 @@ static int uas_submit_urbs(struct scsi_cmnd *cmnd,
 	}
 
 	if (cmdinfo->state & ALLOC_CMD_URB) {
-		cmdinfo->cmd_urb = uas_alloc_cmd_urb(devinfo, gfp, cmnd);
+		if (cmdinfo->state & QUERY_ASYNC_EVENT)
+			cmdinfo->cmd_urb = uas_alloc_qae_urb(devinfo, gfp, cmnd);
+		else
+			cmdinfo->cmd_urb = uas_alloc_cmd_urb(devinfo, gfp, cmnd);
 		if (!cmdinfo->cmd_urb)
 			return SCSI_MLQUEUE_DEVICE_BUSY;
 		cmdinfo->state &= ~ALLOC_CMD_URB;
@@ -647,6 +792,12 @@ static int uas_queuecommand_lck(struct scsi_cmnd *cmnd,
 		return 0;
 	}
 
+	/* Answer repeated management commands without taking a tag */
+	if (usb_stor_cache_lookup(&uas_priv(devinfo)->cache, cmnd)) {
+		cmnd->scsi_done(cmnd);
+		return 0;
+	}
+
 	spin_lock_irqsave(&devinfo->lock, flags);
 
 	if (devinfo->resetting) {
@@ -655,8 +806,19 @@ static int uas_queuecommand_lck(struct scsi_cmnd *cmnd,
 		goto zombie;
 	}
 
+	memset(cmdinfo, 0, sizeof(*cmdinfo));
+
+	if (uas_use_qae(devinfo, cmnd)) {
+		/* Poll with the task management function on its own tag */
+		idx = uas_qae_tag(devinfo) - 1;
+		cmdinfo->state = QUERY_ASYNC_EVENT;
+		goto found;
+	}
+
 	/* Find a free uas-tag */
 	for (idx = 0; idx < devinfo->qdepth; idx++) {
+		if (idx == uas_qae_tag(devinfo) - 1)
+			continue;
 		if (!devinfo->cmnd[idx])
 			break;
 	}
@@ -665,11 +827,20 @@ static int uas_queuecommand_lck(struct scsi_cmnd *cmnd,
 		return SCSI_MLQUEUE_DEVICE_BUSY;
 	}
 
+found:
 	cmnd->scsi_done = done;
 
-	memset(cmdinfo, 0, sizeof(*cmdinfo));
+	switch (usb_stor_trim_queue(&uas_priv(devinfo)->trim, cmnd)) {
+	case -EBUSY:
+		spin_unlock_irqrestore(&devinfo->lock, flags);
+		return SCSI_MLQUEUE_DEVICE_BUSY;
+	case US_TRIM_DONE:
+		cmnd->scsi_done(cmnd);
+		goto zombie;
+	}
+
 	cmdinfo->uas_tag = idx + 1; /* uas-tag == usb-stream-id, so 1 based */
-	cmdinfo->state = SUBMIT_STATUS_URB | ALLOC_CMD_URB | SUBMIT_CMD_URB;
+	cmdinfo->state |= SUBMIT_STATUS_URB | ALLOC_CMD_URB | SUBMIT_CMD_URB;
 
 	switch (cmnd->sc_data_direction) {
 	case DMA_FROM_DEVICE:
@@ -693,6 +864,7 @@ static int uas_queuecommand_lck(struct scsi_cmnd *cmnd,
 	 * of queueing, no matter how fatal the error
 	 */
 	if (err == -ENODEV) {
+		usb_stor_trim_cancel(&uas_priv(devinfo)->trim, cmnd);
 		cmnd->result = DID_ERROR << 16;
 		cmnd->scsi_done(cmnd);
 		goto zombie;
@@ -700,6 +872,7 @@ static int uas_queuecommand_lck(struct scsi_cmnd *cmnd,
 	if (err) {
 		/* If we did nothing, give up now */
 		if (cmdinfo->state & SUBMIT_STATUS_URB) {
+			usb_stor_trim_cancel(&uas_priv(devinfo)->trim, cmnd);
 			spin_unlock_irqrestore(&devinfo->lock, flags);
 			return SCSI_MLQUEUE_DEVICE_BUSY;
 		}
@@ -734,6 +907,10 @@ static int uas_eh_abort_handler(struct scsi_cmnd *cmnd)
 	/* Ensure that try_complete does not call scsi_done */
 	cmdinfo->state |= COMMAND_ABORTED;
 
+	/* A bridge that never answers the TMF gets plain TURs from now on */
+	if (cmdinfo->state & QUERY_ASYNC_EVENT)
+		uas_priv(devinfo)->qae_unsupported = true;
+
 	/* Drop all refs to this cmnd, kill data urbs to break their ref */
 	devinfo->cmnd[cmdinfo->uas_tag - 1] = NULL;
 	if (cmdinfo->state & DATA_IN_URB_INFLIGHT)
@@ -754,6 +931,14 @@ static int uas_eh_abort_handler(struct scsi_cmnd *cmnd)
 		usb_put_urb(data_out_urb);
 	}
 
+	/*
+	 * A DSM TRIM data stage points at the trim buffer, so the UNMAP may
+	 * only be restored, and the buffer reused, once its URB is dead.
+	 */
+	spin_lock_irqsave(&devinfo->lock, flags);
+	usb_stor_trim_cancel(&uas_priv(devinfo)->trim, cmnd);
+	spin_unlock_irqrestore(&devinfo->lock, flags);
+
 	return FAILED;
 }
 
@@ -782,6 +967,8 @@ static int uas_eh_bus_reset_handler(struct scsi_cmnd *cmnd)
 	usb_kill_anchored_urbs(&devinfo->sense_urbs);
 	usb_kill_anchored_urbs(&devinfo->data_urbs);
 	uas_zap_pending(devinfo, DID_RESET);
+	usb_stor_cache_invalidate(&uas_priv(devinfo)->cache);
+	WRITE_ONCE(uas_priv(devinfo)->qae_ready, false);
 
 	err = usb_reset_device(udev);
 
@@ -845,10 +1032,58 @@ static int uas_slave_configure(struct scsi_device *sdev)
 	if (devinfo->flags & US_FL_BROKEN_FUA)
 		sdev->broken_fua = 1;
 
+	/*
+	 * Let sd see UNMAP / WRITE SAME if the bridge reports them, or
+	 * translate UNMAP ourselves if only the disk behind it does TRIM
+	 */
+	if (!(devinfo->flags & US_FL_NO_READ_CAPACITY_16) &&
+			!usb_stor_probe_provisioning(&uas_priv(devinfo)->prov, sdev) &&
+			!(devinfo->flags & US_FL_NO_ATA_1X))
+		usb_stor_trim_probe(&uas_priv(devinfo)->trim,
+				    &uas_priv(devinfo)->prov, sdev);
+
 	scsi_change_queue_depth(sdev, devinfo->qdepth - 2);
 	return 0;
 }
 
+static ssize_t cache_ttl_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct uas_dev_info *devinfo = to_scsi_device(dev)->hostdata;
+
+	return sprintf(buf, "%u\n", uas_priv(devinfo)->cache.ttl);
+}
+
+static ssize_t cache_ttl_store(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct uas_dev_info *devinfo = to_scsi_device(dev)->hostdata;
+	unsigned int ttl;
+
+	if (kstrtouint(buf, 0, &ttl))
+		return -EINVAL;
+
+	usb_stor_cache_set_ttl(&uas_priv(devinfo)->cache, ttl);
+	return count;
+}
+static DEVICE_ATTR_RW(cache_ttl);
+
+static ssize_t cache_stats_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct uas_dev_info *devinfo = to_scsi_device(dev)->hostdata;
+
+	return usb_stor_cache_show_stats(&uas_priv(devinfo)->cache, buf);
+}
+static DEVICE_ATTR_RO(cache_stats);
+
+static struct device_attribute *uas_sdev_attrs[] = {
+	&dev_attr_cache_ttl,
+	&dev_attr_cache_stats,
+	NULL,
+};
+
 static struct scsi_host_template uas_host_template = {
 	.module = THIS_MODULE,
 	.name = "uas",
@@ -862,6 +1097,7 @@ static struct scsi_host_template uas_host_template = {
 	.this_id = -1,
 	.sg_tablesize = SG_NONE,
 	.skip_settle_delay = 1,
+	.sdev_attrs = uas_sdev_attrs,
 #if defined(MY_ABC_HERE) || defined(MY_DEF_HERE)
 	.syno_port_type = SYNO_PORT_TYPE_USB,
 #endif /* MY_ABC_HERE */
@@ -955,7 +1191,7 @@ static int uas_probe(struct usb_interface *intf, const struct usb_device_id *id)
 		return -ENODEV;
 
 	shost = scsi_host_alloc(&uas_host_template,
-				sizeof(struct uas_dev_info));
+				sizeof(struct uas_dev_priv));
 	if (!shost)
 		goto set_alt0;
 
@@ -977,11 +1213,16 @@ static int uas_probe(struct usb_interface *intf, const struct usb_device_id *id)
 	spin_lock_init(&devinfo->lock);
 	INIT_WORK(&devinfo->work, uas_do_work);
 	INIT_WORK(&devinfo->scan_work, uas_scan_work);
+	usb_stor_provisioning_init(&uas_priv(devinfo)->prov, shost);
 
-	result = uas_configure_endpoints(devinfo);
+	result = usb_stor_cache_init(&uas_priv(devinfo)->cache);
 	if (result)
 		goto set_alt0;
 
+	result = uas_configure_endpoints(devinfo);
+	if (result)
+		goto free_cache;
+
 	/*
 	 * 1 tag is reserved for untagged commands +
 	 * 1 tag to avoid off by one errors in some bridge firmwares
@@ -1001,6 +1242,10 @@ static int uas_probe(struct usb_interface *intf, const struct usb_device_id *id)
 free_streams:
 	uas_free_streams(devinfo);
 	usb_set_intfdata(intf, NULL);
+free_cache:
+	usb_stor_cache_release(&uas_priv(devinfo)->cache);
+	usb_stor_trim_release(&uas_priv(devinfo)->trim);
+	usb_stor_provisioning_release(&uas_priv(devinfo)->prov);
 set_alt0:
 	usb_set_interface(udev, intf->altsetting[0].desc.bInterfaceNumber, 0);
 	if (shost)
@@ -1091,6 +1336,9 @@ static int uas_post_reset(struct usb_interface *intf)
 	if (devinfo->shutdown)
 		return 0;
 
+	usb_stor_cache_invalidate(&uas_priv(devinfo)->cache);
+	WRITE_ONCE(uas_priv(devinfo)->qae_ready, false);
+
 	err = uas_configure_endpoints(devinfo);
 	if (err && err != -ENODEV)
 		shost_printk(KERN_ERR, shost,
@@ -1132,6 +1380,9 @@ static int uas_reset_resume(struct usb_interface *intf)
 	unsigned long flags;
 	int err;
 
+	usb_stor_cache_invalidate(&uas_priv(devinfo)->cache);
+	WRITE_ONCE(uas_priv(devinfo)->qae_ready, false);
+
 	err = uas_configure_endpoints(devinfo);
 	if (err) {
 		shost_printk(KERN_ERR, shost,
@@ -1171,6 +1422,9 @@ static void uas_disconnect(struct usb_interface *intf)
 
 	scsi_remove_host(shost);
 	uas_free_streams(devinfo);
+	usb_stor_cache_release(&uas_priv(devinfo)->cache);
+	usb_stor_trim_release(&uas_priv(devinfo)->trim);
+	usb_stor_provisioning_release(&uas_priv(devinfo)->prov);
 	scsi_host_put(shost);
 }
 
@@ -57,7 +57,7 @@
 #include <linux/freezer.h>
 #include <linux/module.h>
 #include <linux/slab.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
 #include <linux/mutex.h>
 #include <linux/utsname.h>
 #if defined(CONFIG_USB_ETRON_HUB)
@@ -94,10 +94,20 @@ static unsigned int delay_use = 1;
 module_param(delay_use, uint, S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(delay_use, "seconds to delay before using a new device");
 
+static bool ready_poll = 1;
+module_param(ready_poll, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ready_poll, "scan Bulk-only devices as soon as they answer "
+		 "TEST UNIT READY, within delay_use");
+
 static char quirks[128];
 module_param_string(quirks, quirks, sizeof(quirks), S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(quirks, "supplemental list of device IDs and their quirks");
 
+static char delays[128];
+module_param_string(delays, delays, sizeof(delays), S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(delays, "list of device IDs and the microseconds to wait "
+		 "between Bulk-only stages");
+
 #ifdef MY_DEF_HERE
 extern int syno_all_usb_uas_enabled;
 #endif /* MY_DEF_HERE */
@@ -328,134 +338,152 @@ static int usb_stor_no_test_unit_ready(struct us_data *us)
 }
 #endif /* CONFIG_USB_ETRON_HUB */
 
-static int usb_stor_control_thread(void * __us)
+/*
+ * Commands are run from us->cmnd_work, queued on a workqueue of the
+ * device's own.  Hosts only ever run one command at a time, so the
+ * workqueue runs one item at a time, and its workers come from the
+ * shared pool and only exist while there is something to do.  Each
+ * device gets its own rescuer, so under memory pressure a device that
+ * is slow to answer holds up only its own commands.  Subdrivers queue
+ * their deferred I/O here as well, to have it ordered with commands.
+ *
+ * The transports themselves sleep for their URBs, so subdrivers see
+ * the same synchronous interface whichever context runs them.
+ */
+
+static void usb_stor_control_work(struct work_struct *work)
 {
-	struct us_data *us = (struct us_data *)__us;
+	struct us_data *us = container_of(work, struct us_data, cmnd_work);
 	struct Scsi_Host *host = us_to_host(us);
 
-	for (;;) {
-		usb_stor_dbg(us, "*** thread sleeping\n");
-		if (wait_for_completion_interruptible(&us->cmnd_ready))
-			break;
-
-		usb_stor_dbg(us, "*** thread awakened\n");
-
-		/* lock the device pointers */
-		mutex_lock(&(us->dev_mutex));
+	usb_stor_dbg(us, "*** work running\n");
 
-		/* lock access to the state */
-		scsi_lock(host);
+	/* lock the device pointers */
+	mutex_lock(&(us->dev_mutex));
 
-		/* When we are called with no command pending, we're done */
-		if (us->srb == NULL) {
-			scsi_unlock(host);
-			mutex_unlock(&us->dev_mutex);
-			usb_stor_dbg(us, "-- exiting\n");
-			break;
-		}
-
-		/* has the command timed out *already* ? */
-		if (test_bit(US_FLIDX_TIMED_OUT, &us->dflags)) {
-			us->srb->result = DID_ABORT << 16;
-			goto SkipForAbort;
-		}
+	/* lock access to the state */
+	scsi_lock(host);
 
+	/* Nothing to do if the command has gone already */
+	if (us->srb == NULL) {
 		scsi_unlock(host);
+		mutex_unlock(&us->dev_mutex);
+		return;
+	}
 
-		/* reject the command if the direction indicator
-		 * is UNKNOWN
-		 */
-		if (us->srb->sc_data_direction == DMA_BIDIRECTIONAL) {
-			usb_stor_dbg(us, "UNKNOWN data direction\n");
-			us->srb->result = DID_ERROR << 16;
-		}
+	/* has the command timed out *already* ? */
+	if (test_bit(US_FLIDX_TIMED_OUT, &us->dflags)) {
+		us->srb->result = DID_ABORT << 16;
+		goto SkipForAbort;
+	}
 
-		/* reject if target != 0 or if LUN is higher than
-		 * the maximum known LUN
-		 */
-		else if (us->srb->device->id &&
-				!(us->fflags & US_FL_SCM_MULT_TARG)) {
-			usb_stor_dbg(us, "Bad target number (%d:%llu)\n",
-				     us->srb->device->id,
-				     us->srb->device->lun);
-			us->srb->result = DID_BAD_TARGET << 16;
-		}
+	scsi_unlock(host);
 
-		else if (us->srb->device->lun > us->max_lun) {
-			usb_stor_dbg(us, "Bad LUN (%d:%llu)\n",
-				     us->srb->device->id,
-				     us->srb->device->lun);
-			us->srb->result = DID_BAD_TARGET << 16;
-		}
+	/* reject the command if the direction indicator
+	 * is UNKNOWN
+	 */
+	if (us->srb->sc_data_direction == DMA_BIDIRECTIONAL) {
+		usb_stor_dbg(us, "UNKNOWN data direction\n");
+		us->srb->result = DID_ERROR << 16;
+	}
+
+	/* reject if target != 0 or if LUN is higher than
+	 * the maximum known LUN
+	 */
+	else if (us->srb->device->id &&
+			!(us->fflags & US_FL_SCM_MULT_TARG)) {
+		usb_stor_dbg(us, "Bad target number (%d:%llu)\n",
+			     us->srb->device->id,
+			     us->srb->device->lun);
+		us->srb->result = DID_BAD_TARGET << 16;
+	}
 
-		/* Handle those devices which need us to fake
-		 * their inquiry data */
-		else if ((us->srb->cmnd[0] == INQUIRY) &&
-			    (us->fflags & US_FL_FIX_INQUIRY)) {
-			unsigned char data_ptr[36] = {
-			    0x00, 0x80, 0x02, 0x02,
-			    0x1F, 0x00, 0x00, 0x00};
+	else if (us->srb->device->lun > us->max_lun) {
+		usb_stor_dbg(us, "Bad LUN (%d:%llu)\n",
+			     us->srb->device->id,
+			     us->srb->device->lun);
+		us->srb->result = DID_BAD_TARGET << 16;
+	}
 
-			usb_stor_dbg(us, "Faking INQUIRY command\n");
-			fill_inquiry_response(us, data_ptr, 36);
-			us->srb->result = SAM_STAT_GOOD;
-		}
+	/* Handle those devices which need us to fake
+	 * their inquiry data */
+	else if ((us->srb->cmnd[0] == INQUIRY) &&
+		    (us->fflags & US_FL_FIX_INQUIRY)) {
+		unsigned char data_ptr[36] = {
+		    0x00, 0x80, 0x02, 0x02,
+		    0x1F, 0x00, 0x00, 0x00};
+
+		usb_stor_dbg(us, "Faking INQUIRY command\n");
+		fill_inquiry_response(us, data_ptr, 36);
+		us->srb->result = SAM_STAT_GOOD;
+	}
 #if defined(CONFIG_USB_ETRON_HUB)
-		else if (usb_is_etron_hcd(us->pusb_dev) && !usb_stor_no_test_unit_ready(us)) {
-				usb_stor_dbg(us, "Ignoring TEST_UNIT_READY command\n");
-				us->srb->result = SAM_STAT_GOOD;
-		}
+	else if (usb_is_etron_hcd(us->pusb_dev) && !usb_stor_no_test_unit_ready(us)) {
+			usb_stor_dbg(us, "Ignoring TEST_UNIT_READY command\n");
+			us->srb->result = SAM_STAT_GOOD;
+	}
 #endif /* CONFIG_USB_ETRON_HUB */
-		/* we've got a command, let's do it! */
-		else {
-			US_DEBUG(usb_stor_show_command(us, us->srb));
-			us->proto_handler(us->srb, us);
-			usb_mark_last_busy(us->pusb_dev);
-		}
-
-		/* lock access to the state */
-		scsi_lock(host);
+	/* Answer repeated management commands from the cache */
+	else if (usb_stor_cache_lookup(&us->cache, us->srb)) {
+		usb_stor_dbg(us, "Answered command 0x%x from cache\n",
+			     us->srb->cmnd[0]);
+	}
 
-		/* indicate that the command is done */
-		if (us->srb->result != DID_ABORT << 16) {
-			usb_stor_dbg(us, "scsi cmd done, result=0x%x\n",
-				     us->srb->result);
-			us->srb->scsi_done(us->srb);
-		} else {
-SkipForAbort:
-			usb_stor_dbg(us, "scsi command aborted\n");
-		}
+	/* Answer the VPD pages faked for TRIM translation */
+	else if (usb_stor_trim_queue(&us->trim, us->srb) ==
+			US_TRIM_DONE) {
+		usb_stor_dbg(us, "Completed command 0x%x for TRIM\n",
+			     us->srb->cmnd[0]);
+	}
 
-		/* If an abort request was received we need to signal that
-		 * the abort has finished.  The proper test for this is
-		 * the TIMED_OUT flag, not srb->result == DID_ABORT, because
-		 * the timeout might have occurred after the command had
-		 * already completed with a different result code. */
-		if (test_bit(US_FLIDX_TIMED_OUT, &us->dflags)) {
-			complete(&(us->notify));
-
-			/* Allow USB transfers to resume */
-			clear_bit(US_FLIDX_ABORTING, &us->dflags);
-			clear_bit(US_FLIDX_TIMED_OUT, &us->dflags);
-		}
+	/* we've got a command, let's do it! */
+	else {
+		US_DEBUG(usb_stor_show_command(us, us->srb));
+		us->proto_handler(us->srb, us);
+		usb_mark_last_busy(us->pusb_dev);
+		usb_stor_trim_complete(&us->trim, us->srb);
+		usb_stor_check_provisioning(&us->prov, us->srb);
+		usb_stor_cache_complete(&us->cache, us->srb);
+		usb_stor_flush_note(&us->flush, us->srb);
+	}
 
-		/* finished working on this command */
-		us->srb = NULL;
-		scsi_unlock(host);
+	/* lock access to the state */
+	scsi_lock(host);
 
-		/* unlock the device pointers */
-		mutex_unlock(&us->dev_mutex);
-	} /* for (;;) */
+	/* indicate that the command is done */
+	if (us->srb->result != DID_ABORT << 16) {
+		usb_stor_dbg(us, "scsi cmd done, result=0x%x\n",
+			     us->srb->result);
+		us->srb->scsi_done(us->srb);
+	} else {
+SkipForAbort:
+		usb_stor_dbg(us, "scsi command aborted\n");
+	}
 
-	/* Wait until we are told to stop */
-	for (;;) {
-		set_current_state(TASK_INTERRUPTIBLE);
-		if (kthread_should_stop())
-			break;
-		schedule();
+	/* If an abort request was received we need to signal that
+	 * the abort has finished.  The proper test for this is
+	 * the TIMED_OUT flag, not srb->result == DID_ABORT, because
+	 * the timeout might have occurred after the command had
+	 * already completed with a different result code. */
+	if (test_bit(US_FLIDX_TIMED_OUT, &us->dflags)) {
+		complete(&(us->notify));
+
+		/* Allow USB transfers to resume */
+		clear_bit(US_FLIDX_ABORTING, &us->dflags);
+		clear_bit(US_FLIDX_TIMED_OUT, &us->dflags);
 	}
-	__set_current_state(TASK_RUNNING);
-	return 0;
+
+	/* finished working on this command; start the next one held
+	 * back behind it, unless we are going away */
+	us->srb = usb_stor_flush_next(&us->flush,
+			test_bit(US_FLIDX_DISCONNECTING, &us->dflags) ?
+			DID_NO_CONNECT << 16 : 0);
+	if (us->srb)
+		queue_work(us->cmnd_wq, &us->cmnd_work);
+	scsi_unlock(host);
+
+	/* unlock the device pointers */
+	mutex_unlock(&us->dev_mutex);
 }
 
 /***********************************************************************
@@ -603,6 +631,33 @@ void usb_stor_adjust_quirks(struct usb_device *udev, unsigned long *fflags)
 }
 EXPORT_SYMBOL_GPL(usb_stor_adjust_quirks);
 
+/* Look up the "delays=" module parameter for this device */
+static unsigned int usb_stor_quirk_delay(struct usb_device *udev)
+{
+	char *p;
+	u16 vid = le16_to_cpu(udev->descriptor.idVendor);
+	u16 pid = le16_to_cpu(udev->descriptor.idProduct);
+
+	p = delays;
+	while (*p) {
+		/* Each entry consists of VID:PID:microseconds */
+		if (vid == simple_strtoul(p, &p, 16) &&
+				*p == ':' &&
+				pid == simple_strtoul(p+1, &p, 16) &&
+				*p == ':')
+			return min_t(unsigned long,
+					simple_strtoul(p+1, NULL, 10),
+					US_PHASE_DELAY_MAX);
+
+		/* Move forward to the next entry */
+		while (*p) {
+			if (*p++ == ',')
+				break;
+		}
+	}
+	return 0;
+}
+
 /* Get the unusual_devs entries and the string descriptors */
 static int get_device_info(struct us_data *us, const struct usb_device_id *id,
 		struct us_unusual_dev *unusual_dev)
@@ -622,6 +677,7 @@ static int get_device_info(struct us_data *us, const struct usb_device_id *id,
 			unusual_dev->useTransport;
 	us->fflags = id->driver_info;
 	usb_stor_adjust_quirks(us->pusb_dev, &us->fflags);
+	us->phase_delay = usb_stor_quirk_delay(us->pusb_dev);
 
 	if (us->fflags & US_FL_IGNORE_DEVICE) {
 		dev_info(pdev, "device ignored\n");
@@ -805,7 +861,6 @@ static int get_pipes(struct us_data *us)
 static int usb_stor_acquire_resources(struct us_data *us)
 {
 	int p;
-	struct task_struct *th;
 
 	us->current_urb = usb_alloc_urb(0, GFP_KERNEL);
 	if (!us->current_urb) {
@@ -813,7 +868,19 @@ static int usb_stor_acquire_resources(struct us_data *us)
 		return -ENOMEM;
 	}
 
-	/* Just before we start our control thread, initialize
+	us->cbw_urb = usb_alloc_urb(0, GFP_KERNEL);
+	us->data_urb = usb_alloc_urb(0, GFP_KERNEL);
+	us->csw_urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!us->cbw_urb || !us->data_urb || !us->csw_urb) {
+		usb_stor_dbg(us, "URB allocation failed\n");
+		return -ENOMEM;
+	}
+
+	p = usb_stor_cache_init(&us->cache);
+	if (p)
+		return p;
+
+	/* Just before we start accepting commands, initialize
 	 * the device if it needs initialization */
 	if (us->unusual_dev->initFunction) {
 		p = us->unusual_dev->initFunction(us);
@@ -821,29 +888,18 @@ static int usb_stor_acquire_resources(struct us_data *us)
 			return p;
 	}
 
-	/* Start up our control thread */
-	th = kthread_run(usb_stor_control_thread, us, "usb-storage");
-	if (IS_ERR(th)) {
-		dev_warn(&us->pusb_intf->dev,
-				"Unable to start control thread\n");
-		return PTR_ERR(th);
-	}
-	us->ctl_thread = th;
-
 	return 0;
 }
 
 /* Release all our dynamic resources */
 static void usb_stor_release_resources(struct us_data *us)
 {
-	/* Tell the control thread to exit.  The SCSI host must
+	/* Wait for the last command to finish.  The SCSI host must
 	 * already have been removed and the DISCONNECTING flag set
 	 * so that we won't accept any more commands.
 	 */
-	usb_stor_dbg(us, "-- sending exit command to thread\n");
-	complete(&us->cmnd_ready);
-	if (us->ctl_thread)
-		kthread_stop(us->ctl_thread);
+	usb_stor_dbg(us, "-- waiting for the command work\n");
+	flush_work(&us->cmnd_work);
 
 	/* Call the destructor routine, if it exists */
 	if (us->extra_destructor) {
@@ -854,6 +910,17 @@ static void usb_stor_release_resources(struct us_data *us)
 	/* Free the extra data and the URB */
 	kfree(us->extra);
 	usb_free_urb(us->current_urb);
+	usb_free_urb(us->cbw_urb);
+	usb_free_urb(us->data_urb);
+	usb_free_urb(us->csw_urb);
+	usb_stor_pool_release(us);
+	usb_stor_cache_release(&us->cache);
+	usb_stor_trim_release(&us->trim);
+	usb_stor_provisioning_release(&us->prov);
+	usb_stor_flush_release(&us->flush);
+	cancel_work_sync(&us->max_sectors_work);
+	if (us->cmnd_wq)
+		destroy_workqueue(us->cmnd_wq);
 }
 
 /* Dissociate from the USB device */
@@ -920,6 +987,57 @@ static void release_everything(struct us_data *us)
 	scsi_host_put(us_to_host(us));
 }
 
+/*
+ * Most devices answer commands long before delay_use is up.  Bulk-only
+ * devices are therefore polled with TEST UNIT READY on LUN 0, backing
+ * off from US_READY_POLL_MIN to US_READY_POLL_MAX ms, until they answer
+ * or delay_use has passed.  This is done before GET MAX LUN, which the
+ * settle time used to cover: some multi-LUN readers stall it or report
+ * a single LUN right after enumeration.  A device that takes the
+ * command but gives no valid status is left to the scan's own error
+ * handling rather than reset here; only a phase error gets the reset
+ * recovery the Bulk-only spec asks for.
+ */
+#define US_READY_POLL_MIN	10
+#define US_READY_POLL_MAX	250
+#define US_READY_POLL_TIMEOUT	(HZ / 2)
+
+static int usb_stor_polls_ready(struct us_data *us)
+{
+	return ready_poll && us->transport == usb_stor_Bulk_transport &&
+			!(us->fflags & US_FL_SCM_MULT_TARG);
+}
+
+static void usb_stor_wait_ready(struct us_data *us)
+{
+	unsigned long deadline = us->attach_time + us->attach_delay;
+	unsigned int backoff = US_READY_POLL_MIN;
+	long left;
+	int result;
+
+	while (!test_bit(US_FLIDX_DISCONNECTING, &us->dflags)) {
+		mutex_lock(&us->dev_mutex);
+		result = usb_stor_Bulk_ping(us, US_READY_POLL_TIMEOUT);
+		if (result == -EPROTO) {
+			usb_stor_dbg(us, "phase error for TEST UNIT READY\n");
+			us->transport_reset(us);
+		} else if (result == -EIO) {
+			usb_stor_dbg(us, "no status for TEST UNIT READY\n");
+		}
+		mutex_unlock(&us->dev_mutex);
+		if (result != -EAGAIN)
+			break;
+
+		left = (long) (deadline - jiffies);
+		if (left <= 0)
+			break;
+		wait_event_interruptible_timeout(us->delay_wait,
+				test_bit(US_FLIDX_DISCONNECTING, &us->dflags),
+				min_t(long, left, msecs_to_jiffies(backoff)));
+		backoff = min(backoff * 2, US_READY_POLL_MAX);
+	}
+}
+
 /* Delayed-work routine to carry out SCSI-device scanning */
 static void usb_stor_scan_dwork(struct work_struct *work)
 {
@@ -929,6 +1047,9 @@ static void usb_stor_scan_dwork(struct work_struct *work)
 
 	dev_dbg(dev, "starting scan\n");
 
+	if (us->attach_delay && usb_stor_polls_ready(us))
+		usb_stor_wait_ready(us);
+
 	/* For bulk-only devices, determine the max LUN value */
 	if (us->protocol == USB_PR_BULK &&
 	    !(us->fflags & US_FL_SINGLE_LUN) &&
@@ -943,6 +1064,9 @@ static void usb_stor_scan_dwork(struct work_struct *work)
 			us_to_host(us)->max_lun = us->max_lun+1;
 		mutex_unlock(&us->dev_mutex);
 	}
+
+	us->ready_time = jiffies_to_msecs(jiffies - us->attach_time);
+
 	scsi_scan_host(us_to_host(us));
 	dev_dbg(dev, "scan complete\n");
 
@@ -993,16 +1117,33 @@ int usb_stor_probe1(struct us_data **pus,
 	*pus = us = host_to_us(host);
 	mutex_init(&(us->dev_mutex));
 	us_set_lock_class(&us->dev_mutex, intf);
-	init_completion(&us->cmnd_ready);
+	INIT_WORK(&us->cmnd_work, usb_stor_control_work);
 	init_completion(&(us->notify));
+	init_completion(&us->bot_done);
+	init_usb_anchor(&us->bot_anchor);
 	init_waitqueue_head(&us->delay_wait);
 	INIT_DELAYED_WORK(&us->scan_dwork, usb_stor_scan_dwork);
+	INIT_WORK(&us->max_sectors_work, usb_stor_max_sectors_work);
+	usb_stor_provisioning_init(&us->prov, host);
+
+	/* Leave room for the flushes parked by the SYNCHRONIZE CACHE filter */
+	usb_stor_flush_init(&us->flush, interface_to_usbdev(intf),
+			host->host_lock);
+	if (us->flush.enabled)
+		host->can_queue = 1 + US_FLUSH_SLOTS;
 
 	/* Associate the us_data structure with the USB device */
 	result = associate_dev(us, intf);
 	if (result)
 		goto BadDevice;
 
+	us->cmnd_wq = alloc_workqueue("usb-storage-%s", WQ_MEM_RECLAIM, 1,
+			dev_name(&intf->dev));
+	if (!us->cmnd_wq) {
+		result = -ENOMEM;
+		goto BadDevice;
+	}
+
 	/* Get the unusual_devs entries and the descriptors */
 	result = get_device_info(us, id, unusual_dev);
 	if (result)
@@ -1092,10 +1233,14 @@ int usb_stor_probe2(struct us_data *us)
 	usb_autopm_get_interface_no_resume(us->pusb_intf);
 	set_bit(US_FLIDX_SCAN_PENDING, &us->dflags);
 
-	if (delay_use > 0)
+	us->attach_time = jiffies;
+	us->attach_delay = delay_use * HZ;
+	if (us->attach_delay && usb_stor_polls_ready(us))
+		dev_dbg(dev, "polling device until it is ready for scanning\n");
+	else if (us->attach_delay)
 		dev_dbg(dev, "waiting for device to settle before scanning\n");
 	queue_delayed_work(system_freezable_wq, &us->scan_dwork,
-			delay_use * HZ);
+			usb_stor_polls_ready(us) ? 0 : us->attach_delay);
 	return 0;
 
 	/* We come here if there are any problems */
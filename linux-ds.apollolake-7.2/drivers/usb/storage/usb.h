@@ -50,6 +50,13 @@
 #include <linux/workqueue.h>
 #include <scsi/scsi_host.h>
 
+#include "respcache.h"
+#include "scsiglue.h"
+#include "trim.h"
+#include "flush.h"
+#include "stats.h"
+#include "pool.h"
+
 struct us_data;
 struct scsi_cmnd;
 
@@ -76,6 +83,7 @@ struct us_unusual_dev {
 #define US_FLIDX_SCAN_PENDING	6	/* scanning not yet done    */
 #define US_FLIDX_REDO_READ10	7	/* redo READ(10) command    */
 #define US_FLIDX_READ10_WORKED	8	/* previous READ(10) succeeded */
+#define US_FLIDX_BOT_ACTIVE	9	/* pipelined Bulk URBs in use */
 
 #define USB_STOR_STRING_LEN 32
 
@@ -143,10 +151,17 @@ struct us_data {
 	struct usb_sg_request	current_sg;	 /* scatter-gather req.  */
 	unsigned char		*iobuf;		 /* I/O buffer		 */
 	dma_addr_t		iobuf_dma;	 /* buffer DMA addresses */
-	struct task_struct	*ctl_thread;	 /* the control thread   */
+	struct work_struct	cmnd_work;	 /* runs the current srb */
+	struct workqueue_struct	*cmnd_wq;	 /* ... and subdriver I/O */
+
+	/* Bulk-only commands with all stages queued at once */
+	struct urb		*cbw_urb;	 /* command wrapper	 */
+	struct urb		*data_urb;	 /* data stage		 */
+	struct urb		*csw_urb;	 /* status wrapper	 */
+	struct usb_anchor	bot_anchor;	 /* all of the above	 */
+	struct completion	bot_done;	 /* CSW or error seen	 */
 
 	/* mutual exclusion and synchronization structures */
-	struct completion	cmnd_ready;	 /* to sleep thread on	    */
 	struct completion	notify;		 /* thread begin/end	    */
 	wait_queue_head_t	delay_wait;	 /* wait during reset	    */
 	struct delayed_work	scan_dwork;	 /* for async scanning      */
@@ -158,9 +173,47 @@ struct us_data {
 	pm_hook			suspend_resume_hook;
 #endif
 
+	/* delay between the Bulk-only stages, for flaky bridges */
+	unsigned int		phase_delay;	 /* microseconds	 */
+	unsigned int		delay_calibrating:1; /* phase_delay growing */
+	unsigned int		delay_clean;	 /* commands since an error */
+
+	/* data stages sent as one URB or through usb_sg_* */
+	unsigned long		sg_single;
+	unsigned long		sg_split;
+	unsigned long		sg_urbs;	/* URBs used by both */
+	unsigned long long	sg_bytes;
+
+	/* falling back from large SuperSpeed transfers */
+	unsigned int		max_sectors_limit;	/* 0, 240 or 64 */
+	unsigned int		max_sectors_errors;	/* in a row */
+	unsigned int		max_sectors_fallbacks;
+	struct work_struct	max_sectors_work;	/* applies the limit */
+
+	/* waiting for a new device to get ready */
+	unsigned long		attach_time;	 /* jiffies at probe	 */
+	unsigned long		attach_delay;	 /* upper bound, jiffies */
+	unsigned int		ready_time;	 /* ms until the scan	 */
+
+	/* per-stage latencies and error-recovery counts */
+	struct us_stats		stats;
+
+	/* bounce buffers kept for the flash subdrivers */
+	struct us_pool		pool;
+
 	/* hacks for READ CAPACITY bug handling */
 	int			use_last_sector_hacks;
 	int			last_sector_retries;
+
+	/* replayed answers to management commands */
+	struct us_cache		cache;
+
+	/* UNMAP sent as ATA TRIM */
+	struct us_provisioning	prov;
+	struct us_trim		trim;
+
+	/* SYNCHRONIZE CACHE emulation */
+	struct us_flush		flush;
 };
 
 /* Convert between us_data and the corresponding Scsi_Host */
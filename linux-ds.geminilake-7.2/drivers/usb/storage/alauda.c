@@ -33,6 +33,7 @@
 
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -43,6 +44,8 @@
 #include "protocol.h"
 #include "debug.h"
 #include "scsiglue.h"
+#include "smecc.h"
+#include "freemap.h"
 
 #define DRV_NAME "ums-alauda"
 
@@ -108,11 +111,19 @@ struct alauda_media_info {
 
 	u16 **lba_to_pba;		/* logical to physical block map */
 	u16 **pba_to_lba;		/* physical to logical block map */
+	struct us_freemap freemap;	/* blocks mapped as UNDEF */
+
+	unsigned char *wbuf;		/* open block with redundancy data */
+	u16 wlba;			/* LBA held in wbuf, or UNDEF */
+	unsigned char lost;		/* a cached write was dropped */
 };
 
 struct alauda_info {
 	struct alauda_media_info port[2];
 	int wr_ep;			/* endpoint to write data out of */
+	struct us_data *us;
+	struct delayed_work flush_work;	/* writes wbuf back when idle */
+	unsigned int flush_retries;	/* failed idle write backs in a row */
 
 	unsigned char sense_key;
 	unsigned long sense_asc;	/* additional sense code */
@@ -130,6 +141,12 @@ struct alauda_info {
 #define PBA_HI(pba) (pba >> 3)
 #define PBA_ZONE(pba) (pba >> 11)
 
+/* Write an open block back after this long without another write */
+#define ALAUDA_FLUSH_DELAY HZ
+
+/* A failed idle write back is retried after 2, 4, 8 and 16 seconds */
+#define ALAUDA_FLUSH_RETRIES 4
+
 static int init_alauda(struct us_data *us);
 
 
@@ -221,61 +238,9 @@ static struct alauda_card_info *alauda_card_find_id(unsigned char id)
 }
 
 /*
- * ECC computation.
+ * ECC checking; the code itself comes from usb_stor_sm_ecc().
  */
 
-static unsigned char parity[256];
-static unsigned char ecc2[256];
-
-static void nand_init_ecc(void)
-{
-	int i, j, a;
-
-	parity[0] = 0;
-	for (i = 1; i < 256; i++)
-		parity[i] = (parity[i&(i-1)] ^ 1);
-
-	for (i = 0; i < 256; i++) {
-		a = 0;
-		for (j = 0; j < 8; j++) {
-			if (i & (1<<j)) {
-				if ((j & 1) == 0)
-					a ^= 0x04;
-				if ((j & 2) == 0)
-					a ^= 0x10;
-				if ((j & 4) == 0)
-					a ^= 0x40;
-			}
-		}
-		ecc2[i] = ~(a ^ (a<<1) ^ (parity[i] ? 0xa8 : 0));
-	}
-}
-
-/* compute 3-byte ecc on 256 bytes */
-static void nand_compute_ecc(unsigned char *data, unsigned char *ecc)
-{
-	int i, j, a;
-	unsigned char par = 0, bit, bits[8] = {0};
-
-	/* collect 16 checksum bits */
-	for (i = 0; i < 256; i++) {
-		par ^= data[i];
-		bit = parity[data[i]];
-		for (j = 0; j < 8; j++)
-			if ((i & (1<<j)) == 0)
-				bits[j] ^= bit;
-	}
-
-	/* put 4+4+4 = 12 bits in the ecc */
-	a = (bits[3] << 6) + (bits[2] << 4) + (bits[1] << 2) + bits[0];
-	ecc[0] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
-
-	a = (bits[7] << 6) + (bits[6] << 4) + (bits[5] << 2) + bits[4];
-	ecc[1] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
-
-	ecc[2] = ecc2[par];
-}
-
 static int nand_compare_ecc(unsigned char *data, unsigned char *ecc)
 {
 	return (data[0] == ecc[0] && data[1] == ecc[1] && data[2] == ecc[2]);
@@ -311,6 +276,16 @@ static void alauda_free_maps (struct alauda_media_info *media_info)
 			kfree(media_info->pba_to_lba[i]);
 			media_info->pba_to_lba[i] = NULL;
 		}
+
+	usb_stor_freemap_free(&media_info->freemap);
+
+	/* The card has gone, and with it any block in the write cache */
+	if (media_info->wlba != UNDEF)
+		printk(KERN_ERR "alauda: lost the write to LBA %u\n",
+		       media_info->wlba);
+	media_info->wlba = UNDEF;
+	kfree(media_info->wbuf);
+	media_info->wbuf = NULL;
 }
 
 /*
@@ -446,10 +421,27 @@ static int alauda_init_media(struct us_data *us)
 	MEDIA_INFO(us).uzonesize = ((1 << media_info->zoneshift) / 128) * 125;
 	MEDIA_INFO(us).blockmask = MEDIA_INFO(us).blocksize - 1;
 
+	/*
+	 * Keep a block buffer with redundancy data for the reads and a
+	 * plain data buffer for the writes, which are merged into the
+	 * write cache.
+	 */
+	usb_stor_pool_reserve(us, 0, (MEDIA_INFO(us).pagesize + 64) *
+			MEDIA_INFO(us).blocksize);
+	usb_stor_pool_reserve(us, 1, MEDIA_INFO(us).pagesize *
+			MEDIA_INFO(us).blocksize);
+	MEDIA_INFO(us).wbuf = kmalloc((MEDIA_INFO(us).pagesize + 64) *
+			MEDIA_INFO(us).blocksize, GFP_NOIO);
+	if (!MEDIA_INFO(us).wbuf)
+		return USB_STOR_TRANSPORT_ERROR;
+
 	num_zones = MEDIA_INFO(us).capacity >> (MEDIA_INFO(us).zoneshift
 		+ MEDIA_INFO(us).blockshift + MEDIA_INFO(us).pageshift);
 	MEDIA_INFO(us).pba_to_lba = kcalloc(num_zones, sizeof(u16*), GFP_NOIO);
 	MEDIA_INFO(us).lba_to_pba = kcalloc(num_zones, sizeof(u16*), GFP_NOIO);
+	if (usb_stor_freemap_alloc(&MEDIA_INFO(us).freemap,
+			num_zones << MEDIA_INFO(us).zoneshift))
+		return USB_STOR_TRANSPORT_ERROR;
 
 	if (alauda_reset_media(us) != USB_STOR_XFER_GOOD)
 		return USB_STOR_TRANSPORT_ERROR;
@@ -499,12 +491,12 @@ static int alauda_check_media(struct us_data *us)
  * Checks the status from the 2nd status register
  * Returns 3 bytes of status data, only the first is known
  */
-static int alauda_check_status2(struct us_data *us)
+static int alauda_check_status2(struct us_data *us, unsigned int port)
 {
 	int rc;
 	unsigned char command[] = {
 		ALAUDA_BULK_CMD, ALAUDA_BULK_GET_STATUS2,
-		0, 0, 0, 0, 3, 0, MEDIA_PORT(us)
+		0, 0, 0, 0, 3, 0, port
 	};
 	unsigned char data[3];
 
@@ -553,14 +545,12 @@ static int alauda_get_redu_data(struct us_data *us, u16 pba, unsigned char *data
 static u16 alauda_find_unused_pba(struct alauda_media_info *info,
 	unsigned int zone)
 {
-	u16 *pba_to_lba = info->pba_to_lba[zone];
-	unsigned int i;
-
-	for (i = 0; i < info->zonesize; i++)
-		if (pba_to_lba[i] == UNDEF)
-			return (zone << info->zoneshift) + i;
+	unsigned int zonestart = zone << info->zoneshift;
+	unsigned int pba;
 
-	return 0;
+	pba = usb_stor_freemap_find(&info->freemap, zonestart,
+			zonestart + info->zonesize, zonestart, 0);
+	return (pba == US_FREEMAP_NONE ? 0 : pba);
 }
 
 /*
@@ -634,7 +624,7 @@ static int alauda_read_map(struct us_data *us, unsigned int zone)
 		}
 
 		/* check even parity */
-		if (parity[data[6] ^ data[7]]) {
+		if (sm_parity8(data[6] ^ data[7])) {
 			printk(KERN_WARNING
 			       "alauda_read_map: Bad parity in LBA for block %d"
 			       " (%02X %02X)\n", i, data[6], data[7]);
@@ -675,6 +665,15 @@ static int alauda_read_map(struct us_data *us, unsigned int zone)
 		continue;
 	}
 
+	for (i = 0; i < zonesize; i++) {
+		if (pba_to_lba[i] == UNDEF)
+			usb_stor_freemap_put(&MEDIA_INFO(us).freemap,
+					zone_base_pba + i, 1);
+		else
+			usb_stor_freemap_take(&MEDIA_INFO(us).freemap,
+					zone_base_pba + i);
+	}
+
 	MEDIA_INFO(us).lba_to_pba[zone] = lba_to_pba;
 	MEDIA_INFO(us).pba_to_lba[zone] = pba_to_lba;
 	result = 0;
@@ -701,12 +700,12 @@ static void alauda_ensure_map_for_zone(struct us_data *us, unsigned int zone)
 /*
  * Erases an entire block
  */
-static int alauda_erase_block(struct us_data *us, u16 pba)
+static int alauda_erase_block(struct us_data *us, unsigned int port, u16 pba)
 {
 	int rc;
 	unsigned char command[] = {
 		ALAUDA_BULK_CMD, ALAUDA_BULK_ERASE_BLOCK, PBA_HI(pba),
-		PBA_ZONE(pba), 0, PBA_LO(pba), 0x02, 0, MEDIA_PORT(us)
+		PBA_ZONE(pba), 0, PBA_LO(pba), 0x02, 0, port
 	};
 	unsigned char buf[2];
 
@@ -781,13 +780,14 @@ static int alauda_read_block(struct us_data *us, u16 pba,
  * Redundancy data must be already included in data. Data should be
  * (pagesize+64)*blocksize bytes in length.
  */
-static int alauda_write_block(struct us_data *us, u16 pba, unsigned char *data)
+static int alauda_write_block(struct us_data *us, unsigned int port, u16 pba,
+		unsigned char *data)
 {
 	int rc;
 	struct alauda_info *info = (struct alauda_info *) us->extra;
 	unsigned char command[] = {
 		ALAUDA_BULK_CMD, ALAUDA_BULK_WRITE_BLOCK, PBA_HI(pba),
-		PBA_ZONE(pba), 0, PBA_LO(pba), 32, 0, MEDIA_PORT(us)
+		PBA_ZONE(pba), 0, PBA_LO(pba), 32, 0, port
 	};
 
 	usb_stor_dbg(us, "pba %d\n", pba);
@@ -798,32 +798,112 @@ static int alauda_write_block(struct us_data *us, u16 pba, unsigned char *data)
 		return rc;
 
 	rc = usb_stor_bulk_transfer_buf(us, info->wr_ep, data,
-		(MEDIA_INFO(us).pagesize + 64) * MEDIA_INFO(us).blocksize,
+		(info->port[port].pagesize + 64) * info->port[port].blocksize,
 		NULL);
 	if (rc != USB_STOR_XFER_GOOD)
 		return rc;
 
-	return alauda_check_status2(us);
+	return alauda_check_status2(us, port);
 }
 
 /*
- * Write some data to a specific LBA.
+ * Write the cached block of a port to a free block and erase the one it
+ * replaces.  It stays cached when that fails, so the write can be tried
+ * again after the reset that follows a failed command.  This is also
+ * called outside of a command, so the port is passed in.
+ */
+static int alauda_flush_port(struct us_data *us, unsigned int port)
+{
+	struct alauda_info *info = (struct alauda_info *) us->extra;
+	struct alauda_media_info *media_info = &info->port[port];
+	unsigned int zonesize = media_info->zonesize;
+	unsigned int zone, lba_offset, new_pba_offset;
+	u16 pba, new_pba;
+	int result;
+
+	if (media_info->wlba == UNDEF)
+		return USB_STOR_XFER_GOOD;
+
+	zone = media_info->wlba / media_info->uzonesize;
+	lba_offset = media_info->wlba % media_info->uzonesize;
+	pba = media_info->lba_to_pba[zone][lba_offset];
+	new_pba = alauda_find_unused_pba(media_info, zone);
+	if (!new_pba) {
+		printk(KERN_WARNING
+		       "alauda_flush_port: Out of unused blocks\n");
+		return USB_STOR_TRANSPORT_ERROR;
+	}
+
+	result = alauda_write_block(us, port, new_pba, media_info->wbuf);
+	if (result != USB_STOR_XFER_GOOD)
+		return result;
+
+	new_pba_offset = new_pba - (zone * zonesize);
+	media_info->pba_to_lba[zone][new_pba_offset] = media_info->wlba;
+	media_info->lba_to_pba[zone][lba_offset] = new_pba;
+	usb_stor_freemap_take(&media_info->freemap, new_pba);
+	usb_stor_dbg(us, "Remapped LBA %d to PBA %d\n",
+		     media_info->wlba, new_pba);
+	media_info->wlba = UNDEF;
+
+	if (pba != UNDEF) {
+		unsigned int pba_offset = pba - (zone * zonesize);
+		result = alauda_erase_block(us, port, pba);
+		if (result != USB_STOR_XFER_GOOD)
+			return result;
+		media_info->pba_to_lba[zone][pba_offset] = UNDEF;
+		usb_stor_freemap_put(&media_info->freemap, pba, 1);
+	}
+
+	return USB_STOR_TRANSPORT_GOOD;
+}
+
+static int alauda_flush(struct us_data *us)
+{
+	int port, rc, result = USB_STOR_XFER_GOOD;
+
+	for (port = 0; port < 2; port++) {
+		rc = alauda_flush_port(us, port);
+		if (rc != USB_STOR_XFER_GOOD)
+			result = rc;
+	}
+	return result;
+}
+
+/*
+ * Write some data to a specific LBA.  The first write to a block reads
+ * it into the write cache of the port, later writes to the same block
+ * are merged there and the block is copied to a new one once, when the
+ * cache is flushed: on a write to another block or to the last page of
+ * this one, on SYNCHRONIZE CACHE, ALLOW MEDIUM REMOVAL and START STOP
+ * UNIT, after ALAUDA_FLUSH_DELAY without writes, after a reset and on
+ * unbind.
  */
 static int alauda_write_lba(struct us_data *us, u16 lba,
 		 unsigned int page, unsigned int pages,
-		 unsigned char *ptr, unsigned char *blockbuffer)
+		 unsigned char *ptr)
 {
-	u16 pba, lbap, new_pba;
+	struct alauda_info *info = (struct alauda_info *) us->extra;
+	u16 pba, lbap;
 	unsigned char *bptr, *cptr, *xptr;
 	unsigned char ecc[3];
 	int i, result;
 	unsigned int uzonesize = MEDIA_INFO(us).uzonesize;
-	unsigned int zonesize = MEDIA_INFO(us).zonesize;
 	unsigned int pagesize = MEDIA_INFO(us).pagesize;
 	unsigned int blocksize = MEDIA_INFO(us).blocksize;
 	unsigned int lba_offset = lba % uzonesize;
-	unsigned int new_pba_offset;
 	unsigned int zone = lba / uzonesize;
+	unsigned char *blockbuffer = MEDIA_INFO(us).wbuf;
+
+	if (lba == MEDIA_INFO(us).wlba) {
+		/* this saves writing a new block and erasing the old one */
+		us->stats.erases_saved++;
+		goto merge;
+	}
+
+	result = alauda_flush_port(us, MEDIA_PORT(us));
+	if (result != USB_STOR_XFER_GOOD)
+		return result;
 
 	alauda_ensure_map_for_zone(us, zone);
 
@@ -836,13 +916,6 @@ static int alauda_write_lba(struct us_data *us, u16 lba,
 		return USB_STOR_TRANSPORT_GOOD;
 	}
 
-	new_pba = alauda_find_unused_pba(&MEDIA_INFO(us), zone);
-	if (!new_pba) {
-		printk(KERN_WARNING
-		       "alauda_write_lba: Out of unused blocks\n");
-		return USB_STOR_TRANSPORT_ERROR;
-	}
-
 	/* read old contents */
 	if (pba != UNDEF) {
 		result = alauda_read_block_raw(us, pba, 0,
@@ -854,20 +927,20 @@ static int alauda_write_lba(struct us_data *us, u16 lba,
 	}
 
 	lbap = (lba_offset << 1) | 0x1000;
-	if (parity[MSB_of(lbap) ^ LSB_of(lbap)])
+	if (sm_parity8(MSB_of(lbap) ^ LSB_of(lbap)))
 		lbap ^= 1;
 
 	/* check old contents and fill lba */
 	for (i = 0; i < blocksize; i++) {
 		bptr = blockbuffer + (i * (pagesize + 64));
 		cptr = bptr + pagesize;
-		nand_compute_ecc(bptr, ecc);
+		usb_stor_sm_ecc(bptr, ecc);
 		if (!nand_compare_ecc(cptr+13, ecc)) {
 			usb_stor_dbg(us, "Warning: bad ecc in page %d- of pba %d\n",
 				     i, pba);
 			nand_store_ecc(cptr+13, ecc);
 		}
-		nand_compute_ecc(bptr + (pagesize / 2), ecc);
+		usb_stor_sm_ecc(bptr + (pagesize / 2), ecc);
 		if (!nand_compare_ecc(cptr+8, ecc)) {
 			usb_stor_dbg(us, "Warning: bad ecc in page %d+ of pba %d\n",
 				     i, pba);
@@ -876,7 +949,9 @@ static int alauda_write_lba(struct us_data *us, u16 lba,
 		cptr[6] = cptr[11] = MSB_of(lbap);
 		cptr[7] = cptr[12] = LSB_of(lbap);
 	}
+	MEDIA_INFO(us).wlba = lba;
 
+ merge:
 	/* copy in new stuff and compute ECC */
 	xptr = ptr;
 	for (i = page; i < page+pages; i++) {
@@ -884,29 +959,18 @@ static int alauda_write_lba(struct us_data *us, u16 lba,
 		cptr = bptr + pagesize;
 		memcpy(bptr, xptr, pagesize);
 		xptr += pagesize;
-		nand_compute_ecc(bptr, ecc);
+		usb_stor_sm_ecc(bptr, ecc);
 		nand_store_ecc(cptr+13, ecc);
-		nand_compute_ecc(bptr + (pagesize / 2), ecc);
+		usb_stor_sm_ecc(bptr + (pagesize / 2), ecc);
 		nand_store_ecc(cptr+8, ecc);
 	}
 
-	result = alauda_write_block(us, new_pba, blockbuffer);
-	if (result != USB_STOR_XFER_GOOD)
-		return result;
-
-	new_pba_offset = new_pba - (zone * zonesize);
-	MEDIA_INFO(us).pba_to_lba[zone][new_pba_offset] = lba;
-	MEDIA_INFO(us).lba_to_pba[zone][lba_offset] = new_pba;
-	usb_stor_dbg(us, "Remapped LBA %d to PBA %d\n", lba, new_pba);
-
-	if (pba != UNDEF) {
-		unsigned int pba_offset = pba - (zone * zonesize);
-		result = alauda_erase_block(us, pba);
-		if (result != USB_STOR_XFER_GOOD)
-			return result;
-		MEDIA_INFO(us).pba_to_lba[zone][pba_offset] = UNDEF;
-	}
+	/* a sequential writer is done with the block */
+	if (page + pages == blocksize)
+		return alauda_flush_port(us, MEDIA_PORT(us));
 
+	info->flush_retries = 0;
+	mod_delayed_work(us->cmnd_wq, &info->flush_work, ALAUDA_FLUSH_DELAY);
 	return USB_STOR_TRANSPORT_GOOD;
 }
 
@@ -918,13 +982,13 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 {
 	unsigned char *buffer;
 	u16 lba, max_lba;
-	unsigned int page, len, offset;
+	unsigned int page, len;
 	unsigned int blockshift = MEDIA_INFO(us).blockshift;
 	unsigned int pageshift = MEDIA_INFO(us).pageshift;
 	unsigned int blocksize = MEDIA_INFO(us).blocksize;
 	unsigned int pagesize = MEDIA_INFO(us).pagesize;
 	unsigned int uzonesize = MEDIA_INFO(us).uzonesize;
-	struct scatterlist *sg;
+	struct us_xfer_cursor cur;
 	int result;
 
 	/*
@@ -936,7 +1000,7 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 	 */
 
 	len = min(sectors, blocksize) * (pagesize + 64);
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL) {
 		printk(KERN_WARNING "alauda_read_data: Out of memory\n");
 		return USB_STOR_TRANSPORT_ERROR;
@@ -948,8 +1012,7 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 	max_lba = MEDIA_INFO(us).capacity >> (blockshift + pageshift);
 
 	result = USB_STOR_TRANSPORT_GOOD;
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, TO_XFER_BUF);
 
 	while (sectors > 0) {
 		unsigned int zone = lba / uzonesize; /* integer division */
@@ -973,7 +1036,17 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 		/* Find where this lba lives on disk */
 		pba = MEDIA_INFO(us).lba_to_pba[zone][lba_offset];
 
-		if (pba == UNDEF) {	/* this lba was never written */
+		if (lba == MEDIA_INFO(us).wlba) {	/* not written back yet */
+			unsigned int i;
+
+			usb_stor_dbg(us, "Read %d cached pages (LBA %d) page %d\n",
+				     pages, lba, page);
+
+			for (i = 0; i < pages; i++)
+				memcpy(buffer + i * pagesize,
+				       MEDIA_INFO(us).wbuf +
+				       (page + i) * (pagesize + 64), pagesize);
+		} else if (pba == UNDEF) {	/* this lba was never written */
 			usb_stor_dbg(us, "Read %d zero pages (LBA %d) page %d\n",
 				     pages, lba, page);
 
@@ -993,15 +1066,15 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 		}
 
 		/* Store the data in the transfer buffer */
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, TO_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
 		page = 0;
 		lba++;
 		sectors -= pages;
 	}
 
-	kfree(buffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 	return result;
 }
 
@@ -1011,13 +1084,13 @@ static int alauda_read_data(struct us_data *us, unsigned long address,
 static int alauda_write_data(struct us_data *us, unsigned long address,
 		unsigned int sectors)
 {
-	unsigned char *buffer, *blockbuffer;
-	unsigned int page, len, offset;
+	unsigned char *buffer;
+	unsigned int page, len;
 	unsigned int blockshift = MEDIA_INFO(us).blockshift;
 	unsigned int pageshift = MEDIA_INFO(us).pageshift;
 	unsigned int blocksize = MEDIA_INFO(us).blocksize;
 	unsigned int pagesize = MEDIA_INFO(us).pagesize;
-	struct scatterlist *sg;
+	struct us_xfer_cursor cur;
 	u16 lba, max_lba;
 	int result;
 
@@ -1028,31 +1101,19 @@ static int alauda_write_data(struct us_data *us, unsigned long address,
 	 */
 
 	len = min(sectors, blocksize) * pagesize;
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL) {
 		printk(KERN_WARNING "alauda_write_data: Out of memory\n");
 		return USB_STOR_TRANSPORT_ERROR;
 	}
 
-	/*
-	 * We also need a temporary block buffer, where we read in the old data,
-	 * overwrite parts with the new data, and manipulate the redundancy data
-	 */
-	blockbuffer = kmalloc((pagesize + 64) * blocksize, GFP_NOIO);
-	if (blockbuffer == NULL) {
-		printk(KERN_WARNING "alauda_write_data: Out of memory\n");
-		kfree(buffer);
-		return USB_STOR_TRANSPORT_ERROR;
-	}
-
 	/* Figure out the initial LBA and page */
 	lba = address >> blockshift;
 	page = (address & MEDIA_INFO(us).blockmask);
 	max_lba = MEDIA_INFO(us).capacity >> (pageshift + blockshift);
 
 	result = USB_STOR_TRANSPORT_GOOD;
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, FROM_XFER_BUF);
 
 	while (sectors > 0) {
 		/* Write as many sectors as possible in this block */
@@ -1068,11 +1129,9 @@ static int alauda_write_data(struct us_data *us, unsigned long address,
 		}
 
 		/* Get the data from the transfer buffer */
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, FROM_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
-		result = alauda_write_lba(us, lba, page, pages, buffer,
-			blockbuffer);
+		result = alauda_write_lba(us, lba, page, pages, buffer);
 		if (result != USB_STOR_TRANSPORT_GOOD)
 			break;
 
@@ -1081,8 +1140,8 @@ static int alauda_write_data(struct us_data *us, unsigned long address,
 		sectors -= pages;
 	}
 
-	kfree(buffer);
-	kfree(blockbuffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 	return result;
 }
 
@@ -1090,6 +1149,88 @@ static int alauda_write_data(struct us_data *us, unsigned long address,
  * Our interface with the rest of the world
  */
 
+/*
+ * Write the open blocks back once writes have stopped for a while.  If
+ * that fails it is tried again a few times, backing off; after that the
+ * blocks stay cached for the next SYNCHRONIZE CACHE or write.
+ */
+static void alauda_flush_work(struct work_struct *work)
+{
+	struct alauda_info *info = container_of(work, struct alauda_info,
+			flush_work.work);
+	struct us_data *us = info->us;
+	unsigned long delay = ALAUDA_FLUSH_DELAY;
+	int busy = 0;
+
+	if (usb_autopm_get_interface(us->pusb_intf))
+		return;
+
+	mutex_lock(&us->dev_mutex);
+	if (test_bit(US_FLIDX_DISCONNECTING, &us->dflags))
+		goto unlock;
+
+	/* the next command may well be another write to the block */
+	if (us->srb) {
+		busy = 1;
+		goto unlock;
+	}
+
+	if (alauda_flush(us) != USB_STOR_XFER_GOOD &&
+	    info->flush_retries < ALAUDA_FLUSH_RETRIES) {
+		info->flush_retries++;
+		delay <<= info->flush_retries;
+		usb_stor_dbg(us, "Idle write back failed, retry in %u ms\n",
+			     jiffies_to_msecs(delay));
+		busy = 1;
+	}
+
+ unlock:
+	mutex_unlock(&us->dev_mutex);
+	usb_autopm_put_interface(us->pusb_intf);
+	if (busy)
+		queue_delayed_work(us->cmnd_wq, &info->flush_work, delay);
+}
+
+/*
+ * A reset doesn't touch the cached blocks, but the command that led to
+ * it may have been a write back, which is tried once more now.  If a
+ * block has to be dropped, the next SYNCHRONIZE CACHE to its port fails.
+ */
+static void alauda_flush_after_reset(struct us_data *us)
+{
+	struct alauda_info *info = (struct alauda_info *) us->extra;
+	int port;
+
+	if (!info)
+		return;
+
+	for (port = 0; port < 2; port++) {
+		struct alauda_media_info *media_info = &info->port[port];
+
+		if (alauda_flush_port(us, port) == USB_STOR_XFER_GOOD)
+			continue;
+		printk(KERN_ERR "alauda: lost the write to LBA %u\n",
+		       media_info->wlba);
+		media_info->wlba = UNDEF;
+		media_info->lost = 1;
+	}
+}
+
+static int alauda_transport_reset(struct us_data *us)
+{
+	int result = usb_stor_Bulk_reset(us);
+
+	alauda_flush_after_reset(us);
+	return result;
+}
+
+/* called with dev_mutex still held by usb_stor_pre_reset() */
+static int alauda_post_reset(struct usb_interface *iface)
+{
+	alauda_flush_after_reset(usb_get_intfdata(iface));
+	return usb_stor_post_reset(iface);
+}
+
 static void alauda_info_destructor(void *extra)
 {
 	struct alauda_info *info = (struct alauda_info *) extra;
@@ -1098,6 +1239,11 @@ static void alauda_info_destructor(void *extra)
 	if (!info)
 		return;
 
+	cancel_delayed_work_sync(&info->flush_work);
+
+	/* on an unbind the reader is still there to take the blocks */
+	alauda_flush(info->us);
+
 	for (port = 0; port < 2; port++) {
 		struct alauda_media_info *media_info = &info->port[port];
 
@@ -1114,7 +1260,6 @@ static int init_alauda(struct us_data *us)
 {
 	struct alauda_info *info;
 	struct usb_host_interface *altsetting = us->pusb_intf->cur_altsetting;
-	nand_init_ecc();
 
 	us->extra = kzalloc(sizeof(struct alauda_info), GFP_NOIO);
 	if (!us->extra)
@@ -1122,6 +1267,9 @@ static int init_alauda(struct us_data *us)
 
 	info = (struct alauda_info *) us->extra;
 	us->extra_destructor = alauda_info_destructor;
+	info->us = us;
+	info->port[0].wlba = info->port[1].wlba = UNDEF;
+	INIT_DELAYED_WORK(&info->flush_work, alauda_flush_work);
 
 	info->wr_ep = usb_sndbulkpipe(us->pusb_dev,
 		altsetting->endpoint[0].desc.bEndpointAddress
@@ -1221,6 +1369,25 @@ static int alauda_transport(struct scsi_cmnd *srb, struct us_data *us)
 		return USB_STOR_TRANSPORT_GOOD;
 	}
 
+	if (srb->cmnd[0] == SYNCHRONIZE_CACHE ||
+	    srb->cmnd[0] == ALLOW_MEDIUM_REMOVAL ||
+	    srb->cmnd[0] == START_STOP) {
+		if (alauda_flush_port(us, MEDIA_PORT(us)) !=
+				USB_STOR_XFER_GOOD ||
+		    (srb->cmnd[0] == SYNCHRONIZE_CACHE &&
+		     MEDIA_INFO(us).lost)) {
+			if (srb->cmnd[0] == SYNCHRONIZE_CACHE)
+				MEDIA_INFO(us).lost = 0;
+			info->sense_key = MEDIUM_ERROR;
+			info->sense_asc = 0x0C;	/* write error */
+			info->sense_ascq = 0x00;
+			return USB_STOR_TRANSPORT_FAILED;
+		}
+	}
+
+	if (srb->cmnd[0] == SYNCHRONIZE_CACHE)
+		return USB_STOR_TRANSPORT_GOOD;
+
 	if (srb->cmnd[0] == ALLOW_MEDIUM_REMOVAL) {
 		/* sure.  whatever.  not like we can stop the user from popping
 		   the media out of the device (no locking doors, etc) */
@@ -1251,9 +1418,12 @@ static int alauda_probe(struct usb_interface *intf,
 
 	us->transport_name  = "Alauda Control/Bulk";
 	us->transport = alauda_transport;
-	us->transport_reset = usb_stor_Bulk_reset;
+	us->transport_reset = alauda_transport_reset;
 	us->max_lun = 1;
 
+	/* have sd send SYNCHRONIZE CACHE for the write cache */
+	us->fflags |= US_FL_WRITE_CACHE;
+
 	result = usb_stor_probe2(us);
 	return result;
 }
@@ -1266,7 +1436,7 @@ static struct usb_driver alauda_driver = {
 	.resume =	usb_stor_resume,
 	.reset_resume =	usb_stor_reset_resume,
 	.pre_reset =	usb_stor_pre_reset,
-	.post_reset =	usb_stor_post_reset,
+	.post_reset =	alauda_post_reset,
 	.id_table =	alauda_usb_ids,
 	.soft_unbind =	1,
 	.no_dynamic_id = 1,
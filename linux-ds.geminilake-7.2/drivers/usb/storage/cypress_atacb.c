@@ -85,6 +85,7 @@ static struct us_unusual_dev cypress_unusual_dev_list[] = {
 static void cypress_atacb_passthrough(struct scsi_cmnd *srb, struct us_data *us)
 {
 	unsigned char save_cmnd[MAX_COMMAND_SIZE];
+	int dma = 0;
 
 	if (likely(srb->cmnd[0] != ATA_16 && srb->cmnd[0] != ATA_12)) {
 		usb_stor_transparent_scsi_command(srb, us);
@@ -94,16 +95,19 @@ static void cypress_atacb_passthrough(struct scsi_cmnd *srb, struct us_data *us)
 	memcpy(save_cmnd, srb->cmnd, sizeof(save_cmnd));
 	memset(srb->cmnd, 0, MAX_COMMAND_SIZE);
 
-	/* check if we support the command */
-	if (save_cmnd[1] >> 5) /* MULTIPLE_COUNT */
-		goto invalid_fld;
 	/* check protocol */
 	switch ((save_cmnd[1] >> 1) & 0xf) {
 	case 3: /*no DATA */
 	case 4: /* PIO in */
 	case 5: /* PIO out */
 		break;
-	default:
+	case 6: /* DMA */
+	case 10: /* UDMA in */
+	case 11: /* UDMA out */
+		/* the bridge runs the data phase in its configured DMA mode */
+		dma = 1;
+		break;
+	default: /* resets, diagnostics, queued and FPDMA */
 		goto invalid_fld;
 	}
 
@@ -117,7 +121,13 @@ static void cypress_atacb_passthrough(struct scsi_cmnd *srb, struct us_data *us)
 
 	srb->cmnd[3] = 0xff - 1; /* features, sector count, lba low, lba med
 								lba high, device, command are valid */
-	srb->cmnd[4] = 1; /* TransferBlockCount : 512 */
+	/* TransferBlockCount : sectors per DRQ block, 1 << MULTIPLE_COUNT,
+	 * as set by SET MULTIPLE MODE for READ/WRITE MULTIPLE; the
+	 * largest block the bridge takes is 128 sectors */
+	srb->cmnd[4] = 1 << (save_cmnd[1] >> 5);
+
+	if (dma)
+		srb->cmnd[2] |= (1<<6); /* UDMACommand */
 
 	if (save_cmnd[0] == ATA_16) {
 		srb->cmnd[ 6] = save_cmnd[ 4]; /* features */
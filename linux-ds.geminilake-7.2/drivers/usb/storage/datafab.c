@@ -63,6 +63,9 @@
 
 #define DRV_NAME "ums-datafab"
 
+/* The sector count of a READ/WRITE SECTORS command is a single byte */
+#define DATAFAB_MAX_SECTORS	255
+
 MODULE_DESCRIPTION("Driver for Datafab USB Compact Flash reader");
 MODULE_AUTHOR("Jimmie Mayfield <mayfield+datafab@sackheads.org>");
 MODULE_LICENSE("GPL");
@@ -149,12 +152,10 @@ static int datafab_read_data(struct us_data *us,
 			     u32 sectors)
 {
 	unsigned char *command = us->iobuf;
-	unsigned char *buffer;
 	unsigned char  thistime;
-	unsigned int totallen, alloclen;
-	int len, result;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result;
+	struct us_sg_part part;
 
 	// we're working in LBA mode.  according to the ATA spec, 
 	// we can support up to 28-bit addressing.  I don't know if Datafab
@@ -172,21 +173,17 @@ static int datafab_read_data(struct us_data *us,
 
 	totallen = sectors * info->ssize;
 
-	// Since we don't read more than 64 KB at a time, we have to create
-	// a bounce buffer and move the data a piece at a time between the
-	// bounce buffer and the actual transfer buffer.
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	// The data goes straight into the transfer buffer, a command's
+	// worth at a time, so that has to be big enough.
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		// loop, never allocate or transfer more than 64k at once
-		// (min(128k, 255*info->ssize) is the real limit)
+	usb_stor_sg_part_start(&part, us->srb);
 
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				DATAFAB_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
 
 		command[0] = 0;
 		command[1] = thistime;
@@ -202,27 +199,21 @@ static int datafab_read_data(struct us_data *us,
 		// send the read command
 		result = datafab_bulk_write(us, command, 8);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// read the result
-		result = datafab_bulk_read(us, buffer, len);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usb_stor_bulk_transfer_sg(us, us->recv_bulk_pipe,
+				part.sg, len, nents, NULL);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
-
-		// Store the data in the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				 &sg, &sg_offset, TO_XFER_BUF);
+			return USB_STOR_TRANSPORT_ERROR;
 
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return USB_STOR_TRANSPORT_GOOD;
-
- leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 
@@ -233,12 +224,10 @@ static int datafab_write_data(struct us_data *us,
 {
 	unsigned char *command = us->iobuf;
 	unsigned char *reply = us->iobuf;
-	unsigned char *buffer;
 	unsigned char thistime;
-	unsigned int totallen, alloclen;
-	int len, result;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result;
+	struct us_sg_part part;
 
 	// we're working in LBA mode.  according to the ATA spec, 
 	// we can support up to 28-bit addressing.  I don't know if Datafab
@@ -256,25 +245,17 @@ static int datafab_write_data(struct us_data *us,
 
 	totallen = sectors * info->ssize;
 
-	// Since we don't write more than 64 KB at a time, we have to create
-	// a bounce buffer and move the data a piece at a time between the
-	// bounce buffer and the actual transfer buffer.
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	// The data comes straight from the transfer buffer, a command's
+	// worth at a time, so that has to be big enough.
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		// loop, never allocate or transfer more than 64k at once
-		// (min(128k, 255*info->ssize) is the real limit)
-
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
+	usb_stor_sg_part_start(&part, us->srb);
 
-		// Get the data from the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &sg_offset, FROM_XFER_BUF);
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				DATAFAB_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
 
 		command[0] = 0;
 		command[1] = thistime;
@@ -290,35 +271,32 @@ static int datafab_write_data(struct us_data *us,
 		// send the command
 		result = datafab_bulk_write(us, command, 8);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// send the data
-		result = datafab_bulk_write(us, buffer, len);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usb_stor_bulk_transfer_sg(us, us->send_bulk_pipe,
+				part.sg, len, nents, NULL);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// read the result
 		result = datafab_bulk_read(us, reply, 2);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		if (reply[0] != 0x50 && reply[1] != 0) {
 			usb_stor_dbg(us, "Gah! write return code: %02x %02x\n",
 				     reply[0], reply[1]);
-			result = USB_STOR_TRANSPORT_ERROR;
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 		}
 
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return USB_STOR_TRANSPORT_GOOD;
-
- leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 
@@ -0,0 +1,240 @@
+/* Driver for USB Mass Storage compliant devices
+ * SYNCHRONIZE CACHE Emulation
+ *
+ * Some bridges hang or drop off the bus when they get SYNCHRONIZE CACHE,
+ * and are marked with SYNO_USB_QUIRK_SYNCHRONIZE_CACHE_FILTER.  For them
+ * the command is never sent; instead we give the device time to write
+ * back its cache on its own and then report success.
+ *
+ * That used to be a msleep(3000) on the command path, which stopped all
+ * other I/O to the device for three seconds on every journal commit.
+ * Here the flush is parked instead and completed from a timer while
+ * reads and writes keep going.  The wait is counted from the last
+ * data-out command rather than from the flush, so a device that has been
+ * idle for the whole delay has nothing left to write and the flush
+ * completes at once; after a write only the rest of the delay is waited
+ * for.  Flushes with no write between them share one deadline and
+ * complete together.
+ *
+ * A parked flush still counts against the host's can_queue, so hosts
+ * with the filter get US_FLUSH_SLOTS more than the one command the
+ * Bulk-only state machine runs, and disks a queue depth of 2.  The SCSI
+ * layer may then send a real command while another is running; it is
+ * held here, in order, until the control work is free for it, rather
+ * than bounced.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/usb.h>
+#include <linux/usb/syno_quirks.h>
+
+#include <scsi/scsi.h>
+#include <scsi/scsi_cmnd.h>
+
+#include "flush.h"
+
+static unsigned int flush_delay = 3000;
+module_param(flush_delay, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(flush_delay, "milliseconds a device without SYNCHRONIZE "
+		 "CACHE support needs after its last write");
+
+/* Remove entry i of an array of n commands, keeping the order */
+static void us_flush_remove(struct scsi_cmnd **srbs, unsigned long *expires,
+		unsigned int i, unsigned int n)
+{
+	memmove(&srbs[i], &srbs[i + 1], (n - i - 1) * sizeof(*srbs));
+	if (expires)
+		memmove(&expires[i], &expires[i + 1],
+				(n - i - 1) * sizeof(*expires));
+}
+
+/*
+ * Complete the parked flushes that are due, or all of them if result
+ * isn't SAM_STAT_GOOD, and rearm the timer for the rest.  Deadlines
+ * never decrease, so the due ones are at the front.  Called with the
+ * host lock held.
+ */
+static void us_flush_complete(struct us_flush *flush, int result)
+{
+	struct scsi_cmnd *srb;
+
+	while (flush->nr_parked) {
+		if (result == SAM_STAT_GOOD &&
+				time_before(jiffies, flush->expires[0])) {
+			mod_timer(&flush->timer, flush->expires[0]);
+			break;
+		}
+		srb = flush->parked[0];
+		us_flush_remove(flush->parked, flush->expires, 0,
+				flush->nr_parked--);
+		srb->result = result;
+		srb->scsi_done(srb);
+		flush->emulated++;
+	}
+}
+
+static void us_flush_timer(unsigned long data)
+{
+	struct us_flush *flush = (struct us_flush *) data;
+	unsigned long flags;
+
+	spin_lock_irqsave(flush->lock, flags);
+	us_flush_complete(flush, SAM_STAT_GOOD);
+	spin_unlock_irqrestore(flush->lock, flags);
+}
+
+void usb_stor_flush_init(struct us_flush *flush, struct usb_device *udev,
+		spinlock_t *lock)
+{
+	flush->enabled = !!(udev->syno_quirks &
+			SYNO_USB_QUIRK_SYNCHRONIZE_CACHE_FILTER);
+	flush->delay = flush_delay;
+	flush->lock = lock;
+	flush->last_write = jiffies;
+	setup_timer(&flush->timer, us_flush_timer, (unsigned long) flush);
+}
+
+/* Called once no more commands can arrive */
+void usb_stor_flush_release(struct us_flush *flush)
+{
+	unsigned long flags;
+
+	del_timer_sync(&flush->timer);
+
+	spin_lock_irqsave(flush->lock, flags);
+	us_flush_complete(flush, DID_NO_CONNECT << 16);
+	usb_stor_flush_next(flush, DID_NO_CONNECT << 16);
+	spin_unlock_irqrestore(flush->lock, flags);
+}
+
+/*
+ * Take srb over if it is a flush to emulate.  Returns 0 if the command
+ * must be sent as usual, 1 if it has been completed or parked, and
+ * -EBUSY if there is no room, which can_queue prevents.  Called with
+ * the host lock held.
+ */
+int usb_stor_flush_queue(struct us_flush *flush, struct scsi_cmnd *srb)
+{
+	unsigned long expires;
+	unsigned int n = flush->nr_parked;
+
+	if (!flush->enabled)
+		return 0;
+	if (srb->cmnd[0] != SYNCHRONIZE_CACHE) {
+		if (n)
+			flush->passed++;
+		return 0;
+	}
+
+	expires = READ_ONCE(flush->last_write) +
+			msecs_to_jiffies(flush->delay);
+
+	if (!n && time_after_eq(jiffies, expires)) {
+		srb->result = SAM_STAT_GOOD;
+		srb->scsi_done(srb);
+		flush->emulated++;
+		flush->immediate++;
+		return 1;
+	}
+
+	if (WARN_ON_ONCE(n == ARRAY_SIZE(flush->parked)))
+		return -EBUSY;
+
+	if (n && !time_after(expires, flush->expires[n - 1])) {
+		expires = flush->expires[n - 1];
+		flush->coalesced++;
+	}
+	flush->parked[n] = srb;
+	flush->expires[n] = expires;
+	flush->nr_parked++;
+	if (!n)
+		mod_timer(&flush->timer, expires);
+	return 1;
+}
+
+/*
+ * Hold srb back until the command that is running has finished.
+ * Returns -EBUSY if there is no room, which can_queue prevents.  Called
+ * with the host lock held.
+ */
+int usb_stor_flush_hold(struct us_flush *flush, struct scsi_cmnd *srb)
+{
+	if (!flush->enabled || flush->nr_held == ARRAY_SIZE(flush->held))
+		return -EBUSY;
+
+	flush->held[flush->nr_held++] = srb;
+	return 0;
+}
+
+/*
+ * Return the oldest held command, to be run next.  If result is nonzero
+ * all held commands are completed with it instead.  Called with the
+ * host lock held.
+ */
+struct scsi_cmnd *usb_stor_flush_next(struct us_flush *flush, int result)
+{
+	struct scsi_cmnd *srb;
+
+	while (flush->nr_held) {
+		srb = flush->held[0];
+		us_flush_remove(flush->held, NULL, 0, flush->nr_held--);
+		if (!result)
+			return srb;
+		srb->result = result;
+		srb->scsi_done(srb);
+	}
+	return NULL;
+}
+
+/*
+ * Drop srb if it is a parked flush or a held command.  Returns 1 if it
+ * was, in which case it will not be completed.  Called with the host
+ * lock held.
+ */
+int usb_stor_flush_abort(struct us_flush *flush, struct scsi_cmnd *srb)
+{
+	unsigned int i;
+
+	for (i = 0; i < flush->nr_parked; i++) {
+		if (flush->parked[i] == srb) {
+			us_flush_remove(flush->parked, flush->expires, i,
+					flush->nr_parked--);
+			if (!flush->nr_parked)
+				del_timer(&flush->timer);
+			return 1;
+		}
+	}
+	for (i = 0; i < flush->nr_held; i++) {
+		if (flush->held[i] == srb) {
+			us_flush_remove(flush->held, NULL, i,
+					flush->nr_held--);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Called for every command sent to the device, once it is done */
+void usb_stor_flush_note(struct us_flush *flush, struct scsi_cmnd *srb)
+{
+	if (flush->enabled && srb->sc_data_direction == DMA_TO_DEVICE)
+		WRITE_ONCE(flush->last_write, jiffies);
+}
+
+ssize_t usb_stor_flush_show_stats(struct us_flush *flush, char *buf)
+{
+	return sprintf(buf, "emulated %lu\ncoalesced %lu\nimmediate %lu\n"
+			"passed %lu\n", flush->emulated, flush->coalesced,
+			flush->immediate, flush->passed);
+}
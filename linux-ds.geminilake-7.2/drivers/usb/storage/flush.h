@@ -0,0 +1,62 @@
+/* Driver for USB Mass Storage compliant devices
+ * SYNCHRONIZE CACHE Emulation Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _FLUSH_H_
+#define _FLUSH_H_
+
+#include <linux/spinlock.h>
+#include <linux/timer.h>
+#include <linux/types.h>
+
+struct usb_device;
+struct scsi_cmnd;
+
+/* Commands besides the running one that a host with the filter takes */
+#define US_FLUSH_SLOTS		4
+
+struct us_flush {
+	unsigned int		enabled:1;	/* SYNCHRONIZE CACHE emulated */
+	unsigned int		delay;		/* ms the device needs after a write */
+	spinlock_t		*lock;		/* the host lock                */
+	struct timer_list	timer;		/* completes the parked flushes  */
+	unsigned long		last_write;	/* jiffies, last data-out command */
+
+	/* flushes waiting for their time, oldest first */
+	struct scsi_cmnd	*parked[US_FLUSH_SLOTS + 1];
+	unsigned long		expires[US_FLUSH_SLOTS + 1];
+	unsigned int		nr_parked;
+
+	/* commands that arrived while another one was running */
+	struct scsi_cmnd	*held[US_FLUSH_SLOTS];
+	unsigned int		nr_held;
+
+	/* statistics */
+	unsigned long		emulated;	/* flushes completed             */
+	unsigned long		coalesced;	/* ... together with an earlier one */
+	unsigned long		immediate;	/* ... without any wait          */
+	unsigned long		passed;		/* commands run past a parked one */
+};
+
+extern void usb_stor_flush_init(struct us_flush *flush,
+		struct usb_device *udev, spinlock_t *lock);
+extern void usb_stor_flush_release(struct us_flush *flush);
+extern int usb_stor_flush_queue(struct us_flush *flush, struct scsi_cmnd *srb);
+extern int usb_stor_flush_hold(struct us_flush *flush, struct scsi_cmnd *srb);
+extern struct scsi_cmnd *usb_stor_flush_next(struct us_flush *flush,
+		int result);
+extern int usb_stor_flush_abort(struct us_flush *flush, struct scsi_cmnd *srb);
+extern void usb_stor_flush_note(struct us_flush *flush, struct scsi_cmnd *srb);
+extern ssize_t usb_stor_flush_show_stats(struct us_flush *flush, char *buf);
+
+#endif
@@ -0,0 +1,57 @@
+/* Driver for USB Mass Storage compliant devices
+ * Free Block Index Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _FREEMAP_H_
+#define _FREEMAP_H_
+
+#include <linux/bitops.h>
+
+struct us_freemap {
+	unsigned long		*free;		/* blocks holding no data     */
+	unsigned long		*erased;	/* free blocks known erased   */
+	unsigned int		blocks;
+};
+
+#define US_FREEMAP_NONE		(~0U)	/* no free block found */
+
+extern int usb_stor_freemap_alloc(struct us_freemap *fm, unsigned int blocks);
+extern void usb_stor_freemap_free(struct us_freemap *fm);
+extern unsigned int usb_stor_freemap_find(struct us_freemap *fm,
+		unsigned int start, unsigned int end, unsigned int from,
+		int erased);
+
+/* The block holds no data; erased says whether it can be written as is */
+static inline void usb_stor_freemap_put(struct us_freemap *fm,
+		unsigned int block, int erased)
+{
+	if (block >= fm->blocks)
+		return;
+	__set_bit(block, fm->free);
+	if (erased)
+		__set_bit(block, fm->erased);
+	else
+		__clear_bit(block, fm->erased);
+}
+
+/* The block has been assigned, retired or found to be bad */
+static inline void usb_stor_freemap_take(struct us_freemap *fm,
+		unsigned int block)
+{
+	if (block >= fm->blocks)
+		return;
+	__clear_bit(block, fm->free);
+	__clear_bit(block, fm->erased);
+}
+
+#endif
@@ -60,6 +60,9 @@
 
 #define DRV_NAME "ums-jumpshot"
 
+/* The sector count of a READ/WRITE SECTORS command is a single byte */
+#define JUMPSHOT_MAX_SECTORS	255
+
 MODULE_DESCRIPTION("Driver for Lexar \"Jumpshot\" Compact Flash reader");
 MODULE_AUTHOR("Jimmie Mayfield <mayfield+usb@sackheads.org>");
 MODULE_LICENSE("GPL");
@@ -167,12 +170,10 @@ static int jumpshot_read_data(struct us_data *us,
 			      u32 sectors)
 {
 	unsigned char *command = us->iobuf;
-	unsigned char *buffer;
 	unsigned char  thistime;
-	unsigned int totallen, alloclen;
-	int len, result;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result;
+	struct us_sg_part part;
 
 	// we're working in LBA mode.  according to the ATA spec, 
 	// we can support up to 28-bit addressing.  I don't know if Jumpshot
@@ -184,20 +185,17 @@ static int jumpshot_read_data(struct us_data *us,
 
 	totallen = sectors * info->ssize;
 
-	// Since we don't read more than 64 KB at a time, we have to create
-	// a bounce buffer and move the data a piece at a time between the
-	// bounce buffer and the actual transfer buffer.
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	// The data goes straight into the transfer buffer, a command's
+	// worth at a time, so that has to be big enough.
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		// loop, never allocate or transfer more than 64k at once
-		// (min(128k, 255*info->ssize) is the real limit)
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
+	usb_stor_sg_part_start(&part, us->srb);
+
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				JUMPSHOT_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
 
 		command[0] = 0;
 		command[1] = thistime;
@@ -212,29 +210,23 @@ static int jumpshot_read_data(struct us_data *us,
 		result = usb_stor_ctrl_transfer(us, us->send_ctrl_pipe,
 					       0, 0x20, 0, 1, command, 7);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// read the result
-		result = jumpshot_bulk_read(us, buffer, len);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usb_stor_bulk_transfer_sg(us, us->recv_bulk_pipe,
+				part.sg, len, nents, NULL);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		usb_stor_dbg(us, "%d bytes\n", len);
 
-		// Store the data in the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				 &sg, &sg_offset, TO_XFER_BUF);
-
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return USB_STOR_TRANSPORT_GOOD;
-
- leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 
@@ -244,12 +236,10 @@ static int jumpshot_write_data(struct us_data *us,
 			       u32 sectors)
 {
 	unsigned char *command = us->iobuf;
-	unsigned char *buffer;
 	unsigned char  thistime;
-	unsigned int totallen, alloclen;
-	int len, result, waitcount;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result, waitcount;
+	struct us_sg_part part;
 
 	// we're working in LBA mode.  according to the ATA spec, 
 	// we can support up to 28-bit addressing.  I don't know if Jumpshot
@@ -261,25 +251,18 @@ static int jumpshot_write_data(struct us_data *us,
 
 	totallen = sectors * info->ssize;
 
-	// Since we don't write more than 64 KB at a time, we have to create
-	// a bounce buffer and move the data a piece at a time between the
-	// bounce buffer and the actual transfer buffer.
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	// The data comes straight from the transfer buffer, a command's
+	// worth at a time, so that has to be big enough.
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		// loop, never allocate or transfer more than 64k at once
-		// (min(128k, 255*info->ssize) is the real limit)
+	usb_stor_sg_part_start(&part, us->srb);
+	result = USB_STOR_TRANSPORT_GOOD;
 
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
-
-		// Get the data from the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &sg_offset, FROM_XFER_BUF);
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				JUMPSHOT_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
 
 		command[0] = 0;
 		command[1] = thistime;
@@ -294,12 +277,15 @@ static int jumpshot_write_data(struct us_data *us,
 		result = usb_stor_ctrl_transfer(us, us->send_ctrl_pipe,
 			0, 0x20, 0, 1, command, 7);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// send the data
-		result = jumpshot_bulk_write(us, buffer, len);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usb_stor_bulk_transfer_sg(us, us->send_bulk_pipe,
+				part.sg, len, nents, NULL);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_XFER_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		// read the result.  apparently the bulk write can complete
 		// before the jumpshot drive is finished writing.  so we loop
@@ -319,14 +305,9 @@ static int jumpshot_write_data(struct us_data *us,
 
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return result;
-
- leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 static int jumpshot_id_device(struct us_data *us,
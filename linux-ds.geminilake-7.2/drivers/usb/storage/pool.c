@@ -0,0 +1,108 @@
+/* Driver for USB Mass Storage compliant devices
+ * Transfer Buffer Pool
+ *
+ * The SmartMedia, xD and MemoryStick subdrivers translate every command
+ * into page and erase-block sized operations on the card and need
+ * temporary buffers of that size to do it.  Allocating them for each
+ * command means GFP_NOIO allocations of up to an erase block in the
+ * middle of writeback, which stall or fail when memory is short.
+ *
+ * Instead, a subdriver reserves its buffers once it knows the card's
+ * geometry and borrows them for every command.  Only if a reservation
+ * failed, or a command needs more than was reserved, is a buffer
+ * allocated on the spot; such allocations are counted in the
+ * buffer_allocs line of the transport_stats sysfs file.
+ *
+ * Commands run one at a time, so the pool needs no locking.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <linux/bitops.h>
+#include <linux/export.h>
+#include <linux/slab.h>
+
+#include "usb.h"
+#include "pool.h"
+
+/*
+ * Make sure buffer slot holds at least size bytes.  Called when a card's
+ * geometry becomes known, with no buffer handed out.
+ */
+int usb_stor_pool_reserve(struct us_data *us, int slot, unsigned int size)
+{
+	struct us_pool *pool = &us->pool;
+	void *buf;
+
+	if (pool->size[slot] >= size)
+		return 0;
+
+	buf = kmalloc(size, GFP_NOIO);
+	if (!buf)
+		return -ENOMEM;
+
+	kfree(pool->buf[slot]);
+	pool->buf[slot] = buf;
+	pool->size[slot] = size;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usb_stor_pool_reserve);
+
+void usb_stor_pool_release(struct us_data *us)
+{
+	struct us_pool *pool = &us->pool;
+	int i;
+
+	for (i = 0; i < US_POOL_BUFS; i++) {
+		kfree(pool->buf[i]);
+		pool->buf[i] = NULL;
+		pool->size[i] = 0;
+	}
+	pool->busy = 0;
+}
+
+/* Borrow the smallest free buffer of at least size bytes */
+void *usb_stor_pool_get(struct us_data *us, unsigned int size)
+{
+	struct us_pool *pool = &us->pool;
+	int i, best = -1;
+
+	for (i = 0; i < US_POOL_BUFS; i++) {
+		if (test_bit(i, &pool->busy) || pool->size[i] < size)
+			continue;
+		if (best < 0 || pool->size[i] < pool->size[best])
+			best = i;
+	}
+
+	if (best >= 0) {
+		__set_bit(best, &pool->busy);
+		return pool->buf[best];
+	}
+
+	us->stats.buffer_allocs++;
+	return kmalloc(size, GFP_NOIO);
+}
+EXPORT_SYMBOL_GPL(usb_stor_pool_get);
+
+void usb_stor_pool_put(struct us_data *us, void *buf)
+{
+	struct us_pool *pool = &us->pool;
+	int i;
+
+	for (i = 0; i < US_POOL_BUFS; i++) {
+		if (buf && buf == pool->buf[i]) {
+			__clear_bit(i, &pool->busy);
+			return;
+		}
+	}
+	kfree(buf);
+}
+EXPORT_SYMBOL_GPL(usb_stor_pool_put);
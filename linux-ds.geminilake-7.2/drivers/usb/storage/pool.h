@@ -0,0 +1,34 @@
+/* Driver for USB Mass Storage compliant devices
+ * Transfer Buffer Pool Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+struct us_data;
+
+#define US_POOL_BUFS		2	/* buffers a command may hold at once */
+
+struct us_pool {
+	void			*buf[US_POOL_BUFS];
+	unsigned int		size[US_POOL_BUFS];
+	unsigned long		busy;		/* buffers handed out */
+};
+
+extern int usb_stor_pool_reserve(struct us_data *us, int slot,
+		unsigned int size);
+extern void usb_stor_pool_release(struct us_data *us);
+extern void *usb_stor_pool_get(struct us_data *us, unsigned int size);
+extern void usb_stor_pool_put(struct us_data *us, void *buf);
+
+#endif
@@ -0,0 +1,58 @@
+/* Driver for USB Mass Storage compliant devices
+ * Management Command Response Cache Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _RESPCACHE_H_
+#define _RESPCACHE_H_
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct scsi_cmnd;
+
+#define US_CACHE_ENTRIES	8	/* responses remembered per host     */
+#define US_CACHE_DATA_SIZE	512	/* largest response kept (IDENTIFY)  */
+
+struct us_cache_entry {
+	unsigned long		expires;	/* jiffies; 0 = unused slot */
+	u64			lun;
+	unsigned int		len;		/* valid bytes in data[]    */
+	unsigned short		cmd_len;
+	unsigned char		cmnd[16];
+	unsigned char		*data;
+};
+
+struct us_cache {
+	spinlock_t		lock;		/* protects everything below */
+	unsigned int		ttl;		/* entry lifetime in ms, 0 = off */
+	unsigned int		next;		/* round-robin replacement slot */
+	unsigned char		*buf;		/* backing store for entry data */
+	struct us_cache_entry	entries[US_CACHE_ENTRIES];
+
+	/* statistics */
+	unsigned long		hits;
+	unsigned long		misses;
+	unsigned long		invalidations;
+};
+
+extern int usb_stor_cache_init(struct us_cache *cache);
+extern void usb_stor_cache_release(struct us_cache *cache);
+extern int usb_stor_cache_lookup(struct us_cache *cache,
+		struct scsi_cmnd *srb);
+extern void usb_stor_cache_complete(struct us_cache *cache,
+		struct scsi_cmnd *srb);
+extern void usb_stor_cache_invalidate(struct us_cache *cache);
+extern void usb_stor_cache_set_ttl(struct us_cache *cache, unsigned int ttl);
+extern ssize_t usb_stor_cache_show_stats(struct us_cache *cache, char *buf);
+
+#endif
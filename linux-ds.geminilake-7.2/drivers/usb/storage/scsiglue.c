@@ -48,6 +48,7 @@
 
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/slab.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -69,6 +70,31 @@
 #define VENDOR_ID_PENTAX	0x0a17
 #define VENDOR_ID_MOTOROLA	0x22b8
 
+/*
+ * SuperSpeed Bulk-only devices get 2048-sector transfers, which some
+ * bridges can't handle.  US_MAX_SECTORS_ERRORS failed transfers to a
+ * disk in a row that would have fit the next smaller limit drop its
+ * disks to 240 sectors, and then to 64, for as long as we are bound to
+ * the device.  The new limit is set from us->max_sectors_work rather
+ * than from the command path, and by slave_configure for disks that
+ * show up later.
+ */
+#define US_MAX_SECTORS_SUPER	2048
+#define US_MAX_SECTORS_ERRORS	3
+
+static unsigned int us_max_sectors_super(struct us_data *us,
+					 struct scsi_device *sdev)
+{
+	if (sdev->type == TYPE_DISK && us->max_sectors_limit)
+		return us->max_sectors_limit;
+	return US_MAX_SECTORS_SUPER;
+}
+
+static bool probe_provisioning = 1;
+module_param(probe_provisioning, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(probe_provisioning, "read the provisioning VPD pages of "
+		 "USB disks and enable UNMAP / WRITE SAME if reported");
+
 /***********************************************************************
  * Host functions 
  ***********************************************************************/
@@ -114,6 +140,230 @@ static int slave_alloc (struct scsi_device *sdev)
 	return 0;
 }
 
+/*
+ * Put every disk on the host back to the conservative defaults and turn
+ * discard off.  The queue flag may only be changed under the queue lock,
+ * which is why this runs from a work item and not from completion.
+ */
+static void usb_stor_provisioning_work(struct work_struct *work)
+{
+	struct us_provisioning *prov = container_of(work,
+			struct us_provisioning, work);
+	struct request_queue *q;
+	struct scsi_device *sdev;
+
+	shost_for_each_device(sdev, prov->host) {
+		if (sdev->type != TYPE_DISK)
+			continue;
+
+		sdev->no_write_same = 1;
+		sdev->skip_vpd_pages = 1;
+		sdev->try_vpd_pages = 0;
+		q = sdev->request_queue;
+		blk_queue_max_discard_sectors(q, 0);
+		spin_lock_irq(q->queue_lock);
+		queue_flag_clear(QUEUE_FLAG_DISCARD, q);
+		spin_unlock_irq(q->queue_lock);
+	}
+}
+
+void usb_stor_provisioning_init(struct us_provisioning *prov,
+				struct Scsi_Host *host)
+{
+	prov->host = host;
+	prov->disabled = false;
+	INIT_WORK(&prov->work, usb_stor_provisioning_work);
+}
+EXPORT_SYMBOL_GPL(usb_stor_provisioning_init);
+
+/* Called once no more commands can complete, before the host is put */
+void usb_stor_provisioning_release(struct us_provisioning *prov)
+{
+	cancel_work_sync(&prov->work);
+}
+EXPORT_SYMBOL_GPL(usb_stor_provisioning_release);
+
+/* Give up on logical block provisioning for this device */
+static void usb_stor_stop_provisioning(struct us_provisioning *prov,
+				       struct scsi_device *sdev)
+{
+	if (!prov->disabled)
+		sdev_printk(KERN_WARNING, sdev,
+			    "bridge failed provisioning commands, disabling UNMAP / WRITE SAME\n");
+	prov->disabled = true;
+}
+
+/*
+ * Most bridges handle VPD pages and UNMAP fine, but enough of them lock
+ * up that the defaults keep sd away from both.  Read the Supported VPD
+ * Pages, Block Limits and Logical Block Provisioning pages here, and if
+ * the device reports UNMAP or WRITE SAME let sd read the pages itself and
+ * configure discard with the reported granularity.  Any error marks the
+ * device so that it is never probed again.
+ *
+ * Returns 1 if sd may use the provisioning commands, 0 otherwise.  Called
+ * from slave_configure, where the device is already able to do I/O.
+ */
+int usb_stor_probe_provisioning(struct us_provisioning *prov,
+				struct scsi_device *sdev)
+{
+	unsigned char *buf;
+	unsigned int skip_vpd_pages = sdev->skip_vpd_pages;
+	int i, len, have_b0 = 0, have_b2 = 0;
+	int lbpu, lbpws, result = 0;
+
+	if (!probe_provisioning || sdev->type != TYPE_DISK)
+		return 0;
+	if (prov->disabled) {
+		sdev->no_write_same = 1;
+		return 0;
+	}
+
+	buf = kmalloc(255, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	sdev->skip_vpd_pages = 0;
+
+	/* Supported VPD Pages */
+	if (scsi_get_vpd_page(sdev, 0x00, buf, 255))
+		goto error;
+	len = min(buf[3] + 4, 255);
+	for (i = 4; i < len; i++) {
+		if (buf[i] == 0xb0)
+			have_b0 = 1;
+		else if (buf[i] == 0xb2)
+			have_b2 = 1;
+	}
+	if (!have_b0 || !have_b2)
+		goto out;
+
+	/* Block Limits, only checked for sanity; sd parses it again */
+	if (scsi_get_vpd_page(sdev, 0xb0, buf, 64) || buf[1] != 0xb0)
+		goto error;
+
+	/* Logical Block Provisioning */
+	if (scsi_get_vpd_page(sdev, 0xb2, buf, 8) || buf[1] != 0xb2)
+		goto error;
+	lbpu = buf[5] & 0x80;
+	lbpws = buf[5] & 0x60;
+	if (!lbpu && !lbpws)
+		goto out;
+
+	sdev_printk(KERN_INFO, sdev, "logical block provisioning:%s%s\n",
+		    lbpu ? " UNMAP" : "", lbpws ? " WRITE SAME" : "");
+
+	/* LBPME is only reported by READ CAPACITY(16) */
+	sdev->try_rc_10_first = 0;
+	sdev->try_vpd_pages = 1;
+	if (lbpws)
+		sdev->no_write_same = 0;
+	skip_vpd_pages = 0;
+	result = 1;
+	goto out;
+
+error:
+	usb_stor_stop_provisioning(prov, sdev);
+	sdev->no_write_same = 1;
+out:
+	sdev->skip_vpd_pages = skip_vpd_pages;
+	kfree(buf);
+	return result;
+}
+EXPORT_SYMBOL_GPL(usb_stor_probe_provisioning);
+
+/*
+ * sd turns discard off by itself when UNMAP or WRITE SAME is rejected as
+ * an illegal request; bridges that fail them in any other way (or that
+ * need a reset afterwards) are remembered here as well.  May be called
+ * in atomic context; the queues are updated later from prov->work.
+ */
+void usb_stor_check_provisioning(struct us_provisioning *prov,
+				 struct scsi_cmnd *srb)
+{
+	struct scsi_sense_hdr sshdr;
+
+	switch (srb->cmnd[0]) {
+	case UNMAP:
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		break;
+	default:
+		return;
+	}
+
+	if (host_byte(srb->result) == DID_OK) {
+		if ((srb->result & 0xff) != SAM_STAT_CHECK_CONDITION)
+			return;
+		if (!scsi_normalize_sense(srb->sense_buffer,
+				SCSI_SENSE_BUFFERSIZE, &sshdr) ||
+				sshdr.sense_key != ILLEGAL_REQUEST)
+			return;
+	}
+
+	usb_stor_stop_provisioning(prov, srb->device);
+	schedule_work(&prov->work);
+}
+EXPORT_SYMBOL_GPL(usb_stor_check_provisioning);
+
+/* Apply a fallen-back transfer limit to the disks of the host */
+void usb_stor_max_sectors_work(struct work_struct *work)
+{
+	struct us_data *us = container_of(work, struct us_data,
+			max_sectors_work);
+	struct scsi_device *sdev;
+	unsigned int max_sectors;
+
+	shost_for_each_device(sdev, us_to_host(us)) {
+		max_sectors = us_max_sectors_super(us, sdev);
+		if (queue_max_hw_sectors(sdev->request_queue) > max_sectors)
+			blk_queue_max_hw_sectors(sdev->request_queue,
+					max_sectors);
+	}
+}
+EXPORT_SYMBOL_GPL(usb_stor_max_sectors_work);
+
+/*
+ * Called for every command sent to a device, with failed set if it ended
+ * in a transport error or timed out.  Falls back to a smaller transfer
+ * limit as described above.
+ */
+void usb_stor_check_max_sectors(struct us_data *us, struct scsi_cmnd *srb,
+				int failed)
+{
+	unsigned int max_sectors;
+
+	if (us->pusb_dev->speed < USB_SPEED_SUPER ||
+			us->protocol != USB_PR_BULK ||
+			srb->device->type != TYPE_DISK ||
+			(us->fflags & (US_FL_MAX_SECTORS_64 |
+				US_FL_MAX_SECTORS_MIN | US_FL_MAX_SECTORS_240)))
+		return;
+
+	max_sectors = us_max_sectors_super(us, srb->device);
+	if (max_sectors == 64)
+		return;
+	max_sectors = max_sectors == 240 ? 64 : 240;
+
+	/* Transfers that would fit the smaller limit tell us nothing */
+	if (scsi_bufflen(srb) <= max_sectors << 9)
+		return;
+	if (!failed) {
+		us->max_sectors_errors = 0;
+		return;
+	}
+	if (++us->max_sectors_errors < US_MAX_SECTORS_ERRORS)
+		return;
+
+	us->max_sectors_errors = 0;
+	us->max_sectors_fallbacks++;
+	us->max_sectors_limit = max_sectors;
+	dev_warn(&us->pusb_intf->dev,
+		 "repeated transfer errors, limiting transfers to %u sectors\n",
+		 max_sectors);
+	queue_work(us->cmnd_wq, &us->max_sectors_work);
+}
+
 static int slave_configure(struct scsi_device *sdev)
 {
 	struct us_data *us = host_to_us(sdev->host);
@@ -136,14 +386,16 @@ static int slave_configure(struct scsi_device *sdev)
 		 * let the queue segment size sort out the real limit.
 		 */
 		blk_queue_max_hw_sectors(sdev->request_queue, 0x7FFFFF);
-#if defined(CONFIG_SYNO_LSP_RTD1619)
-	} else if (us->pusb_dev->speed >= USB_SPEED_SUPER) {
+	} else if (us->pusb_dev->speed >= USB_SPEED_SUPER &&
+			us->protocol == USB_PR_BULK &&
+			!(us->fflags & US_FL_MAX_SECTORS_240)) {
 		/*
 		 * USB3 devices will be limited to 2048 sectors. This gives us
-		 * better throughput on most devices.
+		 * better throughput on most devices.  Disks that couldn't
+		 * cope get the limit they fell back to.
 		 */
-		blk_queue_max_hw_sectors(sdev->request_queue, 2048);
-#endif /* CONFIG_SYNO_LSP_RTD1619 */
+		blk_queue_max_hw_sectors(sdev->request_queue,
+				us_max_sectors_super(us, sdev));
 	}
 
 	/* Some USB host controllers can't do DMA; they have to use PIO.
@@ -234,6 +486,17 @@ static int slave_configure(struct scsi_device *sdev)
 		if (!(us->fflags & US_FL_NEEDS_CAP16))
 			sdev->try_rc_10_first = 1;
 
+		/* Unless the device says it can do UNMAP or WRITE SAME,
+		 * or failing that, the disk behind the bridge does TRIM.
+		 * Only plain SCSI over Bulk-only can be expected to know
+		 * about VPD pages at all. */
+		if (us->protocol == USB_PR_BULK &&
+				us->subclass == USB_SC_SCSI &&
+				!(us->fflags & US_FL_NO_READ_CAPACITY_16) &&
+				!usb_stor_probe_provisioning(&us->prov, sdev) &&
+				!(us->fflags & US_FL_NO_ATA_1X))
+			usb_stor_trim_probe(&us->trim, &us->prov, sdev);
+
 		/*
 		 * assume SPC3 or latter devices support sense size > 18
 		 * unless US_FL_BAD_SENSE quirk is specified.
@@ -275,6 +538,10 @@ static int slave_configure(struct scsi_device *sdev)
 		if (us->fflags & US_FL_BROKEN_FUA)
 			sdev->broken_fua = 1;
 
+		/* Let I/O pass while an emulated flush is parked */
+		if (us->flush.enabled)
+			scsi_change_queue_depth(sdev, 2);
+
 	} else {
 
 		/* Non-disk-type devices don't need to blacklist any pages
@@ -340,9 +607,11 @@ static int queuecommand_lck(struct scsi_cmnd *srb,
 			void (*done)(struct scsi_cmnd *))
 {
 	struct us_data *us = host_to_us(srb->device->host);
+	int result;
 
-	/* check for state-transition errors */
-	if (us->srb != NULL) {
+	/* check for state-transition errors; hosts with the SYNCHRONIZE
+	 * CACHE filter take more commands and hold them back */
+	if (us->srb != NULL && !us->flush.enabled) {
 		printk(KERN_ERR USB_STORAGE "Error in %s: us->srb = %p\n",
 			__func__, us->srb);
 		return SCSI_MLQUEUE_HOST_BUSY;
@@ -356,6 +625,11 @@ static int queuecommand_lck(struct scsi_cmnd *srb,
 		return 0;
 	}
 
+	/* emulated SYNCHRONIZE CACHE doesn't need the device */
+	result = usb_stor_flush_queue(&us->flush, srb);
+	if (result)
+		return result < 0 ? SCSI_MLQUEUE_HOST_BUSY : 0;
+
 	if ((us->fflags & US_FL_NO_ATA_1X) &&
 			(srb->cmnd[0] == ATA_12 || srb->cmnd[0] == ATA_16)) {
 		memcpy(srb->sense_buffer, usb_stor_sense_invalidCDB,
@@ -365,10 +639,18 @@ static int queuecommand_lck(struct scsi_cmnd *srb,
 		return 0;
 	}
 
-	/* enqueue the command and wake up the control thread */
+	/* enqueue the command and queue the work that runs it */
 	srb->scsi_done = done;
+	if (us->srb != NULL) {
+		if (usb_stor_flush_hold(&us->flush, srb)) {
+			printk(KERN_ERR USB_STORAGE "Error in %s: us->srb = %p\n",
+				__func__, us->srb);
+			return SCSI_MLQUEUE_HOST_BUSY;
+		}
+		return 0;
+	}
 	us->srb = srb;
-	complete(&us->cmnd_ready);
+	queue_work(us->cmnd_wq, &us->cmnd_work);
 
 	return 0;
 }
@@ -390,6 +672,13 @@ static int command_abort(struct scsi_cmnd *srb)
 	 * bits are protected by the host lock. */
 	scsi_lock(us_to_host(us));
 
+	/* A parked flush or a held command is simply dropped */
+	if (usb_stor_flush_abort(&us->flush, srb)) {
+		scsi_unlock(us_to_host(us));
+		usb_stor_dbg(us, "-- dropped command that was not sent\n");
+		return SUCCESS;
+	}
+
 	/* Is this command still active? */
 	if (us->srb != srb) {
 		scsi_unlock(us_to_host(us));
@@ -426,6 +715,7 @@ static int device_reset(struct scsi_cmnd *srb)
 	/* lock the device pointers and do the reset */
 	mutex_lock(&(us->dev_mutex));
 	result = us->transport_reset(us);
+	usb_stor_cache_invalidate(&us->cache);
 	mutex_unlock(&us->dev_mutex);
 
 	return result < 0 ? FAILED : SUCCESS;
@@ -451,6 +741,7 @@ void usb_stor_report_device_reset(struct us_data *us)
 	int i;
 	struct Scsi_Host *host = us_to_host(us);
 
+	usb_stor_cache_invalidate(&us->cache);
 	scsi_report_device_reset(host, 0, 0);
 	if (us->fflags & US_FL_SCM_MULT_TARG) {
 		for (i = 1; i < host->max_id; ++i)
@@ -465,6 +756,7 @@ void usb_stor_report_bus_reset(struct us_data *us)
 {
 	struct Scsi_Host *host = us_to_host(us);
 
+	usb_stor_cache_invalidate(&us->cache);
 	scsi_lock(host);
 	scsi_report_bus_reset(host, 0);
 	scsi_unlock(host);
@@ -550,6 +842,165 @@ static ssize_t max_sectors_store(struct device *dev, struct device_attribute *at
 	return -EINVAL;
 }
 
+/* Output routine for the sysfs cache_ttl file */
+static ssize_t cache_ttl_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->cache.ttl);
+}
+
+/* Input routine for the sysfs cache_ttl file */
+static ssize_t cache_ttl_store(struct device *dev, struct device_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+	unsigned int ttl;
+
+	if (sscanf(buf, "%u", &ttl) > 0) {
+		usb_stor_cache_set_ttl(&us->cache, ttl);
+		return count;
+	}
+	return -EINVAL;
+}
+
+/* Output routine for the sysfs cache_stats file */
+static ssize_t cache_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return usb_stor_cache_show_stats(&us->cache, buf);
+}
+
+/* Output routine for the sysfs flush_delay file */
+static ssize_t flush_delay_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->flush.delay);
+}
+
+/* Input routine for the sysfs flush_delay file */
+static ssize_t flush_delay_store(struct device *dev, struct device_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+	unsigned int delay;
+
+	if (sscanf(buf, "%u", &delay) > 0) {
+		us->flush.delay = delay;
+		return count;
+	}
+	return -EINVAL;
+}
+
+/* Output routine for the sysfs flush_stats file */
+static ssize_t flush_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return usb_stor_flush_show_stats(&us->flush, buf);
+}
+
+/* Output routine for the sysfs max_sectors_fallbacks file */
+static ssize_t max_sectors_fallbacks_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->max_sectors_fallbacks);
+}
+
+/* Output routine for the sysfs sg_stats file */
+static ssize_t sg_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "single %lu\nsplit %lu\nurbs %lu\nbytes %llu\n",
+			us->sg_single, us->sg_split, us->sg_urbs, us->sg_bytes);
+}
+
+/* Output routine for the sysfs ready_time file */
+static ssize_t ready_time_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->ready_time);
+}
+
+/* Output routine for the sysfs transport_stats file */
+static ssize_t transport_stats_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return usb_stor_stats_show(&us->stats, buf);
+}
+
+/* Input routine for the sysfs transport_stats file: any write clears */
+static ssize_t transport_stats_store(struct device *dev, struct device_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	mutex_lock(&us->dev_mutex);
+	usb_stor_stats_clear(&us->stats);
+	mutex_unlock(&us->dev_mutex);
+	return count;
+}
+
+/* Output routine for the sysfs phase_delay file */
+static ssize_t phase_delay_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->phase_delay);
+}
+
+/* Input routine for the sysfs phase_delay file */
+static ssize_t phase_delay_store(struct device *dev, struct device_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+	unsigned int delay;
+
+	if (sscanf(buf, "%u", &delay) > 0 && delay <= US_PHASE_DELAY_MAX) {
+		mutex_lock(&us->dev_mutex);
+		us->delay_calibrating = 0;
+		us->phase_delay = delay;
+		mutex_unlock(&us->dev_mutex);
+		return count;
+	}
+	return -EINVAL;
+}
+
+/* Output routine for the sysfs phase_delay_calibrate file */
+static ssize_t phase_delay_calibrate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+
+	return sprintf(buf, "%u\n", us->delay_calibrating);
+}
+
+/* Input routine for the sysfs phase_delay_calibrate file: 1 starts over
+ * from no delay, 0 keeps the value reached so far */
+static ssize_t phase_delay_calibrate_store(struct device *dev, struct device_attribute *attr, const char *buf,
+		size_t count)
+{
+	struct us_data *us = host_to_us(to_scsi_device(dev)->host);
+	unsigned int on;
+
+	if (sscanf(buf, "%u", &on) > 0) {
+		mutex_lock(&us->dev_mutex);
+		if (on) {
+			us->phase_delay = 0;
+			us->delay_clean = 0;
+		}
+		us->delay_calibrating = !!on;
+		mutex_unlock(&us->dev_mutex);
+		return count;
+	}
+	return -EINVAL;
+}
+
 #ifdef MY_ABC_HERE
 extern int blIsCardReader(struct usb_device *usbdev);
 static ssize_t show_syno_cardreader(struct device *dev,
@@ -568,9 +1019,29 @@ static ssize_t show_syno_cardreader(struct device *dev,
 static DEVICE_ATTR(syno_cardreader, S_IRUGO, show_syno_cardreader, NULL);
 #endif /* MY_ABC_HERE */
 static DEVICE_ATTR_RW(max_sectors);
+static DEVICE_ATTR_RO(max_sectors_fallbacks);
+static DEVICE_ATTR_RO(sg_stats);
+static DEVICE_ATTR_RO(ready_time);
+static DEVICE_ATTR_RW(transport_stats);
+static DEVICE_ATTR_RW(cache_ttl);
+static DEVICE_ATTR_RO(cache_stats);
+static DEVICE_ATTR_RW(flush_delay);
+static DEVICE_ATTR_RO(flush_stats);
+static DEVICE_ATTR_RW(phase_delay);
+static DEVICE_ATTR_RW(phase_delay_calibrate);
 
 static struct device_attribute *sysfs_device_attr_list[] = {
 	&dev_attr_max_sectors,
+	&dev_attr_max_sectors_fallbacks,
+	&dev_attr_sg_stats,
+	&dev_attr_ready_time,
+	&dev_attr_transport_stats,
+	&dev_attr_cache_ttl,
+	&dev_attr_cache_stats,
+	&dev_attr_flush_delay,
+	&dev_attr_flush_stats,
+	&dev_attr_phase_delay,
+	&dev_attr_phase_delay_calibrate,
 #ifdef MY_ABC_HERE
 	&dev_attr_syno_cardreader,
 #endif /* MY_ABC_HERE */
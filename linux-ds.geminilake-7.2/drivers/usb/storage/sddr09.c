@@ -42,7 +42,9 @@
 
 #include <linux/errno.h>
 #include <linux/module.h>
+#include <linux/pm_runtime.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 
 #include <scsi/scsi.h>
 #include <scsi/scsi_cmnd.h>
@@ -53,6 +55,8 @@
 #include "protocol.h"
 #include "debug.h"
 #include "scsiglue.h"
+#include "smecc.h"
+#include "freemap.h"
 
 #define DRV_NAME "ums-sddr09"
 
@@ -191,58 +195,8 @@ nand_find_id(unsigned char id) {
 }
 
 /*
- * ECC computation.
+ * ECC checking; the code itself comes from usb_stor_sm_ecc().
  */
-static unsigned char parity[256];
-static unsigned char ecc2[256];
-
-static void nand_init_ecc(void) {
-	int i, j, a;
-
-	parity[0] = 0;
-	for (i = 1; i < 256; i++)
-		parity[i] = (parity[i&(i-1)] ^ 1);
-
-	for (i = 0; i < 256; i++) {
-		a = 0;
-		for (j = 0; j < 8; j++) {
-			if (i & (1<<j)) {
-				if ((j & 1) == 0)
-					a ^= 0x04;
-				if ((j & 2) == 0)
-					a ^= 0x10;
-				if ((j & 4) == 0)
-					a ^= 0x40;
-			}
-		}
-		ecc2[i] = ~(a ^ (a<<1) ^ (parity[i] ? 0xa8 : 0));
-	}
-}
-
-/* compute 3-byte ecc on 256 bytes */
-static void nand_compute_ecc(unsigned char *data, unsigned char *ecc) {
-	int i, j, a;
-	unsigned char par = 0, bit, bits[8] = {0};
-
-	/* collect 16 checksum bits */
-	for (i = 0; i < 256; i++) {
-		par ^= data[i];
-		bit = parity[data[i]];
-		for (j = 0; j < 8; j++)
-			if ((i & (1<<j)) == 0)
-				bits[j] ^= bit;
-	}
-
-	/* put 4+4+4 = 12 bits in the ecc */
-	a = (bits[3] << 6) + (bits[2] << 4) + (bits[1] << 2) + bits[0];
-	ecc[0] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
-
-	a = (bits[7] << 6) + (bits[6] << 4) + (bits[5] << 2) + bits[4];
-	ecc[1] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
-
-	ecc[2] = ecc2[par];
-}
-
 static int nand_compare_ecc(unsigned char *data, unsigned char *ecc) {
 	return (data[0] == ecc[0] && data[1] == ecc[1] && data[2] == ecc[2]);
 }
@@ -262,13 +216,43 @@ struct sddr09_card_info {
 	int		blocksize;	/* Size of block in pages */
 	int		blockshift;	/* log2 of blocksize */
 	int		blockmask;	/* 2^blockshift - 1 */
-	int		*lba_to_pba;	/* logical to physical map */
-	int		*pba_to_lba;	/* physical to logical map */
+	int		numblocks;	/* number of physical blocks */
+	int		numzones;	/* zones of up to 1024 blocks */
+	u16		**lba_to_pba;	/* logical to physical map, per zone */
+	u16		**pba_to_lba;	/* physical to logical map, per zone */
+	struct us_freemap freemap;	/* blocks mapped as UNDEF */
 	int		lbact;		/* number of available pages */
 	int		flags;
 #define	SDDR09_WP	1		/* write protected */
+#define	SDDR09_FRESH	2		/* no read since the maps were reset */
+#define	SDDR09_LOST	4		/* a cached write was dropped */
+	unsigned long	map_start;	/* jiffies when the maps were reset */
+	unsigned char	*wbuf;		/* open block with control bytes */
+	unsigned int	wlba;		/* LBA held in wbuf, or UNDEF */
+	unsigned int	wpba;		/* where it is written back to */
+	unsigned int	flush_retries;	/* failed idle write backs in a row */
+	struct us_data	*us;
+	struct delayed_work map_work;	/* maps the zones not used yet */
+	struct delayed_work flush_work;	/* writes wbuf back when idle */
 };
 
+/* Wait this long after card init and between zones before mapping more */
+#define SDDR09_MAP_DELAY	(HZ / 2)
+
+/* Write the open block back after this long without another write */
+#define SDDR09_FLUSH_DELAY	HZ
+
+/* A failed idle write back is retried after 2, 4, 8 and 16 seconds */
+#define SDDR09_FLUSH_RETRIES	4
+
+/* Blocks in a zone; a small card has a single zone of less than 1024 */
+static inline int
+sddr09_zone_blocks(struct sddr09_card_info *info, int zone) {
+	return min(info->numblocks - (zone << 10), 1024);
+}
+
+static int sddr09_ensure_map(struct us_data *us, int zone);
+
 /*
  * On my 16MB card, control blocks have size 64 (16 real control bytes,
  * and 48 junk bytes). In reality of course the card uses 16 control bytes,
@@ -286,11 +270,11 @@ struct sddr09_card_info {
 #define	LUNBITS	(LUN << 5)
 
 /*
- * LBA and PBA are unsigned ints. Special values.
+ * LBA and PBA are unsigned ints, kept as u16 in the maps. Special values.
  */
-#define UNDEF    0xffffffff
-#define SPARE    0xfffffffe
-#define UNUSABLE 0xfffffffd
+#define UNDEF    0xffff
+#define SPARE    0xfffe
+#define UNUSABLE 0xfffd
 
 static const int erase_bad_lba_entries = 0;
 
@@ -747,15 +731,15 @@ sddr09_read_data(struct us_data *us,
 	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
 	unsigned char *buffer;
 	unsigned int lba, maxlba, pba;
-	unsigned int page, pages;
-	unsigned int len, offset;
-	struct scatterlist *sg;
+	unsigned int page, pages, pagelen;
+	unsigned int len, i;
+	struct us_xfer_cursor cur;
 	int result;
 
 	// Figure out the initial LBA and page
 	lba = address >> info->blockshift;
 	page = (address & info->blockmask);
-	maxlba = info->capacity >> (info->pageshift + info->blockshift);
+	maxlba = info->lbact;
 	if (lba >= maxlba)
 		return -EIO;
 
@@ -764,7 +748,7 @@ sddr09_read_data(struct us_data *us,
 	// bounce buffer and the actual transfer buffer.
 
 	len = min(sectors, (unsigned int) info->blocksize) * info->pagesize;
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL) {
 		printk(KERN_WARNING "sddr09_read_data: Out of memory\n");
 		return -ENOMEM;
@@ -774,8 +758,7 @@ sddr09_read_data(struct us_data *us,
 	// contiguous LBA's. Another exercise left to the student.
 
 	result = 0;
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, TO_XFER_BUF);
 
 	while (sectors > 0) {
 
@@ -792,9 +775,23 @@ sddr09_read_data(struct us_data *us,
 		}
 
 		/* Find where this lba lives on disk */
-		pba = info->lba_to_pba[lba];
+		result = sddr09_ensure_map(us, lba / 1000);
+		if (result)
+			break;
+		pba = info->lba_to_pba[lba / 1000][lba % 1000];
 
-		if (pba == UNDEF) {	/* this lba was never written */
+		if (lba == info->wlba) {	/* not written back yet */
+
+			usb_stor_dbg(us, "Read %d cached pages (LBA %d) page %d\n",
+				     pages, lba, page);
+
+			pagelen = info->pagesize + (1 << CONTROL_SHIFT);
+			for (i = 0; i < pages; i++)
+				memcpy(buffer + (i << info->pageshift),
+				       info->wbuf + (page + i) * pagelen,
+				       info->pagesize);
+
+		} else if (pba == UNDEF) {	/* this lba was never written */
 
 			usb_stor_dbg(us, "Read %d zero pages (LBA %d) page %d\n",
 				     pages, lba, page);
@@ -820,48 +817,91 @@ sddr09_read_data(struct us_data *us,
 		}
 
 		// Store the data in the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, TO_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
 		page = 0;
 		lba++;
 		sectors -= pages;
 	}
 
-	kfree(buffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 	return result;
 }
 
 static unsigned int
 sddr09_find_unused_pba(struct sddr09_card_info *info, unsigned int lba) {
 	static unsigned int lastpba = 1;
-	int zonestart, end, i;
-
-	zonestart = (lba/1000) << 10;
-	end = info->capacity >> (info->blockshift + info->pageshift);
-	end -= zonestart;
-	if (end > 1024)
-		end = 1024;
-
-	for (i = lastpba+1; i < end; i++) {
-		if (info->pba_to_lba[zonestart+i] == UNDEF) {
-			lastpba = i;
-			return zonestart+i;
-		}
-	}
-	for (i = 0; i <= lastpba; i++) {
-		if (info->pba_to_lba[zonestart+i] == UNDEF) {
-			lastpba = i;
-			return zonestart+i;
-		}
-	}
-	return 0;
+	unsigned int zonestart, pba;
+
+	zonestart = (lba / 1000) << 10;
+	pba = usb_stor_freemap_find(&info->freemap, zonestart,
+			zonestart + sddr09_zone_blocks(info, lba / 1000),
+			zonestart + lastpba + 1, 0);
+	if (pba == US_FREEMAP_NONE)
+		return 0;
+	lastpba = pba - zonestart;
+	return pba;
 }
 
+/*
+ * Write the cached block back, erasing and programming the whole block
+ * in place.  It stays cached when that fails, so the rewrite can be
+ * tried again after the reset that follows a failed command.
+ */
+static int
+sddr09_flush(struct us_data *us) {
+	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
+	unsigned long address;
+	int result;
+
+	if (info->wlba == UNDEF)
+		return 0;
+
+	usb_stor_dbg(us, "Rewrite PBA %d (LBA %d)\n", info->wpba, info->wlba);
+
+	address = (info->wpba << (info->pageshift + info->blockshift));
+	result = sddr09_write_inplace(us, address>>1, info->blocksize,
+				      info->pageshift, info->wbuf, 0);
+
+	usb_stor_dbg(us, "sddr09_write_inplace returns %d\n", result);
+
+	if (result == 0)
+		info->wlba = UNDEF;
+	return result;
+}
+
+/* Forget the cached block, it cannot be written back */
+static void
+sddr09_drop_cache(struct sddr09_card_info *info) {
+	if (info->wlba != UNDEF)
+		printk(KERN_ERR "sddr09: lost the write to LBA %u\n",
+		       info->wlba);
+	info->wlba = UNDEF;
+}
+
+/* Queue the idle write back on the device's own workqueue */
+static void
+sddr09_queue_flush(struct us_data *us, unsigned long delay) {
+	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
+
+	mod_delayed_work(us->cmnd_wq, &info->flush_work, delay);
+}
+
+/*
+ * Write some pages of an LBA.  The first write to a block reads it
+ * into the write cache, later writes to the same block are merged
+ * there and the block is written back once, when the cache is flushed:
+ * on a write to another block or to the last page of this one, on
+ * SYNCHRONIZE CACHE, ALLOW MEDIUM REMOVAL and START STOP UNIT, after
+ * SDDR09_FLUSH_DELAY without writes, after a reset and on unbind.
+ * Without US_FL_WRITE_CACHE sd never sends SYNCHRONIZE CACHE, so every
+ * write goes straight through.
+ */
 static int
 sddr09_write_lba(struct us_data *us, unsigned int lba,
 		 unsigned int page, unsigned int pages,
-		 unsigned char *ptr, unsigned char *blockbuffer) {
+		 unsigned char *ptr) {
 
 	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
 	unsigned long address;
@@ -869,13 +909,27 @@ sddr09_write_lba(struct us_data *us, unsigned int lba,
 	unsigned int pagelen;
 	unsigned char *bptr, *cptr, *xptr;
 	unsigned char ecc[3];
-	int i, result, isnew;
+	int i, result;
+
+	pagelen = (1 << info->pageshift) + (1 << CONTROL_SHIFT);
+
+	if (lba == info->wlba) {
+		/* this saves an erase and a program of the block */
+		us->stats.erases_saved++;
+		goto merge;
+	}
+
+	result = sddr09_flush(us);
+	if (result)
+		return result;
 
 	lbap = ((lba % 1000) << 1) | 0x1000;
-	if (parity[MSB_of(lbap) ^ LSB_of(lbap)])
+	if (sm_parity8(MSB_of(lbap) ^ LSB_of(lbap)))
 		lbap ^= 1;
-	pba = info->lba_to_pba[lba];
-	isnew = 0;
+	result = sddr09_ensure_map(us, lba / 1000);
+	if (result)
+		return result;
+	pba = info->lba_to_pba[lba / 1000][lba % 1000];
 
 	if (pba == UNDEF) {
 		pba = sddr09_find_unused_pba(info, lba);
@@ -884,9 +938,9 @@ sddr09_write_lba(struct us_data *us, unsigned int lba,
 			       "sddr09_write_lba: Out of unused blocks\n");
 			return -ENOSPC;
 		}
-		info->pba_to_lba[pba] = lba;
-		info->lba_to_pba[lba] = pba;
-		isnew = 1;
+		info->pba_to_lba[pba >> 10][pba & 0x3ff] = lba;
+		info->lba_to_pba[lba / 1000][lba % 1000] = pba;
+		usb_stor_freemap_take(&info->freemap, pba);
 	}
 
 	if (pba == 1) {
@@ -896,26 +950,24 @@ sddr09_write_lba(struct us_data *us, unsigned int lba,
 		return 0;
 	}
 
-	pagelen = (1 << info->pageshift) + (1 << CONTROL_SHIFT);
-
 	/* read old contents */
 	address = (pba << (info->pageshift + info->blockshift));
 	result = sddr09_read22(us, address>>1, info->blocksize,
-			       info->pageshift, blockbuffer, 0);
+			       info->pageshift, info->wbuf, 0);
 	if (result)
 		return result;
 
 	/* check old contents and fill lba */
 	for (i = 0; i < info->blocksize; i++) {
-		bptr = blockbuffer + i*pagelen;
+		bptr = info->wbuf + i*pagelen;
 		cptr = bptr + info->pagesize;
-		nand_compute_ecc(bptr, ecc);
+		usb_stor_sm_ecc(bptr, ecc);
 		if (!nand_compare_ecc(cptr+13, ecc)) {
 			usb_stor_dbg(us, "Warning: bad ecc in page %d- of pba %d\n",
 				     i, pba);
 			nand_store_ecc(cptr+13, ecc);
 		}
-		nand_compute_ecc(bptr+(info->pagesize / 2), ecc);
+		usb_stor_sm_ecc(bptr+(info->pagesize / 2), ecc);
 		if (!nand_compare_ecc(cptr+8, ecc)) {
 			usb_stor_dbg(us, "Warning: bad ecc in page %d+ of pba %d\n",
 				     i, pba);
@@ -924,45 +976,31 @@ sddr09_write_lba(struct us_data *us, unsigned int lba,
 		cptr[6] = cptr[11] = MSB_of(lbap);
 		cptr[7] = cptr[12] = LSB_of(lbap);
 	}
+	info->wlba = lba;
+	info->wpba = pba;
 
+ merge:
 	/* copy in new stuff and compute ECC */
 	xptr = ptr;
 	for (i = page; i < page+pages; i++) {
-		bptr = blockbuffer + i*pagelen;
+		bptr = info->wbuf + i*pagelen;
 		cptr = bptr + info->pagesize;
 		memcpy(bptr, xptr, info->pagesize);
 		xptr += info->pagesize;
-		nand_compute_ecc(bptr, ecc);
+		usb_stor_sm_ecc(bptr, ecc);
 		nand_store_ecc(cptr+13, ecc);
-		nand_compute_ecc(bptr+(info->pagesize / 2), ecc);
+		usb_stor_sm_ecc(bptr+(info->pagesize / 2), ecc);
 		nand_store_ecc(cptr+8, ecc);
 	}
 
-	usb_stor_dbg(us, "Rewrite PBA %d (LBA %d)\n", pba, lba);
-
-	result = sddr09_write_inplace(us, address>>1, info->blocksize,
-				      info->pageshift, blockbuffer, 0);
+	/* a sequential writer is done with the block */
+	if (page + pages == info->blocksize ||
+	    !(us->fflags & US_FL_WRITE_CACHE))
+		return sddr09_flush(us);
 
-	usb_stor_dbg(us, "sddr09_write_inplace returns %d\n", result);
-
-#if 0
-	{
-		unsigned char status = 0;
-		int result2 = sddr09_read_status(us, &status);
-		if (result2)
-			usb_stor_dbg(us, "cannot read status\n");
-		else if (status != 0xc0)
-			usb_stor_dbg(us, "status after write: 0x%x\n", status);
-	}
-#endif
-
-#if 0
-	{
-		int result2 = sddr09_test_unit_ready(us);
-	}
-#endif
-
-	return result;
+	info->flush_retries = 0;
+	sddr09_queue_flush(us, SDDR09_FLUSH_DELAY);
+	return 0;
 }
 
 static int
@@ -972,49 +1010,31 @@ sddr09_write_data(struct us_data *us,
 
 	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
 	unsigned int lba, maxlba, page, pages;
-	unsigned int pagelen, blocklen;
-	unsigned char *blockbuffer;
 	unsigned char *buffer;
-	unsigned int len, offset;
-	struct scatterlist *sg;
+	unsigned int len;
+	struct us_xfer_cursor cur;
 	int result;
 
 	// Figure out the initial LBA and page
 	lba = address >> info->blockshift;
 	page = (address & info->blockmask);
-	maxlba = info->capacity >> (info->pageshift + info->blockshift);
+	maxlba = info->lbact;
 	if (lba >= maxlba)
 		return -EIO;
 
-	// blockbuffer is used for reading in the old data, overwriting
-	// with the new data, and performing ECC calculations
-
-	/* TODO: instead of doing kmalloc/kfree for each write,
-	   add a bufferpointer to the info structure */
-
-	pagelen = (1 << info->pageshift) + (1 << CONTROL_SHIFT);
-	blocklen = (pagelen << info->blockshift);
-	blockbuffer = kmalloc(blocklen, GFP_NOIO);
-	if (!blockbuffer) {
-		printk(KERN_WARNING "sddr09_write_data: Out of memory\n");
-		return -ENOMEM;
-	}
-
 	// Since we don't write the user data directly to the device,
 	// we have to create a bounce buffer and move the data a piece
 	// at a time between the bounce buffer and the actual transfer buffer.
 
 	len = min(sectors, (unsigned int) info->blocksize) * info->pagesize;
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL) {
 		printk(KERN_WARNING "sddr09_write_data: Out of memory\n");
-		kfree(blockbuffer);
 		return -ENOMEM;
 	}
 
 	result = 0;
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, FROM_XFER_BUF);
 
 	while (sectors > 0) {
 
@@ -1032,11 +1052,9 @@ sddr09_write_data(struct us_data *us,
 		}
 
 		// Get the data from the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, FROM_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
-		result = sddr09_write_lba(us, lba, page, pages,
-				buffer, blockbuffer);
+		result = sddr09_write_lba(us, lba, page, pages, buffer);
 		if (result)
 			break;
 
@@ -1045,8 +1063,8 @@ sddr09_write_data(struct us_data *us,
 		sectors -= pages;
 	}
 
-	kfree(buffer);
-	kfree(blockbuffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 
 	return result;
 }
@@ -1199,78 +1217,55 @@ sddr09_get_cardinfo(struct us_data *us, unsigned char flags) {
 	return cardinfo;
 }
 
+/*
+ * Build the lba-pba translation tables for one zone from the control
+ * area of its blocks, which a single 64 KB read returns.
+ */
 static int
-sddr09_read_map(struct us_data *us) {
+sddr09_map_zone(struct us_data *us, int zone) {
 
 	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
-	int numblocks, alloc_len, alloc_blocks;
-	int i, j, result;
-	unsigned char *buffer, *buffer_end, *ptr;
-	unsigned int lba, lbact;
-
-	if (!info->capacity)
-		return -1;
-
-	// size of a block is 1 << (blockshift + pageshift) bytes
-	// divide into the total capacity to get the number of blocks
+	int numblocks, zonestart;
+	int i, j, ct, result;
+	unsigned char *buffer, *ptr;
+	unsigned long address;
+	unsigned int lba;
+	u16 *lba_to_pba, *pba_to_lba;
 
-	numblocks = info->capacity >> (info->blockshift + info->pageshift);
+	numblocks = sddr09_zone_blocks(info, zone);
+	zonestart = zone << 10;
 
 	// read 64 bytes for every block (actually 1 << CONTROL_SHIFT)
-	// but only use a 64 KB buffer
-	// buffer size used must be a multiple of (1 << CONTROL_SHIFT)
-#define SDDR09_READ_MAP_BUFSZ 65536
-
-	alloc_blocks = min(numblocks, SDDR09_READ_MAP_BUFSZ >> CONTROL_SHIFT);
-	alloc_len = (alloc_blocks << CONTROL_SHIFT);
-	buffer = kmalloc(alloc_len, GFP_NOIO);
-	if (buffer == NULL) {
-		printk(KERN_WARNING "sddr09_read_map: out of memory\n");
+	buffer = kmalloc(numblocks << CONTROL_SHIFT, GFP_NOIO);
+	lba_to_pba = kmalloc(1000 * sizeof(u16), GFP_NOIO);
+	pba_to_lba = kmalloc(numblocks * sizeof(u16), GFP_NOIO);
+	if (!buffer || !lba_to_pba || !pba_to_lba) {
+		printk(KERN_WARNING "sddr09_map_zone: out of memory\n");
 		result = -1;
 		goto done;
 	}
-	buffer_end = buffer + alloc_len;
 
-#undef SDDR09_READ_MAP_BUFSZ
+	memset(lba_to_pba, 0xff, 1000 * sizeof(u16));
+	memset(pba_to_lba, 0xff, numblocks * sizeof(u16));
 
-	kfree(info->lba_to_pba);
-	kfree(info->pba_to_lba);
-	info->lba_to_pba = kmalloc(numblocks*sizeof(int), GFP_NOIO);
-	info->pba_to_lba = kmalloc(numblocks*sizeof(int), GFP_NOIO);
+	usb_stor_dbg(us, "Mapping blocks for zone %d\n", zone);
 
-	if (info->lba_to_pba == NULL || info->pba_to_lba == NULL) {
-		printk(KERN_WARNING "sddr09_read_map: out of memory\n");
+	address = zonestart << (info->pageshift + info->blockshift);
+	result = sddr09_read_control(us, address>>1, numblocks, buffer, 0);
+	if (result) {
 		result = -1;
 		goto done;
 	}
 
-	for (i = 0; i < numblocks; i++)
-		info->lba_to_pba[i] = info->pba_to_lba[i] = UNDEF;
-
 	/*
 	 * Define lba-pba translation table
 	 */
 
-	ptr = buffer_end;
 	for (i = 0; i < numblocks; i++) {
-		ptr += (1 << CONTROL_SHIFT);
-		if (ptr >= buffer_end) {
-			unsigned long address;
-
-			address = i << (info->pageshift + info->blockshift);
-			result = sddr09_read_control(
-				us, address>>1,
-				min(alloc_blocks, numblocks - i),
-				buffer, 0);
-			if (result) {
-				result = -1;
-				goto done;
-			}
-			ptr = buffer;
-		}
+		ptr = buffer + (i << CONTROL_SHIFT);
 
-		if (i == 0 || i == 1) {
-			info->pba_to_lba[i] = UNUSABLE;
+		if (zonestart + i < 2) {
+			pba_to_lba[i] = UNUSABLE;
 			continue;
 		}
 
@@ -1278,9 +1273,9 @@ sddr09_read_map(struct us_data *us) {
 		for (j = 0; j < 16; j++)
 			if (ptr[j] != 0)
 				goto nonz;
-		info->pba_to_lba[i] = UNUSABLE;
+		pba_to_lba[i] = UNUSABLE;
 		printk(KERN_WARNING "sddr09: PBA %d has no logical mapping\n",
-		       i);
+		       zonestart + i);
 		continue;
 
 	nonz:
@@ -1297,9 +1292,9 @@ sddr09_read_map(struct us_data *us) {
 			       "sddr09: PBA %d has no logical mapping: "
 			       "reserved area = %02X%02X%02X%02X "
 			       "data status %02X block status %02X\n",
-			       i, ptr[0], ptr[1], ptr[2], ptr[3],
+			       zonestart + i, ptr[0], ptr[1], ptr[2], ptr[3],
 			       ptr[4], ptr[5]);
-			info->pba_to_lba[i] = UNUSABLE;
+			pba_to_lba[i] = UNUSABLE;
 			continue;
 		}
 
@@ -1307,17 +1302,17 @@ sddr09_read_map(struct us_data *us) {
 			printk(KERN_WARNING
 			       "sddr09: PBA %d has invalid address field "
 			       "%02X%02X/%02X%02X\n",
-			       i, ptr[6], ptr[7], ptr[11], ptr[12]);
-			info->pba_to_lba[i] = UNUSABLE;
+			       zonestart + i, ptr[6], ptr[7], ptr[11], ptr[12]);
+			pba_to_lba[i] = UNUSABLE;
 			continue;
 		}
 
 		/* check even parity */
-		if (parity[ptr[6] ^ ptr[7]]) {
+		if (sm_parity8(ptr[6] ^ ptr[7])) {
 			printk(KERN_WARNING
 			       "sddr09: Bad parity in LBA for block %d"
-			       " (%02X %02X)\n", i, ptr[6], ptr[7]);
-			info->pba_to_lba[i] = UNUSABLE;
+			       " (%02X %02X)\n", zonestart + i, ptr[6], ptr[7]);
+			pba_to_lba[i] = UNUSABLE;
 			continue;
 		}
 
@@ -1336,69 +1331,263 @@ sddr09_read_map(struct us_data *us) {
 		if (lba >= 1000) {
 			printk(KERN_WARNING
 			       "sddr09: Bad low LBA %d for block %d\n",
-			       lba, i);
+			       lba, zonestart + i);
 			goto possibly_erase;
 		}
 
-		lba += 1000*(i/0x400);
-
-		if (info->lba_to_pba[lba] != UNDEF) {
+		if (lba_to_pba[lba] != UNDEF) {
 			printk(KERN_WARNING
 			       "sddr09: LBA %d seen for PBA %d and %d\n",
-			       lba, info->lba_to_pba[lba], i);
+			       lba + 1000*zone, lba_to_pba[lba], zonestart + i);
 			goto possibly_erase;
 		}
 
-		info->pba_to_lba[i] = lba;
-		info->lba_to_pba[lba] = i;
+		pba_to_lba[i] = lba + 1000*zone;
+		lba_to_pba[lba] = zonestart + i;
 		continue;
 
 	possibly_erase:
 		if (erase_bad_lba_entries) {
-			unsigned long address;
-
-			address = (i << (info->pageshift + info->blockshift));
+			address = ((zonestart + i) <<
+				   (info->pageshift + info->blockshift));
 			sddr09_erase(us, address>>1);
-			info->pba_to_lba[i] = UNDEF;
+			pba_to_lba[i] = UNDEF;
 		} else
-			info->pba_to_lba[i] = UNUSABLE;
+			pba_to_lba[i] = UNUSABLE;
 	}
 
-	/*
-	 * Approximate capacity. This is not entirely correct yet,
-	 * since a zone with less than 1000 usable pages leads to
-	 * missing LBAs. Especially if it is the last zone, some
-	 * LBAs can be past capacity.
-	 */
-	lbact = 0;
-	for (i = 0; i < numblocks; i += 1024) {
-		int ct = 0;
-
-		for (j = 0; j < 1024 && i+j < numblocks; j++) {
-			if (info->pba_to_lba[i+j] != UNUSABLE) {
-				if (ct >= 1000)
-					info->pba_to_lba[i+j] = SPARE;
-				else
-					ct++;
-			}
+	/* Blocks beyond the 1000 a zone can map are held as spares */
+	ct = 0;
+	for (i = 0; i < numblocks; i++) {
+		if (pba_to_lba[i] != UNUSABLE) {
+			if (ct >= 1000)
+				pba_to_lba[i] = SPARE;
+			else
+				ct++;
 		}
-		lbact += ct;
 	}
-	info->lbact = lbact;
-	usb_stor_dbg(us, "Found %d LBA's\n", lbact);
+	usb_stor_dbg(us, "Zone %d has %d usable blocks\n", zone, ct);
+
+	/* unwritten blocks and the ones erased above are free */
+	for (i = 0; i < numblocks; i++)
+		if (pba_to_lba[i] == UNDEF)
+			usb_stor_freemap_put(&info->freemap, zonestart + i, 1);
+
+	info->lba_to_pba[zone] = lba_to_pba;
+	info->pba_to_lba[zone] = pba_to_lba;
+	lba_to_pba = pba_to_lba = NULL;
 	result = 0;
 
  done:
-	if (result != 0) {
-		kfree(info->lba_to_pba);
-		kfree(info->pba_to_lba);
-		info->lba_to_pba = NULL;
-		info->pba_to_lba = NULL;
-	}
+	kfree(lba_to_pba);
+	kfree(pba_to_lba);
 	kfree(buffer);
 	return result;
 }
 
+/*
+ * Zones are mapped the first time they are used
+ */
+static int
+sddr09_ensure_map(struct us_data *us, int zone) {
+	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
+
+	if (zone >= info->numzones)
+		return -EIO;
+	if (info->lba_to_pba[zone])
+		return 0;
+	return (sddr09_map_zone(us, zone) ? -EIO : 0);
+}
+
+static void
+sddr09_free_maps(struct sddr09_card_info *info) {
+	int i;
+
+	for (i = 0; i < info->numzones; i++) {
+		kfree(info->lba_to_pba[i]);
+		kfree(info->pba_to_lba[i]);
+	}
+	kfree(info->lba_to_pba);
+	kfree(info->pba_to_lba);
+	info->lba_to_pba = NULL;
+	info->pba_to_lba = NULL;
+	info->numzones = 0;
+	info->lbact = 0;
+	usb_stor_freemap_free(&info->freemap);
+	sddr09_drop_cache(info);
+	kfree(info->wbuf);
+	info->wbuf = NULL;
+}
+
+/*
+ * Forget the maps and set up empty ones for the card now in the reader.
+ * The write cache must have been written back or dropped already.  Reading the control area of every block up front took
+ * seconds on large cards; now a zone is mapped when it is first used
+ * and the others are filled in by sddr09_map_work() while the reader
+ * is idle.
+ */
+static int
+sddr09_init_maps(struct us_data *us) {
+
+	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
+	int numzones;
+
+	sddr09_free_maps(info);
+
+	if (!info->capacity)
+		return -1;
+
+	// size of a block is 1 << (blockshift + pageshift) bytes
+	// divide into the total capacity to get the number of blocks
+
+	info->numblocks = info->capacity >>
+		(info->blockshift + info->pageshift);
+	numzones = (info->numblocks + 1023) >> 10;
+
+	info->lba_to_pba = kcalloc(numzones, sizeof(u16 *), GFP_NOIO);
+	info->pba_to_lba = kcalloc(numzones, sizeof(u16 *), GFP_NOIO);
+	info->wbuf = kmalloc((info->pagesize + (1 << CONTROL_SHIFT)) <<
+			     info->blockshift, GFP_NOIO);
+	if (info->lba_to_pba == NULL || info->pba_to_lba == NULL ||
+	    info->wbuf == NULL ||
+	    usb_stor_freemap_alloc(&info->freemap, info->numblocks)) {
+		printk(KERN_WARNING "sddr09_init_maps: out of memory\n");
+		sddr09_free_maps(info);
+		return -1;
+	}
+	info->numzones = numzones;
+
+	/*
+	 * Report the 1000 LBA's per 1024 blocks the format provides for
+	 * (fewer on cards with a single short zone) without reading the
+	 * zones.  A zone with more than 24 bad blocks then runs out of
+	 * blocks on writes to its last LBA's instead of shrinking the
+	 * card.
+	 */
+	info->lbact = (info->numblocks >> 7) * 125;
+	usb_stor_dbg(us, "Reporting %d LBA's\n", info->lbact);
+
+	info->map_start = jiffies;
+	info->flags |= SDDR09_FRESH;
+	mod_delayed_work(us->cmnd_wq, &info->map_work, SDDR09_MAP_DELAY);
+	return 0;
+}
+
+/*
+ * Map the next zone that has not been used yet, as long as no command
+ * is waiting and the device is awake anyway.
+ */
+static void
+sddr09_map_work(struct work_struct *work) {
+	struct sddr09_card_info *info = container_of(work,
+			struct sddr09_card_info, map_work.work);
+	struct us_data *us = info->us;
+	int zone, more = 0;
+
+	usb_autopm_get_interface_no_resume(us->pusb_intf);
+	if (!pm_runtime_active(&us->pusb_intf->dev))
+		goto out;
+
+	mutex_lock(&us->dev_mutex);
+	if (test_bit(US_FLIDX_DISCONNECTING, &us->dflags))
+		goto unlock;
+
+	/* busy, try again later */
+	if (us->srb) {
+		more = 1;
+		goto unlock;
+	}
+
+	for (zone = 0; zone < info->numzones; zone++)
+		if (!info->lba_to_pba[zone])
+			break;
+	if (zone < info->numzones && sddr09_map_zone(us, zone) == 0) {
+		usb_mark_last_busy(us->pusb_dev);
+		more = 1;
+	}
+
+ unlock:
+	mutex_unlock(&us->dev_mutex);
+ out:
+	usb_autopm_put_interface_no_suspend(us->pusb_intf);
+	if (more)
+		queue_delayed_work(us->cmnd_wq, &info->map_work,
+				   SDDR09_MAP_DELAY);
+}
+
+/*
+ * Write the open block back once writes have stopped for a while.  If
+ * that fails it is tried again a few times, backing off; after that the
+ * block stays cached for the next SYNCHRONIZE CACHE or write.
+ */
+static void
+sddr09_flush_work(struct work_struct *work) {
+	struct sddr09_card_info *info = container_of(work,
+			struct sddr09_card_info, flush_work.work);
+	struct us_data *us = info->us;
+	unsigned long delay = SDDR09_FLUSH_DELAY;
+	int busy = 0;
+
+	if (usb_autopm_get_interface(us->pusb_intf))
+		return;
+
+	mutex_lock(&us->dev_mutex);
+	if (test_bit(US_FLIDX_DISCONNECTING, &us->dflags))
+		goto unlock;
+
+	/* the next command may well be another write to the block */
+	if (us->srb) {
+		busy = 1;
+		goto unlock;
+	}
+
+	if (sddr09_flush(us) &&
+	    info->flush_retries < SDDR09_FLUSH_RETRIES) {
+		info->flush_retries++;
+		delay <<= info->flush_retries;
+		usb_stor_dbg(us, "Idle write back of LBA %u failed, "
+			     "retry in %u ms\n",
+			     info->wlba, jiffies_to_msecs(delay));
+		busy = 1;
+	}
+
+ unlock:
+	mutex_unlock(&us->dev_mutex);
+	usb_autopm_put_interface(us->pusb_intf);
+	if (busy)
+		sddr09_queue_flush(us, delay);
+}
+
+/*
+ * A reset doesn't touch the cached block, but the command that led to
+ * it may have been its write back, which is tried once more now.  If
+ * the block has to be dropped, the next SYNCHRONIZE CACHE fails.
+ */
+static void
+sddr09_flush_after_reset(struct us_data *us) {
+	struct sddr09_card_info *info = (struct sddr09_card_info *) us->extra;
+
+	if (info && sddr09_flush(us)) {
+		sddr09_drop_cache(info);
+		info->flags |= SDDR09_LOST;
+	}
+}
+
+static int
+sddr09_transport_reset(struct us_data *us) {
+	int result = usb_stor_CB_reset(us);
+
+	sddr09_flush_after_reset(us);
+	return result;
+}
+
+/* called with dev_mutex still held by usb_stor_pre_reset() */
+static int
+sddr09_post_reset(struct usb_interface *iface) {
+	sddr09_flush_after_reset(usb_get_intfdata(iface));
+	return usb_stor_post_reset(iface);
+}
+
 static void
 sddr09_card_info_destructor(void *extra) {
 	struct sddr09_card_info *info = (struct sddr09_card_info *)extra;
@@ -1406,12 +1595,17 @@ sddr09_card_info_destructor(void *extra) {
 	if (!info)
 		return;
 
-	kfree(info->lba_to_pba);
-	kfree(info->pba_to_lba);
+	cancel_delayed_work_sync(&info->map_work);
+	cancel_delayed_work_sync(&info->flush_work);
+
+	/* on an unbind the reader is still there to take the block */
+	sddr09_flush(info->us);
+	sddr09_free_maps(info);
 }
 
 static int
 sddr09_common_init(struct us_data *us) {
+	struct sddr09_card_info *info;
 	int result;
 
 	/* set the configuration -- STALL is an acceptable response here */
@@ -1431,12 +1625,16 @@ sddr09_common_init(struct us_data *us) {
 		return -EINVAL;
 	}
 
-	us->extra = kzalloc(sizeof(struct sddr09_card_info), GFP_NOIO);
-	if (!us->extra)
+	info = kzalloc(sizeof(struct sddr09_card_info), GFP_NOIO);
+	if (!info)
 		return -ENOMEM;
+	info->us = us;
+	info->wlba = UNDEF;
+	INIT_DELAYED_WORK(&info->map_work, sddr09_map_work);
+	INIT_DELAYED_WORK(&info->flush_work, sddr09_flush_work);
+	us->extra = info;
 	us->extra_destructor = sddr09_card_info_destructor;
 
-	nand_init_ecc();
 	return 0;
 }
 
@@ -1591,13 +1789,29 @@ static int sddr09_transport(struct scsi_cmnd *srb, struct us_data *us)
 
 		cardinfo = sddr09_get_cardinfo(us, info->flags);
 		if (!cardinfo) {
-			/* probably no media */
+			/* probably no media, and the cached block with it */
+			sddr09_drop_cache(info);
 		init_error:
 			sensekey = 0x02;	/* not ready */
 			sensecode = 0x3a;	/* medium not present */
 			return USB_STOR_TRANSPORT_FAILED;
 		}
 
+		// sd reads the capacity again whenever it revalidates the
+		// disk; the cached block is written back first unless the
+		// card has been replaced by one of another size
+		if (info->wlba != UNDEF) {
+			if (info->capacity != (1 << cardinfo->chipshift) ||
+			    info->pageshift != cardinfo->pageshift ||
+			    info->blockshift != cardinfo->blockshift) {
+				sddr09_drop_cache(info);
+			} else if (sddr09_flush(us)) {
+				sensekey = 0x03;	/* medium error */
+				sensecode = 0x0c;	/* write error */
+				return USB_STOR_TRANSPORT_FAILED;
+			}
+		}
+
 		info->capacity = (1 << cardinfo->chipshift);
 		info->pageshift = cardinfo->pageshift;
 		info->pagesize = (1 << info->pageshift);
@@ -1605,8 +1819,13 @@ static int sddr09_transport(struct scsi_cmnd *srb, struct us_data *us)
 		info->blocksize = (1 << info->blockshift);
 		info->blockmask = info->blocksize - 1;
 
+		// keep a data buffer for the reads and writes; without
+		// it they allocate their own
+		usb_stor_pool_reserve(us, 0,
+				info->blocksize << info->pageshift);
+
 		// map initialization, must follow get_cardinfo()
-		if (sddr09_read_map(us)) {
+		if (sddr09_init_maps(us)) {
 			/* probably out of memory */
 			goto init_error;
 		}
@@ -1647,8 +1866,21 @@ static int sddr09_transport(struct scsi_cmnd *srb, struct us_data *us)
 		return USB_STOR_TRANSPORT_FAILED;
 	}
 
-	if (srb->cmnd[0] == ALLOW_MEDIUM_REMOVAL)
-		return USB_STOR_TRANSPORT_GOOD;
+	if (srb->cmnd[0] == SYNCHRONIZE_CACHE ||
+	    srb->cmnd[0] == ALLOW_MEDIUM_REMOVAL ||
+	    srb->cmnd[0] == START_STOP) {
+		if (sddr09_flush(us) ||
+		    (srb->cmnd[0] == SYNCHRONIZE_CACHE &&
+		     (info->flags & SDDR09_LOST))) {
+			if (srb->cmnd[0] == SYNCHRONIZE_CACHE)
+				info->flags &= ~SDDR09_LOST;
+			sensekey = 0x03;	/* medium error */
+			sensecode = 0x0c;	/* write error */
+			return USB_STOR_TRANSPORT_FAILED;
+		}
+		if (srb->cmnd[0] != START_STOP)
+			return USB_STOR_TRANSPORT_GOOD;
+	}
 
 	havefakesense = 0;
 
@@ -1663,6 +1895,12 @@ static int sddr09_transport(struct scsi_cmnd *srb, struct us_data *us)
 			     page, pages);
 
 		result = sddr09_read_data(us, page, pages);
+		if (result == 0 && (info->flags & SDDR09_FRESH)) {
+			info->flags &= ~SDDR09_FRESH;
+			usb_stor_dbg(us, "First read %u ms after card init\n",
+				     jiffies_to_msecs(jiffies -
+						      info->map_start));
+		}
 		return (result == 0 ? USB_STOR_TRANSPORT_GOOD :
 				USB_STOR_TRANSPORT_ERROR);
 	}
@@ -1758,13 +1996,19 @@ static int sddr09_probe(struct usb_interface *intf,
 	if (us->protocol == USB_PR_DPCM_USB) {
 		us->transport_name = "Control/Bulk-EUSB/SDDR09";
 		us->transport = dpcm_transport;
-		us->transport_reset = usb_stor_CB_reset;
+		us->transport_reset = sddr09_transport_reset;
 		us->max_lun = 1;
+
+		/* no US_FL_WRITE_CACHE: the CompactFlash LUN would reject
+		 * SYNCHRONIZE CACHE, so SmartMedia writes go through */
 	} else {
 		us->transport_name = "EUSB/SDDR09";
 		us->transport = sddr09_transport;
-		us->transport_reset = usb_stor_CB_reset;
+		us->transport_reset = sddr09_transport_reset;
 		us->max_lun = 0;
+
+		/* have sd send SYNCHRONIZE CACHE for the write cache */
+		us->fflags |= US_FL_WRITE_CACHE;
 	}
 
 	result = usb_stor_probe2(us);
@@ -1779,7 +2023,7 @@ static struct usb_driver sddr09_driver = {
 	.resume =	usb_stor_resume,
 	.reset_resume =	usb_stor_reset_resume,
 	.pre_reset =	usb_stor_pre_reset,
-	.post_reset =	usb_stor_post_reset,
+	.post_reset =	sddr09_post_reset,
 	.id_table =	sddr09_usb_ids,
 	.soft_unbind =	1,
 	.no_dynamic_id = 1,
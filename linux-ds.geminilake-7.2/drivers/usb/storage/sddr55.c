@@ -104,15 +104,16 @@ struct sddr55_card_info {
 	int		blockmask;	/* 2^blockshift - 1 */
 	int		read_only;	/* non zero if card is write protected */
 	int		force_read_only;	/* non zero if we find a map error*/
-	int		*lba_to_pba;	/* logical to physical map */
-	int		*pba_to_lba;	/* physical to logical map */
+	u16		*lba_to_pba;	/* logical to physical map */
+	u16		*pba_to_lba;	/* physical to logical map */
 	int		fatal_error;	/* set if we detect something nasty */
 	unsigned long 	last_access;	/* number of jiffies since we last talked to device */
+	unsigned long	map_start;	/* jiffies at READ_CAPACITY, 0 once read */
 	unsigned char   sense_data[18];
 };
 
 
-#define NOT_ALLOCATED		0xffffffff
+#define NOT_ALLOCATED		0xffff
 #define BAD_BLOCK		0xffff
 #define CIS_BLOCK		0x400
 #define UNUSED_BLOCK		0x3ff
@@ -165,6 +166,7 @@ static int sddr55_status(struct us_data *us)
 		kfree(info->pba_to_lba);
 		info->lba_to_pba = NULL;
 		info->pba_to_lba = NULL;
+		info->map_start = 0;
 
 		info->fatal_error = 0;
 		info->force_read_only = 0;
@@ -209,8 +211,8 @@ static int sddr55_read_data(struct us_data *us,
 	unsigned long address;
 
 	unsigned short pages;
-	unsigned int len, offset;
-	struct scatterlist *sg;
+	unsigned int len;
+	struct us_xfer_cursor cur;
 
 	// Since we only read in one block at a time, we have to create
 	// a bounce buffer and move the data a piece at a time between the
@@ -218,11 +220,10 @@ static int sddr55_read_data(struct us_data *us,
 
 	len = min((unsigned int) sectors, (unsigned int) info->blocksize >>
 			info->smallpageshift) * PAGESIZE;
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL)
 		return USB_STOR_TRANSPORT_ERROR; /* out of memory */
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, TO_XFER_BUF);
 
 	while (sectors>0) {
 
@@ -297,8 +298,7 @@ static int sddr55_read_data(struct us_data *us,
 		}
 
 		// Store the data in the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, TO_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
 		page = 0;
 		lba++;
@@ -308,7 +308,8 @@ static int sddr55_read_data(struct us_data *us,
 	result = USB_STOR_TRANSPORT_GOOD;
 
 leave:
-	kfree(buffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 
 	return result;
 }
@@ -330,8 +331,8 @@ static int sddr55_write_data(struct us_data *us,
 
 	unsigned short pages;
 	int i;
-	unsigned int len, offset;
-	struct scatterlist *sg;
+	unsigned int len;
+	struct us_xfer_cursor cur;
 
 	/* check if we are allowed to write */
 	if (info->read_only || info->force_read_only) {
@@ -345,11 +346,10 @@ static int sddr55_write_data(struct us_data *us,
 
 	len = min((unsigned int) sectors, (unsigned int) info->blocksize >>
 			info->smallpageshift) * PAGESIZE;
-	buffer = kmalloc(len, GFP_NOIO);
+	buffer = usb_stor_pool_get(us, len);
 	if (buffer == NULL)
 		return USB_STOR_TRANSPORT_ERROR;
-	offset = 0;
-	sg = NULL;
+	usb_stor_cursor_start(&cur, us->srb, FROM_XFER_BUF);
 
 	while (sectors > 0) {
 
@@ -366,8 +366,7 @@ static int sddr55_write_data(struct us_data *us,
 		len = pages << info->pageshift;
 
 		// Get the data from the transfer buffer
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-				&sg, &offset, FROM_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
 		usb_stor_dbg(us, "Write %02X pages, to PBA %04X (LBA %04X) page %02X\n",
 			     pages, pba, lba, page);
@@ -515,7 +514,8 @@ static int sddr55_write_data(struct us_data *us,
 	result = USB_STOR_TRANSPORT_GOOD;
 
  leave:
-	kfree(buffer);
+	usb_stor_cursor_stop(&cur);
+	usb_stor_pool_put(us, buffer);
 	return result;
 }
 
@@ -694,8 +694,8 @@ static int sddr55_read_map(struct us_data *us) {
 
 	kfree(info->lba_to_pba);
 	kfree(info->pba_to_lba);
-	info->lba_to_pba = kmalloc(numblocks*sizeof(int), GFP_NOIO);
-	info->pba_to_lba = kmalloc(numblocks*sizeof(int), GFP_NOIO);
+	info->lba_to_pba = kmalloc(numblocks*sizeof(u16), GFP_NOIO);
+	info->pba_to_lba = kmalloc(numblocks*sizeof(u16), GFP_NOIO);
 
 	if (info->lba_to_pba == NULL || info->pba_to_lba == NULL) {
 		kfree(info->lba_to_pba);
@@ -706,8 +706,8 @@ static int sddr55_read_map(struct us_data *us) {
 		return -1;
 	}
 
-	memset(info->lba_to_pba, 0xff, numblocks*sizeof(int));
-	memset(info->pba_to_lba, 0xff, numblocks*sizeof(int));
+	memset(info->lba_to_pba, 0xff, numblocks*sizeof(u16));
+	memset(info->pba_to_lba, 0xff, numblocks*sizeof(u16));
 
 	/* set maximum lba */
 	max_lba = info->max_log_blks;
@@ -762,6 +762,19 @@ static int sddr55_read_map(struct us_data *us) {
 	return 0;
 }
 
+/* The map is read when a card is first accessed, not at READ_CAPACITY */
+static int sddr55_ensure_map(struct us_data *us) {
+	struct sddr55_card_info *info = (struct sddr55_card_info *)(us->extra);
+
+	if (info->lba_to_pba)
+		return 0;
+	if (sddr55_read_map(us)) {
+		set_sense_info (3, 0x31, 0);	/* medium format corrupted */
+		return USB_STOR_TRANSPORT_FAILED;
+	}
+	return 0;
+}
+
 
 static void sddr55_card_info_destructor(void *extra) {
 	struct sddr55_card_info *info = (struct sddr55_card_info *)extra;
@@ -833,10 +846,12 @@ static int sddr55_transport(struct scsi_cmnd *srb, struct us_data *us)
 		return USB_STOR_TRANSPORT_GOOD;
 	}
 
-	/* only check card status if the map isn't allocated, ie no card seen yet
-	 * or if it's been over half a second since we last accessed it
+	/* only check card status if no card has been seen yet (no map and
+	 * none pending since READ_CAPACITY) or if it's been over half a
+	 * second since we last accessed it
 	 */
-	if (info->lba_to_pba == NULL || time_after(jiffies, info->last_access + HZ/2)) {
+	if ((info->lba_to_pba == NULL && !info->map_start) ||
+	    time_after(jiffies, info->last_access + HZ/2)) {
 
 		/* check to see if a card is fitted */
 		result = sddr55_status (us);
@@ -868,6 +883,10 @@ static int sddr55_transport(struct scsi_cmnd *srb, struct us_data *us)
 
 		info->capacity = capacity;
 
+		/* keep a block's worth of buffer for reads and writes */
+		usb_stor_pool_reserve(us, 0, (info->blocksize >>
+				info->smallpageshift) * PAGESIZE);
+
 		/* figure out the maximum logical block number, allowing for
 		 * the fact that only 250 out of every 256 are used */
 		info->max_log_blks = ((info->capacity >> (info->pageshift + info->blockshift)) / 256) * 250;
@@ -883,13 +902,25 @@ static int sddr55_transport(struct scsi_cmnd *srb, struct us_data *us)
 		((__be32 *) ptr)[1] = cpu_to_be32(PAGESIZE);
 		usb_stor_set_xfer_buf(ptr, 8, srb);
 
-		sddr55_read_map(us);
+		/* the card may have changed, read its map when it is used */
+		kfree(info->lba_to_pba);
+		kfree(info->pba_to_lba);
+		info->lba_to_pba = NULL;
+		info->pba_to_lba = NULL;
+		info->map_start = jiffies;
 
 		return USB_STOR_TRANSPORT_GOOD;
 	}
 
 	if (srb->cmnd[0] == MODE_SENSE_10) {
 
+		/* force_read_only is only known once the map has been read */
+		if (info->capacity) {
+			result = sddr55_ensure_map(us);
+			if (result)
+				return result;
+		}
+
 		memcpy(ptr, mode_page_01, sizeof mode_page_01);
 		ptr[3] = (info->read_only || info->force_read_only) ? 0x80 : 0;
 		usb_stor_set_xfer_buf(ptr, sizeof(mode_page_01), srb);
@@ -942,6 +973,10 @@ static int sddr55_transport(struct scsi_cmnd *srb, struct us_data *us)
 			return USB_STOR_TRANSPORT_FAILED;
 		}
 
+		result = sddr55_ensure_map(us);
+		if (result)
+			return result;
+
 		pba = info->lba_to_pba[lba];
 
 		if (srb->cmnd[0] == WRITE_10) {
@@ -949,12 +984,18 @@ static int sddr55_transport(struct scsi_cmnd *srb, struct us_data *us)
 				     pba, lba, page, pages);
 
 			return sddr55_write_data(us, lba, page, pages);
-		} else {
-			usb_stor_dbg(us, "READ_10: read block %04X (LBA %04X) page %01X pages %d\n",
-				     pba, lba, page, pages);
+		}
 
-			return sddr55_read_data(us, lba, page, pages);
+		usb_stor_dbg(us, "READ_10: read block %04X (LBA %04X) page %01X pages %d\n",
+			     pba, lba, page, pages);
+
+		result = sddr55_read_data(us, lba, page, pages);
+		if (result == USB_STOR_TRANSPORT_GOOD && info->map_start) {
+			usb_stor_dbg(us, "First read %u ms after card init\n",
+				     jiffies_to_msecs(jiffies - info->map_start));
+			info->map_start = 0;
 		}
+		return result;
 	}
 
 
@@ -57,6 +57,9 @@
 
 #define DRV_NAME "ums-usbat"
 
+/* Flash block transfers stay at the 64 KB they have always used */
+#define USBAT_MAX_SECTORS	128
+
 MODULE_DESCRIPTION("Driver for SCM Microsystems (a.k.a. Shuttle) USB-ATAPI cable");
 MODULE_AUTHOR("Daniel Drake <dsd@gentoo.org>, Robert Baruch <autophile@starband.net>");
 MODULE_LICENSE("GPL");
@@ -1129,12 +1132,10 @@ static int usbat_flash_read_data(struct us_data *us,
 		USBAT_ATA_STATUS,
 	};
 	unsigned char command[7];
-	unsigned char *buffer;
 	unsigned char  thistime;
-	unsigned int totallen, alloclen;
-	int len, result;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result;
+	struct us_sg_part part;
 
 	result = usbat_flash_check_media(us, info);
 	if (result != USB_STOR_TRANSPORT_GOOD)
@@ -1153,23 +1154,18 @@ static int usbat_flash_read_data(struct us_data *us,
 	totallen = sectors * info->ssize;
 
 	/*
-	 * Since we don't read more than 64 KB at a time, we have to create
-	 * a bounce buffer and move the data a piece at a time between the
-	 * bounce buffer and the actual transfer buffer.
+	 * The data goes straight into the transfer buffer, a command's
+	 * worth at a time, so that has to be big enough.
 	 */
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		/*
-		 * loop, never allocate or transfer more than 64k at once
-		 * (min(128k, 255*info->ssize) is the real limit)
-		 */
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
+	usb_stor_sg_part_start(&part, us->srb);
+
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				USBAT_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
  
 		/* ATA command 0x20 (READ SECTORS) */
 		usbat_pack_ata_sector_cmd(command, thistime, sector, 0x20);
@@ -1177,29 +1173,22 @@ static int usbat_flash_read_data(struct us_data *us,
 		/* Write/execute ATA read command */
 		result = usbat_multiple_write(us, registers, command, 7);
 		if (result != USB_STOR_TRANSPORT_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		/* Read the data we just requested */
-		result = usbat_read_blocks(us, buffer, len, 0);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usbat_read_blocks(us, part.sg, len, nents);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_TRANSPORT_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
   	 
 		usb_stor_dbg(us, "%d bytes\n", len);
-	
-		/* Store the data in the transfer buffer */
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-					 &sg, &sg_offset, TO_XFER_BUF);
 
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return USB_STOR_TRANSPORT_GOOD;
-
-leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 /*
@@ -1220,12 +1209,10 @@ static int usbat_flash_write_data(struct us_data *us,
 		USBAT_ATA_STATUS,
 	};
 	unsigned char command[7];
-	unsigned char *buffer;
 	unsigned char  thistime;
-	unsigned int totallen, alloclen;
-	int len, result;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	unsigned int totallen, len;
+	int nents, result;
+	struct us_sg_part part;
 
 	result = usbat_flash_check_media(us, info);
 	if (result != USB_STOR_TRANSPORT_GOOD)
@@ -1244,27 +1231,19 @@ static int usbat_flash_write_data(struct us_data *us,
 	totallen = sectors * info->ssize;
 
 	/*
-	 * Since we don't write more than 64 KB at a time, we have to create
-	 * a bounce buffer and move the data a piece at a time between the
-	 * bounce buffer and the actual transfer buffer.
+	 * The data comes straight from the transfer buffer, a command's
+	 * worth at a time, so that has to be big enough.
 	 */
-
-	alloclen = min(totallen, 65536u);
-	buffer = kmalloc(alloclen, GFP_NOIO);
-	if (buffer == NULL)
+	if (totallen > scsi_bufflen(us->srb))
 		return USB_STOR_TRANSPORT_ERROR;
 
-	do {
-		/*
-		 * loop, never allocate or transfer more than 64k at once
-		 * (min(128k, 255*info->ssize) is the real limit)
-		 */
-		len = min(totallen, alloclen);
-		thistime = (len / info->ssize) & 0xff;
+	usb_stor_sg_part_start(&part, us->srb);
+	result = USB_STOR_TRANSPORT_GOOD;
 
-		/* Get the data from the transfer buffer */
-		usb_stor_access_xfer_buf(buffer, len, us->srb,
-					 &sg, &sg_offset, FROM_XFER_BUF);
+	while (totallen > 0) {
+		len = min_t(unsigned int, totallen,
+				USBAT_MAX_SECTORS * info->ssize);
+		thistime = len / info->ssize;
 
 		/* ATA command 0x30 (WRITE SECTORS) */
 		usbat_pack_ata_sector_cmd(command, thistime, sector, 0x30);
@@ -1272,23 +1251,20 @@ static int usbat_flash_write_data(struct us_data *us,
 		/* Write/execute ATA write command */
 		result = usbat_multiple_write(us, registers, command, 7);
 		if (result != USB_STOR_TRANSPORT_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		/* Write the data */
-		result = usbat_write_blocks(us, buffer, len, 0);
+		nents = usb_stor_sg_part_next(&part, len);
+		result = usbat_write_blocks(us, part.sg, len, nents);
+		usb_stor_sg_part_done(&part);
 		if (result != USB_STOR_TRANSPORT_GOOD)
-			goto leave;
+			return USB_STOR_TRANSPORT_ERROR;
 
 		sector += thistime;
 		totallen -= len;
-	} while (totallen > 0);
+	}
 
-	kfree(buffer);
 	return result;
-
-leave:
-	kfree(buffer);
-	return USB_STOR_TRANSPORT_ERROR;
 }
 
 /*
@@ -1304,8 +1280,7 @@ static int usbat_hp8200e_handle_read10(struct us_data *us,
 	unsigned char *buffer;
 	unsigned int len;
 	unsigned int sector;
-	unsigned int sg_offset = 0;
-	struct scatterlist *sg = NULL;
+	struct us_xfer_cursor cur;
 
 	usb_stor_dbg(us, "transfersize %d\n", srb->transfersize);
 
@@ -1361,6 +1336,8 @@ static int usbat_hp8200e_handle_read10(struct us_data *us,
 	sector |= short_pack(data[7+5], data[7+4]);
 	transferred = 0;
 
+	usb_stor_cursor_start(&cur, srb, TO_XFER_BUF);
+
 	while (transferred != scsi_bufflen(srb)) {
 
 		if (len > scsi_bufflen(srb) - transferred)
@@ -1392,8 +1369,7 @@ static int usbat_hp8200e_handle_read10(struct us_data *us,
 			break;
 
 		/* Store the data in the transfer buffer */
-		usb_stor_access_xfer_buf(buffer, len, srb,
-				 &sg, &sg_offset, TO_XFER_BUF);
+		usb_stor_cursor_copy(&cur, buffer, len);
 
 		/* Update the amount transferred and the sector number */
 
@@ -1402,6 +1378,7 @@ static int usbat_hp8200e_handle_read10(struct us_data *us,
 
 	} /* while transferred != scsi_bufflen(srb) */
 
+	usb_stor_cursor_stop(&cur);
 	kfree(buffer);
 	return result;
 }
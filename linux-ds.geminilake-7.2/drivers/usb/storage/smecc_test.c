@@ -0,0 +1,207 @@
+/* Driver for USB Mass Storage compliant devices
+ * SmartMedia ECC Self-Test
+ *
+ * Checks usb_stor_sm_ecc() against the byte-at-a-time nand_compute_ecc()
+ * that sddr09 and alauda used before, and reports how fast both are.
+ * The blocks checked are all-zero and all-ones blocks with every single
+ * bit flipped in turn, followed by random blocks at every alignment
+ * within a 64-bit word.  Loading the module runs the test; it fails to
+ * load with -EINVAL if any ECC differs.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "smecc.h"
+
+#define SM_TEST_BUFSIZE	(64 * 1024)
+
+static unsigned int random_blocks = 100000;
+module_param(random_blocks, uint, S_IRUGO);
+MODULE_PARM_DESC(random_blocks, "number of random blocks to compare");
+
+static unsigned int bench_rounds = 64;
+module_param(bench_rounds, uint, S_IRUGO);
+MODULE_PARM_DESC(bench_rounds, "times the 64 KB benchmark buffer is "
+		 "processed by each implementation");
+
+/*
+ * The reference implementation, as it was in sddr09.c.
+ */
+static unsigned char parity[256];
+static unsigned char ecc2[256];
+
+static void nand_init_ecc(void) {
+	int i, j, a;
+
+	parity[0] = 0;
+	for (i = 1; i < 256; i++)
+		parity[i] = (parity[i&(i-1)] ^ 1);
+
+	for (i = 0; i < 256; i++) {
+		a = 0;
+		for (j = 0; j < 8; j++) {
+			if (i & (1<<j)) {
+				if ((j & 1) == 0)
+					a ^= 0x04;
+				if ((j & 2) == 0)
+					a ^= 0x10;
+				if ((j & 4) == 0)
+					a ^= 0x40;
+			}
+		}
+		ecc2[i] = ~(a ^ (a<<1) ^ (parity[i] ? 0xa8 : 0));
+	}
+}
+
+/* compute 3-byte ecc on 256 bytes */
+static void nand_compute_ecc(unsigned char *data, unsigned char *ecc) {
+	int i, j, a;
+	unsigned char par = 0, bit, bits[8] = {0};
+
+	/* collect 16 checksum bits */
+	for (i = 0; i < 256; i++) {
+		par ^= data[i];
+		bit = parity[data[i]];
+		for (j = 0; j < 8; j++)
+			if ((i & (1<<j)) == 0)
+				bits[j] ^= bit;
+	}
+
+	/* put 4+4+4 = 12 bits in the ecc */
+	a = (bits[3] << 6) + (bits[2] << 4) + (bits[1] << 2) + bits[0];
+	ecc[0] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
+
+	a = (bits[7] << 6) + (bits[6] << 4) + (bits[5] << 2) + bits[4];
+	ecc[1] = ~(a ^ (a<<1) ^ (parity[par] ? 0xaa : 0));
+
+	ecc[2] = ecc2[par];
+}
+
+/* Returns 1 if both implementations agree on the block at data */
+static int sm_test_block(unsigned char *data)
+{
+	unsigned char old[3], new[3];
+
+	nand_compute_ecc(data, old);
+	usb_stor_sm_ecc(data, new);
+	if (!memcmp(old, new, sizeof(old)))
+		return 1;
+
+	pr_err("ECC %02x%02x%02x instead of %02x%02x%02x for %*ph\n",
+	       new[0], new[1], new[2], old[0], old[1], old[2],
+	       32, data);
+	return 0;
+}
+
+static unsigned int sm_test_patterns(unsigned char *buf)
+{
+	unsigned int bad = 0, fill, i;
+
+	for (fill = 0; fill < 2; fill++) {
+		memset(buf, fill ? 0xff : 0, SM_ECC_BLOCK);
+		bad += !sm_test_block(buf);
+		for (i = 0; i < SM_ECC_BLOCK * 8; i++) {
+			buf[i / 8] ^= 1 << (i % 8);
+			bad += !sm_test_block(buf);
+			buf[i / 8] ^= 1 << (i % 8);
+		}
+	}
+	return bad;
+}
+
+static unsigned int sm_test_random(unsigned char *buf)
+{
+	unsigned int bad = 0, i;
+
+	for (i = 0; i < random_blocks; i++) {
+		if (i % (SM_TEST_BUFSIZE / SM_ECC_BLOCK) == 0)
+			prandom_bytes(buf, SM_TEST_BUFSIZE);
+		bad += !sm_test_block(buf + (i % 8) +
+				(i % (SM_TEST_BUFSIZE / SM_ECC_BLOCK - 1)) *
+				SM_ECC_BLOCK);
+		if (bad > 10)
+			break;
+	}
+	return bad;
+}
+
+/* MB/s for the benchmark buffer, which holds random data */
+static unsigned int sm_test_speed(unsigned char *buf, int new)
+{
+	unsigned char ecc[3];
+	unsigned int round, i;
+	ktime_t start;
+	s64 us;
+
+	start = ktime_get();
+	for (round = 0; round < bench_rounds; round++) {
+		for (i = 0; i < SM_TEST_BUFSIZE; i += SM_ECC_BLOCK) {
+			if (new)
+				usb_stor_sm_ecc(buf + i, ecc);
+			else
+				nand_compute_ecc(buf + i, ecc);
+		}
+		cond_resched();
+	}
+	us = ktime_us_delta(ktime_get(), start);
+
+	return div64_s64((s64) bench_rounds * SM_TEST_BUFSIZE, max_t(s64, us, 1));
+}
+
+static int __init sm_test_init(void)
+{
+	unsigned char *buf;
+	unsigned int bad;
+
+	buf = kmalloc(SM_TEST_BUFSIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	nand_init_ecc();
+	bad = sm_test_patterns(buf);
+	if (!bad)
+		bad = sm_test_random(buf);
+	if (bad) {
+		pr_err("usb_stor_sm_ecc differs from nand_compute_ecc\n");
+		kfree(buf);
+		return -EINVAL;
+	}
+	pr_info("%u pattern and %u random blocks identical\n",
+		2 * (1 + SM_ECC_BLOCK * 8), random_blocks);
+
+	if (bench_rounds) {
+		prandom_bytes(buf, SM_TEST_BUFSIZE);
+		pr_info("nand_compute_ecc %u MB/s, usb_stor_sm_ecc %u MB/s\n",
+			sm_test_speed(buf, 0), sm_test_speed(buf, 1));
+	}
+
+	kfree(buf);
+	return 0;
+}
+
+static void __exit sm_test_exit(void)
+{
+}
+
+module_init(sm_test_init);
+module_exit(sm_test_exit);
+
+MODULE_DESCRIPTION("Self-test for the SmartMedia ECC of USB storage");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,66 @@
+/* Driver for USB Mass Storage compliant devices
+ * Transport Statistics Header File
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <linux/ktime.h>
+#include <linux/types.h>
+
+/* Stages of a command that are timed separately */
+enum {
+	US_PHASE_CBW,		/* Bulk-only command block wrapper      */
+	US_PHASE_DATA,		/* Bulk-only data stage                  */
+	US_PHASE_CSW,		/* Bulk-only command status wrapper      */
+	US_PHASE_CSW_RETRY,	/* CSW read again after 0-length / STALL */
+	US_PHASE_PIPELINE,	/* CBW, data and CSW submitted together  */
+	US_PHASE_SENSE,		/* auto-sense REQUEST SENSE round trip   */
+	US_PHASE_CLEAR_HALT,	/* CLEAR_FEATURE(ENDPOINT_HALT)          */
+	US_PHASES
+};
+
+/*
+ * Latency histogram: bucket 0 counts stages that took less than 1 us,
+ * bucket n those that took [2^(n-1), 2^n) us and the last bucket
+ * everything from about 4 seconds up.
+ */
+#define US_STATS_BUCKETS	24
+
+struct us_phase_stats {
+	unsigned long		count;
+	unsigned long		errors;
+	u64			total_us;
+	u32			max_us;
+	u32			hist[US_STATS_BUCKETS];
+};
+
+struct us_stats {
+	struct us_phase_stats	phase[US_PHASES];
+
+	/* events */
+	unsigned long		auto_sense;	/* REQUEST SENSE issued       */
+	unsigned long		residue_fixups;	/* CSW residue applied        */
+	unsigned long		last_sector;	/* last-sector error faked    */
+	unsigned long		phase_errors;	/* CSW reported phase error   */
+	unsigned long		resets;		/* error recovery resets      */
+	unsigned long		buffer_allocs;	/* bounce buffers not pooled  */
+	unsigned long		erases_saved;	/* block rewrites absorbed    */
+};
+
+extern void usb_stor_stats_phase(struct us_stats *stats, int phase,
+		ktime_t start, int error);
+extern void usb_stor_stats_clear(struct us_stats *stats);
+extern ssize_t usb_stor_stats_show(struct us_stats *stats, char *buf);
+
+#endif
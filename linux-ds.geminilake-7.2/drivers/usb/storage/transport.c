@@ -50,6 +50,7 @@
 #include <linux/gfp.h>
 #include <linux/errno.h>
 #include <linux/export.h>
+#include <linux/moduleparam.h>
 
 #include <linux/usb/quirks.h>
 
@@ -246,6 +247,7 @@ int usb_stor_clear_halt(struct us_data *us, unsigned int pipe)
 {
 	int result;
 	int endp = usb_pipeendpoint(pipe);
+	ktime_t start = ktime_get();
 
 	if (usb_pipein (pipe))
 		endp |= USB_DIR_IN;
@@ -254,6 +256,8 @@ int usb_stor_clear_halt(struct us_data *us, unsigned int pipe)
 		USB_REQ_CLEAR_FEATURE, USB_RECIP_ENDPOINT,
 		USB_ENDPOINT_HALT, endp,
 		NULL, 0, 3*HZ);
+	usb_stor_stats_phase(&us->stats, US_PHASE_CLEAR_HALT, start,
+			result < 0);
 
 	if (result >= 0)
 		usb_reset_endpoint(us->pusb_dev, endp);
@@ -418,11 +422,41 @@ int usb_stor_bulk_transfer_buf(struct us_data *us, unsigned int pipe,
 }
 EXPORT_SYMBOL_GPL(usb_stor_bulk_transfer_buf);
 
+/*
+ * Can the host controller take this scatter-gather list in a single URB?
+ * Without no_sg_constraint every entry but the last must be a multiple of
+ * the endpoint's maxpacket, or usb_submit_urb() refuses it.
+ */
+static int usb_stor_sg_one_urb(struct us_data *us, unsigned int pipe,
+		struct scatterlist *sg, int num_sg)
+{
+	struct usb_bus *bus = us->pusb_dev->bus;
+	struct scatterlist *s;
+	unsigned int maxp;
+	int i;
+
+	if (num_sg > bus->sg_tablesize)
+		return 0;
+	if (bus->no_sg_constraint)
+		return 1;
+
+	maxp = usb_maxpacket(us->pusb_dev, pipe, usb_pipeout(pipe));
+	if (!maxp)
+		return 0;
+	for_each_sg(sg, s, num_sg - 1, i) {
+		if (s->length % maxp)
+			return 0;
+	}
+	return 1;
+}
+
 /*
  * Transfer a scatter-gather list via bulk transfer
  *
  * This function does basically the same thing as usb_stor_bulk_transfer_buf()
- * above, but it uses the usbcore scatter-gather library.
+ * above.  When the host controller handles scatter-gather lists itself
+ * the whole list goes out in current_urb; otherwise it uses the usbcore
+ * scatter-gather library, which allocates URBs for every transfer.
  */
 static int usb_stor_bulk_transfer_sglist(struct us_data *us, unsigned int pipe,
 		struct scatterlist *sg, int num_sg, unsigned int length,
@@ -430,6 +464,31 @@ static int usb_stor_bulk_transfer_sglist(struct us_data *us, unsigned int pipe,
 {
 	int result;
 
+	if (usb_stor_sg_one_urb(us, pipe, sg, num_sg)) {
+		usb_stor_dbg(us, "xfer %u bytes, %d entries in one URB\n",
+			     length, num_sg);
+
+		/* fill and submit the URB */
+		usb_fill_bulk_urb(us->current_urb, us->pusb_dev, pipe, NULL,
+				length, usb_stor_blocking_completion, NULL);
+		us->current_urb->sg = sg;
+		us->current_urb->num_sgs = num_sg;
+		result = usb_stor_msg_common(us, 0);
+
+		/* the other users of current_urb don't expect a list */
+		us->current_urb->sg = NULL;
+		us->current_urb->num_sgs = 0;
+
+		us->sg_single++;
+		us->sg_urbs++;
+		us->sg_bytes += us->current_urb->actual_length;
+
+		if (act_len)
+			*act_len = us->current_urb->actual_length;
+		return interpret_urb_result(us, pipe, length, result,
+				us->current_urb->actual_length);
+	}
+
 	/* don't submit s-g requests during abort processing */
 	if (test_bit(US_FLIDX_ABORTING, &us->dflags))
 		return USB_STOR_XFER_ERROR;
@@ -461,6 +520,10 @@ static int usb_stor_bulk_transfer_sglist(struct us_data *us, unsigned int pipe,
 	usb_sg_wait(&us->current_sg);
 	clear_bit(US_FLIDX_SG_ACTIVE, &us->dflags);
 
+	us->sg_split++;
+	us->sg_urbs += us->current_sg.entries;
+	us->sg_bytes += us->current_sg.bytes;
+
 	result = us->current_sg.status;
 	if (act_len)
 		*act_len = us->current_sg.bytes;
@@ -585,6 +648,7 @@ static void last_sector_hacks(struct us_data *us, struct scsi_cmnd *srb)
 		 */
 		if (++us->last_sector_retries < 3)
 			return;
+		us->stats.last_sector++;
 		srb->result = SAM_STAT_CHECK_CONDITION;
 		memcpy(srb->sense_buffer, record_not_found,
 				sizeof(record_not_found));
@@ -599,6 +663,47 @@ static void last_sector_hacks(struct us_data *us, struct scsi_cmnd *srb)
 		us->last_sector_retries = 0;
 }
 
+/*
+ * Delay calibration
+ *
+ * Some bridges only work reliably with a pause between the Bulk-only
+ * stages, and how long it has to be differs from one unit to the next.
+ * Once calibration is started through sysfs, every transport error
+ * doubles the device's phase_delay, starting from
+ * US_PHASE_DELAY_CALIBRATE_MIN, and a run of US_PHASE_DELAY_SETTLE
+ * commands without one ends the calibration with the value reached.
+ */
+#define US_PHASE_DELAY_CALIBRATE_MIN	8
+#define US_PHASE_DELAY_SETTLE		1000
+
+static void usb_stor_calibrate_delay(struct us_data *us, int result)
+{
+	if (likely(!us->delay_calibrating))
+		return;
+
+	if (result != USB_STOR_TRANSPORT_ERROR) {
+		if (++us->delay_clean < US_PHASE_DELAY_SETTLE)
+			return;
+		us->delay_calibrating = 0;
+		dev_info(&us->pusb_intf->dev,
+			 "phase delay calibrated to %u us\n", us->phase_delay);
+		return;
+	}
+
+	us->delay_clean = 0;
+	if (us->phase_delay >= US_PHASE_DELAY_MAX) {
+		us->delay_calibrating = 0;
+		dev_warn(&us->pusb_intf->dev,
+			 "still failing with a %u us phase delay\n",
+			 us->phase_delay);
+		return;
+	}
+	us->phase_delay = us->phase_delay ?
+			min(us->phase_delay * 2, US_PHASE_DELAY_MAX) :
+			US_PHASE_DELAY_CALIBRATE_MIN;
+	usb_stor_dbg(us, "-- phase delay raised to %u us\n", us->phase_delay);
+}
+
 /* Invoke the transport and basic error-handling/recovery methods
  *
  * This is used by the protocol layers to actually send the message to
@@ -609,19 +714,12 @@ void usb_stor_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
 	int need_auto_sense;
 	int result;
 
-#ifdef MY_ABC_HERE
-	if (unlikely((us->pusb_dev->syno_quirks &
-					SYNO_USB_QUIRK_SYNCHRONIZE_CACHE_FILTER) &&
-				 SYNCHRONIZE_CACHE == srb->cmnd[0])) {
-		srb->result = SAM_STAT_GOOD;
-		msleep(3000);
-		return;
-	}
-#endif /* MY_ABC_HERE */
-
 	/* send the command to the transport layer */
 	scsi_set_resid(srb, 0);
 	result = us->transport(srb, us);
+	usb_stor_check_max_sectors(us, srb,
+			result == USB_STOR_TRANSPORT_ERROR ||
+			test_bit(US_FLIDX_TIMED_OUT, &us->dflags));
 
 	/* if the command gets aborted by the higher layers, we need to
 	 * short-circuit all other processing
@@ -632,6 +730,8 @@ void usb_stor_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
 		goto Handle_Errors;
 	}
 
+	usb_stor_calibrate_delay(us, result);
+
 	/* if there is a transport error, reset and don't auto-sense */
 	if (result == USB_STOR_TRANSPORT_ERROR) {
 		usb_stor_dbg(us, "-- transport indicates error, resetting\n");
@@ -708,6 +808,7 @@ void usb_stor_invoke_transport(struct scsi_cmnd *srb, struct us_data *us)
 	/* Now, if we need to do the auto-sense, let's do it */
 	if (need_auto_sense) {
 		int temp_result;
+		ktime_t sense_start;
 		struct scsi_eh_save ses;
 		int sense_size = US_SENSE_SIZE;
 		struct scsi_sense_hdr sshdr;
@@ -731,7 +832,11 @@ Retry_Sense:
 
 		/* issue the auto-sense command */
 		scsi_set_resid(srb, 0);
+		us->stats.auto_sense++;
+		sense_start = ktime_get();
 		temp_result = us->transport(us->srb, us);
+		usb_stor_stats_phase(&us->stats, US_PHASE_SENSE, sense_start,
+				temp_result != USB_STOR_TRANSPORT_GOOD);
 
 		/* let's clean up right away */
 		scsi_eh_restore_cmnd(srb, &ses);
@@ -899,6 +1004,7 @@ Retry_Sense:
 
 	/* Set the RESETTING bit, and clear the ABORTING bit so that
 	 * the reset may proceed. */
+	us->stats.resets++;
 	scsi_lock(us_to_host(us));
 	set_bit(US_FLIDX_RESETTING, &us->dflags);
 	clear_bit(US_FLIDX_ABORTING, &us->dflags);
@@ -920,6 +1026,18 @@ Retry_Sense:
 	last_sector_hacks(us, srb);
 }
 
+/*
+ * Asynchronously unlink whatever is still queued; may be called in atomic
+ * context.  usb_unlink_anchored_urbs() would also unanchor the URBs, and
+ * usb_stor_Bulk_pipeline() relies on the anchor to wait for them.
+ */
+static void usb_stor_Bulk_pipeline_cancel(struct us_data *us)
+{
+	usb_unlink_urb(us->cbw_urb);
+	usb_unlink_urb(us->data_urb);
+	usb_unlink_urb(us->csw_urb);
+}
+
 /* Stop the current URB transfer */
 void usb_stor_stop_transport(struct us_data *us)
 {
@@ -937,6 +1055,12 @@ void usb_stor_stop_transport(struct us_data *us)
 		usb_stor_dbg(us, "-- cancelling sg request\n");
 		usb_sg_cancel(&us->current_sg);
 	}
+
+	/* Likewise for a pipelined Bulk-only command */
+	if (test_and_clear_bit(US_FLIDX_BOT_ACTIVE, &us->dflags)) {
+		usb_stor_dbg(us, "-- cancelling pipelined URBs\n");
+		usb_stor_Bulk_pipeline_cancel(us);
+	}
 }
 
 /*
@@ -1097,6 +1221,73 @@ int usb_stor_Bulk_max_lun(struct us_data *us)
 	return 0;
 }
 
+/*
+ * Send TEST UNIT READY to LUN 0 outside of the SCSI layer, giving each
+ * stage at most timeout jiffies.  Used to find out when a new device is
+ * ready for the scan; the caller must hold dev_mutex.  The CDB is padded
+ * to 12 bytes for the subclasses that only take ATAPI-sized commands.
+ *
+ * Returns 0 if the device answered with a passed or failed CSW, -EAGAIN
+ * if it didn't take the command yet, -EPROTO if it reported a phase
+ * error, which calls for reset recovery, and -EIO if it took the command
+ * but gave no valid status.
+ */
+int usb_stor_Bulk_ping(struct us_data *us, int timeout)
+{
+	struct bulk_cb_wrap *bcb = (struct bulk_cb_wrap *) us->iobuf;
+	struct bulk_cs_wrap *bcs = (struct bulk_cs_wrap *) us->iobuf;
+	unsigned int cbwlen = US_BULK_CB_WRAP_LEN;
+	int result;
+
+	/* Take care of BULK32 devices; set extra byte to 0 */
+	if (unlikely(us->fflags & US_FL_BULK32)) {
+		cbwlen = 32;
+		us->iobuf[31] = 0;
+	}
+
+	/* set up the command wrapper; the zeroed CDB is TEST UNIT READY */
+	bcb->Signature = cpu_to_le32(US_BULK_CB_SIGN);
+	bcb->DataTransferLength = 0;
+	bcb->Flags = 0;
+	bcb->Tag = ++us->tag;
+	bcb->Lun = 0;
+	switch (us->subclass) {
+	case USB_SC_8020:
+	case USB_SC_QIC:
+	case USB_SC_8070:
+	case USB_SC_UFI:
+		bcb->Length = 12;
+		break;
+	default:
+		bcb->Length = 6;
+		break;
+	}
+	memset(bcb->CDB, 0, sizeof(bcb->CDB));
+
+	usb_fill_bulk_urb(us->current_urb, us->pusb_dev, us->send_bulk_pipe,
+			bcb, cbwlen, usb_stor_blocking_completion, NULL);
+	result = usb_stor_msg_common(us, timeout);
+	usb_stor_dbg(us, "TEST UNIT READY command result %d\n", result);
+	if (result == -EPIPE)
+		usb_stor_clear_halt(us, us->send_bulk_pipe);
+	if (result || us->current_urb->actual_length != cbwlen)
+		return -EAGAIN;
+
+	usb_fill_bulk_urb(us->current_urb, us->pusb_dev, us->recv_bulk_pipe,
+			bcs, US_BULK_CS_WRAP_LEN, usb_stor_blocking_completion,
+			NULL);
+	result = usb_stor_msg_common(us, timeout);
+	usb_stor_dbg(us, "TEST UNIT READY status result %d\n", result);
+	if (result || us->current_urb->actual_length != US_BULK_CS_WRAP_LEN)
+		return -EIO;
+	if (!(bcs->Tag == us->tag || (us->fflags & US_FL_BULK_IGNORE_TAG)) ||
+			bcs->Status > US_BULK_STAT_PHASE)
+		return -EIO;
+	if (bcs->Status == US_BULK_STAT_PHASE)
+		return -EPROTO;
+	return 0;
+}
+
 #ifdef MY_ABC_HERE
 int extra_delay = 0;
 module_param(extra_delay, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -1105,21 +1296,272 @@ module_param(extra_delay_time, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 
 static inline void usb_stor_delay(struct us_data *us)
 {
-	/* 0 : no delay
+	unsigned int delay = us->phase_delay;
+
+	/* A device's own delay (delays= or sysfs) wins over the global one.
+	 * For extra_delay:
+	 * 0 : no delay
 	 * 1 : for customized
 	 * others : for original delay mechanism (just for Jmicron, Samsung, Lacie,
 	 * Freecom, Iomega, SimpleTech, Icybox)
 	 */
-	if (likely(extra_delay == 0))
+	if (!delay && 1 == extra_delay && 0 < extra_delay_time)
+		delay = extra_delay_time;
+	if (likely(!delay))
 		return;
 
-	if (1 == extra_delay && 0 < extra_delay_time) {
-		udelay(extra_delay_time);
-		return;
-	}
+	/* Sleep on an hrtimer rather than spin; no slack, it is meant to
+	 * be exact */
+	usleep_range(delay, delay);
 }
 #endif /* MY_ABC_HERE */
 
+/*
+ * Bulk-only pipelining
+ *
+ * Done one stage at a time, every Bulk-only command costs three URB
+ * round trips through the command work: the CBW, the data and the CSW.
+ * Nothing in the protocol needs that, since the endpoints queue the
+ * transfers in order anyway, so when nothing calls for delays between
+ * the stages we submit all three URBs back to back.  Only the CSW URB
+ * asks for an interrupt, and we are only woken for it, for an error,
+ * or for a 13-byte read that may be a CSW sent in place of the data.
+ * Halts are still cleared here in process context, and anything that
+ * needs a second look at the CSW is finished by the synchronous code in
+ * usb_stor_Bulk_transport().
+ */
+static bool bulk_pipeline = 1;
+module_param(bulk_pipeline, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bulk_pipeline, "queue the CBW, data and CSW of Bulk-only "
+		 "commands at once");
+
+/* The CSW is read behind the (up to 32-byte) CBW in us->iobuf */
+#define US_BULK_CS_OFFSET	32
+
+/* How long to wait for a command without a block layer timeout */
+#define US_BOT_TIMEOUT		(30 * HZ)
+
+/* usb_stor_Bulk_pipeline() return values */
+#define US_BOT_ERROR		0	/* transport error                */
+#define US_BOT_CSW		1	/* CSW read, result and length set */
+#define US_BOT_NEED_CSW		2	/* data stage done, read the CSW  */
+#define US_BOT_SKIPPED		3	/* CSW came in the data stage     */
+
+static void usb_stor_Bulk_pipeline_completion(struct urb *urb)
+{
+	struct us_data *us = urb->context;
+
+	if (urb == us->csw_urb || urb->status ||
+			(usb_pipein(urb->pipe) &&
+			 urb->transfer_buffer_length > US_BULK_CS_WRAP_LEN &&
+			 urb->actual_length == US_BULK_CS_WRAP_LEN))
+		complete(&us->bot_done);
+}
+
+static int usb_stor_Bulk_can_pipeline(struct us_data *us,
+		struct scsi_cmnd *srb)
+{
+	unsigned int pipe;
+
+	if (!bulk_pipeline || !us->csw_urb || (us->fflags & US_FL_GO_SLOW))
+		return 0;
+	if (us->phase_delay || us->delay_calibrating)
+		return 0;
+#ifdef MY_ABC_HERE
+	if (extra_delay)
+		return 0;
+#endif /* MY_ABC_HERE */
+	if (!scsi_bufflen(srb))
+		return 1;
+
+	/* The data stage goes out as a single scatter-gather URB */
+	if (srb->sc_data_direction == DMA_BIDIRECTIONAL)
+		return 0;
+	pipe = srb->sc_data_direction == DMA_FROM_DEVICE ?
+			us->recv_bulk_pipe : us->send_bulk_pipe;
+	return usb_stor_sg_one_urb(us, pipe, scsi_sglist(srb),
+			scsi_sg_count(srb));
+}
+
+/*
+ * Send the CBW already built in us->iobuf, transfer the data and read
+ * the CSW, all queued at once.  On US_BOT_CSW and US_BOT_SKIPPED the CSW
+ * is at the start of us->iobuf, as the synchronous code expects it.
+ */
+static int usb_stor_Bulk_pipeline(struct us_data *us, struct scsi_cmnd *srb,
+		unsigned int cbwlen, int *fake_sense, int *result,
+		unsigned int *cswlen)
+{
+	unsigned int transfer_length = scsi_bufflen(srb);
+	unsigned int pipe = srb->sc_data_direction == DMA_FROM_DEVICE ?
+			us->recv_bulk_pipe : us->send_bulk_pipe;
+	struct bulk_cs_wrap csw;
+	struct urb *urbs[3];
+	int n = 0, i, status, skipped = 0;
+	long left = (srb->request && srb->request->timeout) ?
+			srb->request->timeout : US_BOT_TIMEOUT;
+
+	/* don't submit URBs during abort processing */
+	if (test_bit(US_FLIDX_ABORTING, &us->dflags))
+		return US_BOT_ERROR;
+
+	reinit_completion(&us->bot_done);
+
+	usb_fill_bulk_urb(us->cbw_urb, us->pusb_dev, us->send_bulk_pipe,
+			us->iobuf, cbwlen, usb_stor_Bulk_pipeline_completion, us);
+	us->cbw_urb->transfer_dma = us->iobuf_dma;
+	us->cbw_urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP |
+			URB_NO_INTERRUPT;
+	urbs[n++] = us->cbw_urb;
+
+	if (transfer_length) {
+		usb_fill_bulk_urb(us->data_urb, us->pusb_dev, pipe, NULL,
+				transfer_length,
+				usb_stor_Bulk_pipeline_completion, us);
+		us->data_urb->sg = scsi_sglist(srb);
+		us->data_urb->num_sgs = scsi_sg_count(srb);
+		us->data_urb->transfer_flags = URB_NO_INTERRUPT;
+		urbs[n++] = us->data_urb;
+	}
+
+	usb_fill_bulk_urb(us->csw_urb, us->pusb_dev, us->recv_bulk_pipe,
+			us->iobuf + US_BULK_CS_OFFSET, US_BULK_CS_WRAP_LEN,
+			usb_stor_Bulk_pipeline_completion, us);
+	us->csw_urb->transfer_dma = us->iobuf_dma + US_BULK_CS_OFFSET;
+	us->csw_urb->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+	urbs[n++] = us->csw_urb;
+
+	for (i = 0; i < n; i++) {
+		usb_anchor_urb(urbs[i], &us->bot_anchor);
+		status = usb_submit_urb(urbs[i], GFP_NOIO);
+		if (status) {
+			usb_stor_dbg(us, "pipelined URB %d not submitted: %d\n",
+				     i, status);
+			usb_unanchor_urb(urbs[i]);
+			usb_kill_anchored_urbs(&us->bot_anchor);
+			return US_BOT_ERROR;
+		}
+	}
+
+	/* same protocol as usb_stor_msg_common() */
+	set_bit(US_FLIDX_BOT_ACTIVE, &us->dflags);
+	if (test_bit(US_FLIDX_ABORTING, &us->dflags)) {
+		if (test_and_clear_bit(US_FLIDX_BOT_ACTIVE, &us->dflags)) {
+			usb_stor_dbg(us, "-- cancelling pipelined URBs\n");
+			usb_stor_Bulk_pipeline_cancel(us);
+		}
+	}
+
+	for (;;) {
+		left = wait_for_completion_interruptible_timeout(&us->bot_done,
+				left);
+		if (left <= 0 || us->csw_urb->status != -EINPROGRESS)
+			break;
+		status = us->cbw_urb->status;
+		if (status && status != -EINPROGRESS)
+			break;
+		if (!transfer_length)
+			continue;
+
+		status = us->data_urb->status;
+		if (status == -EINPROGRESS)
+			continue;
+
+		/* A stalled data-out stage is still followed by a CSW */
+		if (status == -EPIPE && usb_pipeout(pipe))
+			continue;
+		if (status)
+			break;
+
+		/*
+		 * Sometimes a device will mistakenly skip the data phase
+		 * and go directly to the status phase without sending a
+		 * zero-length packet.  Then the CSW URB would wait forever.
+		 * As in usb_stor_Bulk_transport(), only a short read can be
+		 * such a CSW.
+		 */
+		if (usb_pipein(pipe) &&
+				transfer_length > US_BULK_CS_WRAP_LEN &&
+				us->data_urb->actual_length ==
+					US_BULK_CS_WRAP_LEN) {
+			struct scatterlist *sg = NULL;
+			unsigned int offset = 0;
+
+			if (usb_stor_access_xfer_buf((unsigned char *) &csw,
+					US_BULK_CS_WRAP_LEN, srb, &sg,
+					&offset, FROM_XFER_BUF) ==
+						US_BULK_CS_WRAP_LEN &&
+					csw.Signature ==
+						cpu_to_le32(US_BULK_CS_SIGN)) {
+				skipped = 1;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * After a good CSW everything else has finished on the bus and is
+	 * only waiting to be given back; otherwise cancel what is left.
+	 */
+	if (us->csw_urb->status == 0 && !skipped) {
+		if (!usb_wait_anchor_empty_timeout(&us->bot_anchor, 1000))
+			usb_kill_anchored_urbs(&us->bot_anchor);
+	} else {
+		usb_kill_anchored_urbs(&us->bot_anchor);
+	}
+	clear_bit(US_FLIDX_BOT_ACTIVE, &us->dflags);
+
+	/*
+	 * A device that never sends its CSW: report a transport error so
+	 * that usb_stor_invoke_transport() resets it, instead of reading
+	 * the CSW again synchronously.
+	 */
+	if (!left) {
+		usb_stor_dbg(us, "pipelined command timed out\n");
+		return US_BOT_ERROR;
+	}
+
+	usb_stor_dbg(us, "Bulk command transfer, pipelined\n");
+	if (interpret_urb_result(us, us->send_bulk_pipe, cbwlen,
+			us->cbw_urb->status, us->cbw_urb->actual_length) !=
+				USB_STOR_XFER_GOOD)
+		return US_BOT_ERROR;
+
+	if (transfer_length) {
+		if (skipped) {
+			usb_stor_dbg(us, "Device skipped data phase\n");
+			memcpy(us->iobuf, &csw, US_BULK_CS_WRAP_LEN);
+			scsi_set_resid(srb, transfer_length);
+			return US_BOT_SKIPPED;
+		}
+
+		us->sg_single++;
+		us->sg_urbs++;
+		us->sg_bytes += us->data_urb->actual_length;
+
+		scsi_set_resid(srb, transfer_length -
+				us->data_urb->actual_length);
+		status = interpret_urb_result(us, pipe, transfer_length,
+				us->data_urb->status,
+				us->data_urb->actual_length);
+		usb_stor_dbg(us, "Bulk data transfer result 0x%x\n", status);
+		if (status == USB_STOR_XFER_ERROR)
+			return US_BOT_ERROR;
+		if (status == USB_STOR_XFER_LONG)
+			*fake_sense = 1;
+	}
+
+	/* We cancelled the CSW behind a failed data stage */
+	if (us->csw_urb->status == -ENOENT)
+		return US_BOT_NEED_CSW;
+
+	*cswlen = us->csw_urb->actual_length;
+	memcpy(us->iobuf, us->iobuf + US_BULK_CS_OFFSET, US_BULK_CS_WRAP_LEN);
+	*result = interpret_urb_result(us, us->recv_bulk_pipe,
+			US_BULK_CS_WRAP_LEN, us->csw_urb->status, *cswlen);
+	return US_BOT_CSW;
+}
+
 int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 {
 	struct bulk_cb_wrap *bcb = (struct bulk_cb_wrap *) us->iobuf;
@@ -1130,6 +1572,7 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 	int fake_sense = 0;
 	unsigned int cswlen;
 	unsigned int cbwlen = US_BULK_CB_WRAP_LEN;
+	ktime_t start;
 
 	/* Take care of BULK32 devices; set extra byte to 0 */
 	if (unlikely(us->fflags & US_FL_BULK32)) {
@@ -1158,8 +1601,32 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 		     le32_to_cpu(bcb->DataTransferLength), bcb->Flags,
 		     (bcb->Lun >> 4), (bcb->Lun & 0x0F),
 		     bcb->Length);
+
+	if (usb_stor_Bulk_can_pipeline(us, srb)) {
+		int ret;
+
+		start = ktime_get();
+		ret = usb_stor_Bulk_pipeline(us, srb, cbwlen, &fake_sense,
+				&result, &cswlen);
+		usb_stor_stats_phase(&us->stats, US_PHASE_PIPELINE, start,
+				ret == US_BOT_ERROR);
+		switch (ret) {
+		case US_BOT_CSW:
+			goto csw_received;
+		case US_BOT_NEED_CSW:
+			goto get_csw;
+		case US_BOT_SKIPPED:
+			goto skipped_data_phase;
+		default:
+			return USB_STOR_TRANSPORT_ERROR;
+		}
+	}
+
+	start = ktime_get();
 	result = usb_stor_bulk_transfer_buf(us, us->send_bulk_pipe,
 				bcb, cbwlen, NULL);
+	usb_stor_stats_phase(&us->stats, US_PHASE_CBW, start,
+			result != USB_STOR_XFER_GOOD);
 #ifdef MY_ABC_HERE
 	usb_stor_delay(us);
 #endif /* MY_ABC_HERE */
@@ -1179,7 +1646,10 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 	if (transfer_length) {
 		unsigned int pipe = srb->sc_data_direction == DMA_FROM_DEVICE ? 
 				us->recv_bulk_pipe : us->send_bulk_pipe;
+		start = ktime_get();
 		result = usb_stor_bulk_srb(us, pipe, srb);
+		usb_stor_stats_phase(&us->stats, US_PHASE_DATA, start,
+				result == USB_STOR_XFER_ERROR);
 #ifdef MY_ABC_HERE
 		usb_stor_delay(us);
 #endif /* MY_ABC_HERE */
@@ -1227,21 +1697,30 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 	 */
 
 	/* get CSW for device status */
+ get_csw:
 	usb_stor_dbg(us, "Attempting to get CSW...\n");
+	start = ktime_get();
 	result = usb_stor_bulk_transfer_buf(us, us->recv_bulk_pipe,
 				bcs, US_BULK_CS_WRAP_LEN, &cswlen);
+	usb_stor_stats_phase(&us->stats, US_PHASE_CSW, start,
+			result != USB_STOR_XFER_GOOD);
 #ifdef MY_ABC_HERE
 	usb_stor_delay(us);
 #endif /* MY_ABC_HERE */
 
+ csw_received:
+
 	/* Some broken devices add unnecessary zero-length packets to the
 	 * end of their data transfers.  Such packets show up as 0-length
 	 * CSWs.  If we encounter such a thing, try to read the CSW again.
 	 */
 	if (result == USB_STOR_XFER_SHORT && cswlen == 0) {
 		usb_stor_dbg(us, "Received 0-length CSW; retrying...\n");
+		start = ktime_get();
 		result = usb_stor_bulk_transfer_buf(us, us->recv_bulk_pipe,
 				bcs, US_BULK_CS_WRAP_LEN, &cswlen);
+		usb_stor_stats_phase(&us->stats, US_PHASE_CSW_RETRY, start,
+				result != USB_STOR_XFER_GOOD);
 #ifdef MY_ABC_HERE
 		usb_stor_delay(us);
 #endif /* MY_ABC_HERE */
@@ -1252,8 +1731,11 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 
 		/* get the status again */
 		usb_stor_dbg(us, "Attempting to get CSW (2nd try)...\n");
+		start = ktime_get();
 		result = usb_stor_bulk_transfer_buf(us, us->recv_bulk_pipe,
 				bcs, US_BULK_CS_WRAP_LEN, NULL);
+		usb_stor_stats_phase(&us->stats, US_PHASE_CSW_RETRY, start,
+				result != USB_STOR_XFER_GOOD);
 #ifdef MY_ABC_HERE
 		usb_stor_delay(us);
 #endif /* MY_ABC_HERE */
@@ -1309,6 +1791,7 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 			us->fflags |= US_FL_IGNORE_RESIDUE;
 
 		} else {
+			us->stats.residue_fixups++;
 			residue = min(residue, transfer_length);
 			scsi_set_resid(srb, max(scsi_get_resid(srb),
 			                                       (int) residue));
@@ -1337,6 +1820,7 @@ int usb_stor_Bulk_transport(struct scsi_cmnd *srb, struct us_data *us)
 			/* phase error -- note that a transport reset will be
 			 * invoked by the invoke_transport() function
 			 */
+			us->stats.phase_errors++;
 			return USB_STOR_TRANSPORT_ERROR;
 	}
 